@@ -0,0 +1,253 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_lib.h>
+
+#include "bench_flb.h"
+
+/* The loop checks the end of the run at least this often */
+#define BENCH_FLB_TICK_NS 100000000
+
+struct bench_flb_chunks bench_flb_chunks;
+
+/*
+ * Takes the place of the function of Fluent Bit for the benchmarks, which
+ * link the plugin sources against the shared library: the records are
+ * counted and dropped.
+ */
+int flb_input_chunk_append_raw(struct flb_input_instance *in,
+                               const char *tag, size_t tag_len,
+                               const void *buf, size_t buf_size)
+{
+    bench_flb_chunks.appends++;
+    bench_flb_chunks.bytes += buf_size;
+    if (bench_flb_chunks.cb) {
+        bench_flb_chunks.cb(buf, buf_size, bench_flb_chunks.data);
+    }
+
+    return 0;
+}
+
+#ifdef BENCH_FLB_ALLOCS
+static uint64_t allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/*
+ * Take the place of the allocator entry points of the C library, for the
+ * plugins, Fluent Bit and libmodbus alike, and count the calls.
+ */
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+uint64_t bench_flb_allocs(void)
+{
+    return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+#else
+uint64_t bench_flb_allocs(void)
+{
+    return 0;
+}
+#endif
+
+uint64_t bench_flb_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int bench_flb_init(struct bench_flb *b)
+{
+    memset(b, 0, sizeof(struct bench_flb));
+
+    flb_init_env();
+    b->config = flb_config_init();
+    if (b->config == NULL) {
+        return -1;
+    }
+
+    /* Created by the engine otherwise */
+    b->config->evl = mk_event_loop_create(256);
+    if (b->config->evl == NULL) {
+        return -1;
+    }
+
+    MK_EVENT_NEW(&b->tick);
+    b->tick_fd = mk_event_timeout_create(b->config->evl, 0,
+                                         BENCH_FLB_TICK_NS, &b->tick);
+    if (b->tick_fd == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Split "key=value" properties, -1 for a malformed one */
+static int split_prop(const char *prop, char *key, size_t size,
+                      const char **val)
+{
+    const char *eq;
+
+    eq = strchr(prop, '=');
+    if (eq == NULL || eq == prop || (size_t) (eq - prop) >= size) {
+        fprintf(stderr, "Invalid property %s, has to be key=value\n", prop);
+        return -1;
+    }
+
+    memcpy(key, prop, eq - prop);
+    key[eq - prop] = '\0';
+    *val = eq + 1;
+
+    return 0;
+}
+
+/*
+ * Register an input plugin built into the benchmark, create an instance
+ * with the given properties and initialize it.
+ */
+struct flb_input_instance *bench_flb_input(struct bench_flb *b,
+                                           struct flb_input_plugin *plugin,
+                                           char **props, int nprops)
+{
+    int i;
+    char key[64];
+    const char *val;
+    struct flb_input_instance *ins;
+
+    mk_list_add(&plugin->_head, &b->config->in_plugins);
+
+    ins = flb_input_new(b->config, plugin->name, NULL, FLB_TRUE);
+    if (ins == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < nprops; i++) {
+        if (split_prop(props[i], key, sizeof(key), &val) == -1 ||
+            flb_input_set_property(ins, key, val) == -1) {
+            return NULL;
+        }
+    }
+
+    if (plugin->cb_init(ins, b->config, NULL) != 0) {
+        return NULL;
+    }
+
+    return ins;
+}
+
+struct flb_output_instance *bench_flb_output(struct bench_flb *b,
+                                             struct flb_output_plugin *plugin,
+                                             char **props, int nprops)
+{
+    int i;
+    char key[64];
+    const char *val;
+    struct flb_output_instance *ins;
+
+    mk_list_add(&plugin->_head, &b->config->out_plugins);
+
+    ins = flb_output_new(b->config, plugin->name, NULL);
+    if (ins == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < nprops; i++) {
+        if (split_prop(props[i], key, sizeof(key), &val) == -1 ||
+            flb_output_set_property(ins, key, val) == -1) {
+            return NULL;
+        }
+    }
+
+    if (plugin->cb_init(ins, b->config, NULL) != 0) {
+        return NULL;
+    }
+
+    return ins;
+}
+
+/*
+ * Run the collectors of the input instances for 'duration_ms', the way
+ * the engine does: timers and file descriptors go through the input
+ * interface, custom events (async transport) to their own handler.
+ */
+int bench_flb_run(struct bench_flb *b, uint64_t duration_ms)
+{
+    uint64_t end;
+    uint64_t val;
+    struct mk_event *event;
+    struct mk_event_loop *evl = b->config->evl;
+
+    if (!b->started) {
+        if (flb_input_collectors_start(b->config) == -1) {
+            return -1;
+        }
+        b->started = 1;
+    }
+
+    end = bench_flb_time_us() + duration_ms * 1000;
+    while (bench_flb_time_us() < end) {
+        mk_event_wait(evl);
+        mk_event_foreach(event, evl) {
+            if (event == &b->tick) {
+                if (read(b->tick_fd, &val, sizeof(val)) <= 0) {
+                    return -1;
+                }
+            }
+            else if (event->type == FLB_ENGINE_EV_CORE) {
+                flb_input_collector_fd(event->fd, b->config);
+            }
+            else if (event->type == FLB_ENGINE_EV_CUSTOM) {
+                event->handler(event);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_MODBUS_BENCH_FLB_H
+#define FLB_MODBUS_BENCH_FLB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_output.h>
+
+/*
+ * Minimal Fluent Bit runtime for the benchmarks: a configuration, the
+ * plugin instances under test and an event loop running their collectors,
+ * without the engine, the storage or any output of the records.
+ */
+struct bench_flb {
+    struct flb_config *config;
+    struct mk_event tick;       /* wakes the loop up to check the time */
+    int tick_fd;
+    int started;                /* collectors */
+};
+
+/* Chunks appended by input instances, instead of buffering them */
+struct bench_flb_chunks {
+    uint64_t appends;
+    uint64_t bytes;
+
+    /* Optional, called with every chunk */
+    void (*cb)(const void *buf, size_t size, void *data);
+    void *data;
+};
+
+extern struct bench_flb_chunks bench_flb_chunks;
+
+/*
+ * Heap allocations of the whole process (malloc, calloc and realloc), on
+ * glibc where they can be hooked.
+ */
+#ifdef __GLIBC__
+#define BENCH_FLB_ALLOCS
+#endif
+
+uint64_t bench_flb_allocs(void);
+
+int bench_flb_init(struct bench_flb *b);
+struct flb_input_instance *bench_flb_input(struct bench_flb *b,
+                                           struct flb_input_plugin *plugin,
+                                           char **props, int nprops);
+struct flb_output_instance *bench_flb_output(struct bench_flb *b,
+                                             struct flb_output_plugin *plugin,
+                                             char **props, int nprops);
+int bench_flb_run(struct bench_flb *b, uint64_t duration_ms);
+uint64_t bench_flb_time_us(void);
+
+#endif
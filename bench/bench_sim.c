@@ -0,0 +1,408 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "bench_sim.h"
+
+void bench_sim_init(struct bench_sim *sim)
+{
+    memset(sim, 0, sizeof(struct bench_sim));
+    sim->backend = BENCH_SIM_TCP;
+    sim->unit_id = 1;
+    sim->points = 1000;
+    sim->fd = -1;
+    sim->tty = -1;
+    sim->stop[0] = -1;
+    sim->stop[1] = -1;
+    sim->seed = 1;
+}
+
+/* Settings by name, -1 when the key or the value is unknown */
+int bench_sim_set(struct bench_sim *sim, const char *key, const char *val)
+{
+    int n;
+
+    if (strcmp(key, "backend") == 0) {
+        if (strcmp(val, "tcp") == 0) {
+            sim->backend = BENCH_SIM_TCP;
+        }
+        else if (strcmp(val, "rtu") == 0) {
+            sim->backend = BENCH_SIM_RTU;
+        }
+        else {
+            return -1;
+        }
+        return 0;
+    }
+
+    n = atoi(val);
+    if (n < 0) {
+        return -1;
+    }
+    if (strcmp(key, "port") == 0) {
+        sim->port = n;
+    }
+    else if (strcmp(key, "unit_id") == 0) {
+        sim->unit_id = n;
+    }
+    else if (strcmp(key, "points") == 0) {
+        sim->points = n > 65536 ? 65536 : n;
+    }
+    else if (strcmp(key, "latency_us") == 0) {
+        sim->latency_us = n;
+    }
+    else if (strcmp(key, "jitter_us") == 0) {
+        sim->jitter_us = n;
+    }
+    else if (strcmp(key, "exception_pct") == 0) {
+        sim->exception_pct = n;
+    }
+    else if (strcmp(key, "drop_pct") == 0) {
+        sim->drop_pct = n;
+    }
+    else if (strcmp(key, "change_pct") == 0) {
+        sim->change_pct = n;
+    }
+    else if (strcmp(key, "seed") == 0) {
+        sim->seed = n;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int chance(struct bench_sim *sim, int pct)
+{
+    return pct > 0 && rand_r(&sim->seed) % 100 < pct;
+}
+
+/* Move a share of the values, as a process would between two polls */
+static void change_values(struct bench_sim *sim)
+{
+    int i;
+    int n;
+    int pos;
+    modbus_mapping_t *map = sim->map;
+
+    n = (int) ((int64_t) sim->points * sim->change_pct / 100);
+    for (i = 0; i < n; i++) {
+        pos = rand_r(&sim->seed) % sim->points;
+        map->tab_registers[pos] = rand_r(&sim->seed);
+        map->tab_input_registers[pos] = rand_r(&sim->seed);
+        map->tab_bits[pos] ^= 1;
+        map->tab_input_bits[pos] ^= 1;
+    }
+}
+
+/* Answer one request read from fd, -1 when the peer is gone */
+static int serve(struct bench_sim *sim, int fd)
+{
+    int len;
+    int delay;
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    modbus_set_socket(sim->mb, fd);
+    len = modbus_receive(sim->mb, query);
+    if (len == -1) {
+        /* A broken frame on the serial line is only skipped */
+        return sim->backend == BENCH_SIM_TCP ? -1 : 0;
+    }
+    if (len == 0) {
+        /* Addressed to another slave */
+        return 0;
+    }
+
+    __atomic_add_fetch(&sim->requests, 1, __ATOMIC_RELAXED);
+
+    if (chance(sim, sim->drop_pct)) {
+        return 0;
+    }
+
+    delay = sim->latency_us;
+    if (sim->jitter_us > 0) {
+        delay += rand_r(&sim->seed) % (sim->jitter_us + 1);
+    }
+    if (delay > 0) {
+        usleep(delay);
+    }
+
+    if (sim->change_pct > 0) {
+        change_values(sim);
+    }
+
+    if (chance(sim, sim->exception_pct)) {
+        modbus_reply_exception(sim->mb, query,
+                               MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    }
+    else {
+        modbus_reply(sim->mb, query, len, sim->map);
+    }
+
+    return 0;
+}
+
+static void accept_client(struct bench_sim *sim)
+{
+    int i;
+    int fd;
+
+    fd = accept(sim->fd, NULL, NULL);
+    if (fd == -1) {
+        return;
+    }
+
+    for (i = 0; i < BENCH_SIM_CLIENTS; i++) {
+        if (sim->clients[i] == -1) {
+            sim->clients[i] = fd;
+            return;
+        }
+    }
+
+    fprintf(stderr, "[bench_sim] Too many clients, closing a connection\n");
+    close(fd);
+}
+
+static void *sim_run(void *data)
+{
+    int i;
+    int ret;
+    int maxfd;
+    fd_set rfds;
+    struct bench_sim *sim = data;
+
+    while (1) {
+        FD_ZERO(&rfds);
+        FD_SET(sim->stop[0], &rfds);
+        FD_SET(sim->fd, &rfds);
+        maxfd = sim->stop[0] > sim->fd ? sim->stop[0] : sim->fd;
+        for (i = 0; i < BENCH_SIM_CLIENTS; i++) {
+            if (sim->clients[i] != -1) {
+                FD_SET(sim->clients[i], &rfds);
+                if (sim->clients[i] > maxfd) {
+                    maxfd = sim->clients[i];
+                }
+            }
+        }
+
+        ret = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[bench_sim] select");
+            break;
+        }
+        if (FD_ISSET(sim->stop[0], &rfds)) {
+            break;
+        }
+
+        if (sim->backend == BENCH_SIM_RTU) {
+            if (FD_ISSET(sim->fd, &rfds)) {
+                serve(sim, sim->fd);
+            }
+            continue;
+        }
+
+        if (FD_ISSET(sim->fd, &rfds)) {
+            accept_client(sim);
+        }
+        for (i = 0; i < BENCH_SIM_CLIENTS; i++) {
+            if (sim->clients[i] != -1 && FD_ISSET(sim->clients[i], &rfds) &&
+                serve(sim, sim->clients[i]) == -1) {
+                close(sim->clients[i]);
+                sim->clients[i] = -1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int start_tcp(struct bench_sim *sim)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    sim->mb = modbus_new_tcp("127.0.0.1", sim->port);
+    if (sim->mb == NULL) {
+        return -1;
+    }
+
+    sim->fd = modbus_tcp_listen(sim->mb, BENCH_SIM_CLIENTS);
+    if (sim->fd == -1) {
+        fprintf(stderr, "[bench_sim] Cannot listen on port %d: %s\n",
+                sim->port, modbus_strerror(errno));
+        return -1;
+    }
+
+    /* Port picked by the system */
+    if (getsockname(sim->fd, (struct sockaddr *) &addr, &len) == -1) {
+        return -1;
+    }
+    sim->port = ntohs(addr.sin_port);
+
+    return 0;
+}
+
+/*
+ * The slave answers on the master side of a pseudo terminal, and the
+ * plugins open the slave side as their serial line.
+ */
+static int start_rtu(struct bench_sim *sim)
+{
+    struct termios tio;
+
+    sim->fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->fd == -1 || grantpt(sim->fd) == -1 || unlockpt(sim->fd) == -1 ||
+        ptsname_r(sim->fd, sim->device, sizeof(sim->device)) != 0) {
+        perror("[bench_sim] pty");
+        return -1;
+    }
+
+    sim->tty = open(sim->device, O_RDWR | O_NOCTTY);
+    if (sim->tty == -1) {
+        perror("[bench_sim] open");
+        return -1;
+    }
+
+    /* No echo or line editing before the plugin sets the line up */
+    if (tcgetattr(sim->tty, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(sim->tty, TCSANOW, &tio);
+    }
+    if (tcgetattr(sim->fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(sim->fd, TCSANOW, &tio);
+    }
+
+    sim->mb = modbus_new_rtu(sim->device, 115200, 'N', 8, 1);
+    if (sim->mb == NULL) {
+        return -1;
+    }
+    modbus_set_slave(sim->mb, sim->unit_id);
+
+    return 0;
+}
+
+int bench_sim_start(struct bench_sim *sim)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < BENCH_SIM_CLIENTS; i++) {
+        sim->clients[i] = -1;
+    }
+
+    sim->map = modbus_mapping_new(sim->points, sim->points,
+                                  sim->points, sim->points);
+    if (sim->map == NULL) {
+        return -1;
+    }
+    for (i = 0; i < sim->points; i++) {
+        sim->map->tab_bits[i] = i & 1;
+        sim->map->tab_input_bits[i] = (i >> 1) & 1;
+        sim->map->tab_registers[i] = i;
+        sim->map->tab_input_registers[i] = 65535 - i;
+    }
+
+    if (sim->backend == BENCH_SIM_TCP) {
+        ret = start_tcp(sim);
+    }
+    else {
+        ret = start_rtu(sim);
+    }
+    if (ret == -1 || pipe(sim->stop) == -1) {
+        bench_sim_stop(sim);
+        return -1;
+    }
+
+    if (pthread_create(&sim->thread, NULL, sim_run, sim) != 0) {
+        bench_sim_stop(sim);
+        return -1;
+    }
+    sim->running = 1;
+
+    return 0;
+}
+
+void bench_sim_stop(struct bench_sim *sim)
+{
+    int i;
+
+    if (sim->running) {
+        if (write(sim->stop[1], "x", 1) == 1) {
+            pthread_join(sim->thread, NULL);
+        }
+        sim->running = 0;
+    }
+    if (sim->stop[1] != -1) {
+        close(sim->stop[0]);
+        close(sim->stop[1]);
+        sim->stop[0] = -1;
+        sim->stop[1] = -1;
+    }
+
+    for (i = 0; i < BENCH_SIM_CLIENTS; i++) {
+        if (sim->clients[i] != -1) {
+            close(sim->clients[i]);
+            sim->clients[i] = -1;
+        }
+    }
+    if (sim->fd != -1) {
+        close(sim->fd);
+        sim->fd = -1;
+    }
+    if (sim->tty != -1) {
+        close(sim->tty);
+        sim->tty = -1;
+    }
+
+    if (sim->mb) {
+        /* Every socket it used is closed above */
+        modbus_set_socket(sim->mb, -1);
+        modbus_free(sim->mb);
+        sim->mb = NULL;
+    }
+    if (sim->map) {
+        modbus_mapping_free(sim->map);
+        sim->map = NULL;
+    }
+}
+
+uint64_t bench_sim_requests(struct bench_sim *sim)
+{
+    return __atomic_load_n(&sim->requests, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_MODBUS_BENCH_SIM_H
+#define FLB_MODBUS_BENCH_SIM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <modbus.h>
+
+enum {
+    BENCH_SIM_TCP = 0,
+    BENCH_SIM_RTU
+};
+
+/* Most TCP clients served at once */
+#define BENCH_SIM_CLIENTS 16
+
+/*
+ * Simulated Modbus slave answering from its own thread, over TCP on the
+ * loopback or over RTU on a pseudo terminal. Responses can be delayed,
+ * answered with an exception or dropped to measure the plugins against a
+ * slow or faulty device.
+ */
+struct bench_sim {
+    int backend;
+    int port;           /* tcp, 0 for any free port */
+    int unit_id;        /* rtu, requests to other slaves are ignored */
+    int points;         /* coils, discrete inputs and registers */
+
+    /* Response delay: latency_us plus up to jitter_us */
+    int latency_us;
+    int jitter_us;
+
+    /* Requests answered with "Slave busy" or left unanswered */
+    int exception_pct;
+    int drop_pct;
+
+    /* Share of the registers and bits changed before each response */
+    int change_pct;
+
+    /* Set when started: pty to open as the serial line (rtu) */
+    char device[PATH_MAX];
+
+    /* Requests received, read by the benchmarks */
+    uint64_t requests;
+
+    modbus_t *mb;
+    modbus_mapping_t *map;
+    int fd;             /* listening socket (tcp) or pty master (rtu) */
+    int tty;            /* pty slave, kept open so reads never see EIO */
+    int clients[BENCH_SIM_CLIENTS];
+    int stop[2];
+    unsigned int seed;
+    int running;
+    pthread_t thread;
+};
+
+void bench_sim_init(struct bench_sim *sim);
+int bench_sim_set(struct bench_sim *sim, const char *key, const char *val);
+int bench_sim_start(struct bench_sim *sim);
+void bench_sim_stop(struct bench_sim *sim);
+uint64_t bench_sim_requests(struct bench_sim *sim);
+
+#endif
@@ -0,0 +1,164 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+/*
+ * Writes and mask writes to the same registers in one chunk: the slave
+ * has to end up as if the records were sent one by one, in chunk order,
+ * with and without deduplication and the shadow of the written values.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <msgpack.h>
+
+#include <fluent-bit/flb_time.h>
+
+#include "bench_flb.h"
+#include "bench_sim.h"
+#include "out_modbus.h"
+
+extern struct flb_output_plugin out_modbus_plugin;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            return 1;                                                   \
+        }                                                               \
+    } while (0)
+
+static void pack_str(msgpack_packer *mp_pck, const char *str)
+{
+    msgpack_pack_str(mp_pck, strlen(str));
+    msgpack_pack_str_body(mp_pck, str, strlen(str));
+}
+
+/* [time, {key: [{"address": addr, k1: v1, k2: v2}]}] */
+static void pack_record(msgpack_packer *mp_pck, const char *key, int addr,
+                        const char *k1, int v1, const char *k2, int v2)
+{
+    struct flb_time tm;
+
+    flb_time_get(&tm);
+    msgpack_pack_array(mp_pck, 2);
+    flb_time_append_to_msgpack(&tm, mp_pck, 0);
+    msgpack_pack_map(mp_pck, 1);
+    pack_str(mp_pck, key);
+    msgpack_pack_array(mp_pck, 1);
+    msgpack_pack_map(mp_pck, k2 ? 3 : 2);
+    pack_str(mp_pck, "address");
+    msgpack_pack_uint16(mp_pck, addr);
+    pack_str(mp_pck, k1);
+    msgpack_pack_uint16(mp_pck, v1);
+    if (k2) {
+        pack_str(mp_pck, k2);
+        msgpack_pack_uint16(mp_pck, v2);
+    }
+}
+
+static void pack_write(msgpack_packer *mp_pck, int addr, int value)
+{
+    pack_record(mp_pck, "holding_registers", addr, "value", value, NULL, 0);
+}
+
+static void pack_mask(msgpack_packer *mp_pck, int addr, int and_mask,
+                      int or_mask)
+{
+    pack_record(mp_pck, "mask_write_registers", addr, "and_mask", and_mask,
+                "or_mask", or_mask);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int v;
+    char port[32];
+    char *props[] = {
+        "address=127.0.0.1",
+        port,
+        NULL,
+    };
+    const char *options[] = { "dedup=off", "dedup=on", "shadow=on" };
+    msgpack_sbuffer sbuf;
+    msgpack_packer mp_pck;
+    struct bench_sim sim;
+    struct bench_flb flb;
+    struct flb_output_instance *ins;
+    struct flb_out_modbus_config *ctx;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_sim_init(&sim);
+    sim.points = 4;
+    CHECK(bench_sim_start(&sim) == 0);
+    snprintf(port, sizeof(port), "tcp_port=%d", sim.port);
+    CHECK(bench_flb_init(&flb) == 0);
+
+    /*
+     * Register 0 is masked then written, 2 written, masked and written
+     * again, 1 written twice then masked. Sending the writes before the
+     * masks leaves 0x1234 in register 0 and 0x0103 in register 2.
+     */
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&mp_pck, &sbuf, msgpack_sbuffer_write);
+    pack_write(&mp_pck, 2, 1);
+    pack_write(&mp_pck, 1, 0x00f0);
+    pack_mask(&mp_pck, 0, 0x0000, 0x1234);
+    pack_write(&mp_pck, 0, 7);
+    pack_write(&mp_pck, 1, 8);
+    pack_mask(&mp_pck, 2, 0x00ff, 0x0100);
+    pack_write(&mp_pck, 2, 3);
+    pack_mask(&mp_pck, 1, 0xff00, 0x000f);
+
+    for (v = 0; v < (int) (sizeof(options) / sizeof(options[0])); v++) {
+        for (i = 0; i < sim.points; i++) {
+            sim.map->tab_registers[i] = i;
+        }
+
+        props[2] = (char *) options[v];
+        ins = bench_flb_output(&flb, &out_modbus_plugin, props,
+                               sizeof(props) / sizeof(props[0]));
+        CHECK(ins != NULL);
+        ctx = ins->context;
+
+        CHECK(out_modbus_flush_chunk(ctx, sbuf.data, sbuf.size) == FLB_OK);
+        if (sim.map->tab_registers[0] != 7 ||
+            sim.map->tab_registers[1] != 0x000f ||
+            sim.map->tab_registers[2] != 3) {
+            fprintf(stderr, "%s: registers 0x%04x 0x%04x 0x%04x, expected "
+                    "0x0007 0x000f 0x0003\n", options[v],
+                    sim.map->tab_registers[0], sim.map->tab_registers[1],
+                    sim.map->tab_registers[2]);
+            return 1;
+        }
+
+        out_modbus_plugin.cb_exit(ctx, flb.config);
+    }
+
+    msgpack_sbuffer_destroy(&sbuf);
+    bench_sim_stop(&sim);
+
+    return 0;
+}
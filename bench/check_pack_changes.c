@@ -0,0 +1,156 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+/*
+ * Report by exception with two plans of the same type, one read and
+ * changed, the other failing: the record has to carry the type once,
+ * with the changed register and the error, and be valid msgpack.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "bench_flb.h"
+#include "bench_sim.h"
+#include "in_modbus.h"
+#include "in_modbus_device.h"
+
+extern struct flb_input_plugin in_modbus_plugin;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            return 1;                                                   \
+        }                                                               \
+    } while (0)
+
+static int str_is(msgpack_object *obj, const char *str)
+{
+    return obj->type == MSGPACK_OBJECT_STR &&
+           obj->via.str.size == strlen(str) &&
+           memcmp(obj->via.str.ptr, str, obj->via.str.size) == 0;
+}
+
+/* Scan the slave and pack its record on its own into 'sbuf' */
+static void scan(struct flb_in_modbus_config *ctx,
+                 struct in_modbus_device *dev, uint64_t n,
+                 msgpack_sbuffer *sbuf)
+{
+    msgpack_packer mp_pck;
+
+    msgpack_sbuffer_clear(sbuf);
+    msgpack_packer_init(&mp_pck, sbuf, msgpack_sbuffer_write);
+
+    in_modbus_collect_device(ctx, dev, ctx->buf, n);
+    in_modbus_pack_device(ctx, dev, ctx->buf, n, &mp_pck);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    size_t off = 0;
+    char port[32];
+    char *props[] = {
+        "address=127.0.0.1",
+        port,
+        "report_by_exception=on",
+        "time_interval_ms=100",
+        "holding_reg_blocks=0:2@100,10:2@200",
+        "reconnect_min_ms=10",
+    };
+    msgpack_sbuffer sbuf;
+    msgpack_unpacked result;
+    msgpack_object *map;
+    msgpack_object *regs;
+    struct bench_sim sim;
+    struct bench_flb flb;
+    struct flb_input_instance *ins;
+    struct flb_in_modbus_config *ctx;
+    struct in_modbus_device *dev;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Registers 10 and 11 do not exist, their plan always fails */
+    bench_sim_init(&sim);
+    sim.points = 5;
+    CHECK(bench_sim_start(&sim) == 0);
+    snprintf(port, sizeof(port), "tcp_port=%d", sim.port);
+
+    CHECK(bench_flb_init(&flb) == 0);
+    ins = bench_flb_input(&flb, &in_modbus_plugin, props,
+                          sizeof(props) / sizeof(props[0]));
+    CHECK(ins != NULL);
+    ctx = ins->context;
+    CHECK(ctx->nplans == 2);
+    dev = mk_list_entry_first(&ctx->devices, struct in_modbus_device, _head);
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_unpacked_init(&result);
+
+    /* Both plans are due on scan 0, which sends the integrity record */
+    scan(ctx, dev, 0, &sbuf);
+    CHECK(msgpack_unpack_next(&result, sbuf.data, sbuf.size, &off) ==
+          MSGPACK_UNPACK_SUCCESS);
+    CHECK(off == sbuf.size);
+
+    /* Both due again on scan 2, with register 0 moved */
+    sim.map->tab_registers[0] += 1;
+    scan(ctx, dev, 2, &sbuf);
+
+    off = 0;
+    CHECK(msgpack_unpack_next(&result, sbuf.data, sbuf.size, &off) ==
+          MSGPACK_UNPACK_SUCCESS);
+    CHECK(off == sbuf.size);
+
+    CHECK(result.data.type == MSGPACK_OBJECT_ARRAY);
+    CHECK(result.data.via.array.size == 2);
+    map = &result.data.via.array.ptr[1];
+    CHECK(map->type == MSGPACK_OBJECT_MAP);
+    CHECK(map->via.map.size == 1);
+    CHECK(str_is(&map->via.map.ptr[0].key, "holding_registers"));
+
+    regs = &map->via.map.ptr[0].val;
+    CHECK(regs->type == MSGPACK_OBJECT_MAP);
+    CHECK(regs->via.map.size == 2);
+    for (i = 0; i < 2; i++) {
+        if (str_is(&regs->via.map.ptr[i].key, "0")) {
+            CHECK(regs->via.map.ptr[i].val.type ==
+                  MSGPACK_OBJECT_POSITIVE_INTEGER);
+            CHECK(regs->via.map.ptr[i].val.via.u64 == 1);
+        }
+        else {
+            CHECK(str_is(&regs->via.map.ptr[i].key, "error"));
+            CHECK(regs->via.map.ptr[i].val.type == MSGPACK_OBJECT_STR);
+        }
+    }
+
+    msgpack_unpacked_destroy(&result);
+    msgpack_sbuffer_destroy(&sbuf);
+    in_modbus_plugin.cb_exit(ctx, flb.config);
+    bench_sim_stop(&sim);
+
+    return 0;
+}
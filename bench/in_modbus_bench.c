@@ -0,0 +1,198 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+/*
+ * Poll the simulated slave with in_modbus for a while and report the
+ * reads per second, the scan latencies, the allocations per scan and the
+ * msgpack bytes per point. Arguments are key=value: 'duration' (seconds),
+ * 'sim.*' settings of the simulator and properties of the instance.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "bench_flb.h"
+#include "bench_sim.h"
+#include "in_modbus.h"
+#include "in_modbus_stats.h"
+
+#define MAX_PROPS 128
+
+extern struct flb_input_plugin in_modbus_plugin;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [duration=S] [sim.KEY=VALUE...] [PROPERTY=VALUE...]\n"
+            "  e.g. %s duration=5 sim.latency_us=200 holding_reg_no=500 "
+            "time_interval_ms=10\n", prog, prog);
+}
+
+static int has_prop(char **props, int nprops, const char *key)
+{
+    int i;
+    size_t len = strlen(key);
+
+    for (i = 0; i < nprops; i++) {
+        if (strncmp(props[i], key, len) == 0 && props[i][len] == '=') {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static char *prop(const char *key, const char *val)
+{
+    char *ret;
+
+    ret = malloc(strlen(key) + strlen(val) + 2);
+    if (ret) {
+        sprintf(ret, "%s=%s", key, val);
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int nprops = 0;
+    int duration = 10;
+    char *val;
+    char num[16];
+    char *props[MAX_PROPS];
+    uint64_t exceptions = 0;
+    uint64_t requests;
+    uint64_t allocs;
+    double secs;
+    struct bench_sim sim;
+    struct bench_flb flb;
+    struct flb_input_instance *ins;
+    struct flb_in_modbus_config *ctx;
+    struct in_modbus_stats *stats;
+
+    bench_sim_init(&sim);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Measured on every scan, whatever the arguments */
+    props[nprops++] = "stats=on";
+
+    for (i = 1; i < argc; i++) {
+        val = strchr(argv[i], '=');
+        if (val == NULL || nprops >= MAX_PROPS - 4) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(argv[i], "duration=", 9) == 0) {
+            duration = atoi(val + 1);
+        }
+        else if (strncmp(argv[i], "sim.", 4) == 0) {
+            *val = '\0';
+            if (bench_sim_set(&sim, argv[i] + 4, val + 1) == -1) {
+                fprintf(stderr, "Invalid setting %s=%s\n", argv[i], val + 1);
+                return 1;
+            }
+        }
+        else {
+            props[nprops++] = argv[i];
+        }
+    }
+
+    if (bench_sim_start(&sim) == -1) {
+        fprintf(stderr, "Cannot start the simulated slave\n");
+        return 1;
+    }
+
+    /* Point the instance at the simulator */
+    if (sim.backend == BENCH_SIM_TCP) {
+        snprintf(num, sizeof(num), "%d", sim.port);
+        props[nprops++] = prop("address", "127.0.0.1");
+        props[nprops++] = prop("tcp_port", num);
+    }
+    else {
+        props[nprops++] = prop("backend", "rtu");
+        props[nprops++] = prop("address", sim.device);
+        if (!has_prop(props, nprops, "rate")) {
+            props[nprops++] = prop("rate", "115200");
+        }
+        if (!has_prop(props, nprops, "unit_id") &&
+            !has_prop(props, nprops, "slaves")) {
+            snprintf(num, sizeof(num), "%d", sim.unit_id);
+            props[nprops++] = prop("unit_id", num);
+        }
+    }
+
+    if (bench_flb_init(&flb) == -1) {
+        fprintf(stderr, "Cannot set Fluent Bit up\n");
+        return 1;
+    }
+    ins = bench_flb_input(&flb, &in_modbus_plugin, props, nprops);
+    if (ins == NULL) {
+        fprintf(stderr, "Cannot create the in_modbus instance\n");
+        return 1;
+    }
+    ctx = ins->context;
+    stats = ctx->stats;
+
+    allocs = bench_flb_allocs();
+    if (bench_flb_run(&flb, (uint64_t) duration * 1000) == -1) {
+        fprintf(stderr, "Cannot run the collectors\n");
+        return 1;
+    }
+
+    allocs = bench_flb_allocs() - allocs;
+    secs = (bench_flb_time_us() - stats->start_us) / 1e6;
+    requests = bench_sim_requests(&sim);
+    for (i = 0; i < IN_MODBUS_STATS_EXCEPTIONS; i++) {
+        exceptions += stats->exceptions[i];
+    }
+
+    printf("in_modbus: %" PRIu64 " slave scans in %.1f s\n",
+           stats->scans, secs);
+    printf("  reads/s       %.1f (slave: %.1f requests/s)\n",
+           stats->reads / secs, requests / secs);
+    printf("  read errors   %" PRIu64 " (%" PRIu64 " timeouts, %" PRIu64
+           " exceptions, %" PRIu64 " reconnects)\n",
+           stats->errors, stats->timeouts, exceptions, stats->reconnects);
+    printf("  scan latency  p50 %" PRIu64 " us, p99 %" PRIu64 " us\n",
+           in_modbus_stats_percentile(stats, 50),
+           in_modbus_stats_percentile(stats, 99));
+#ifdef BENCH_FLB_ALLOCS
+    printf("  allocs/scan   %.3f\n",
+           stats->scans ? (double) allocs / stats->scans : 0.0);
+#else
+    printf("  allocs/scan   n/a\n");
+#endif
+    printf("  bytes/point   %.2f (%" PRIu64 " appends)\n",
+           stats->points ? (double) bench_flb_chunks.bytes / stats->points :
+           0.0, bench_flb_chunks.appends);
+
+    in_modbus_plugin.cb_exit(ctx, flb.config);
+    bench_sim_stop(&sim);
+
+    return 0;
+}
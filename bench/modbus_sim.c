@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+/*
+ * Standalone simulated slave, to run the plugins from Fluent Bit against
+ * it. Settings are given as key=value arguments, see bench_sim_set().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "bench_sim.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [backend=tcp|rtu] [port=N] [unit_id=N] [points=N]\n"
+            "          [latency_us=N] [jitter_us=N] [exception_pct=N]\n"
+            "          [drop_pct=N] [change_pct=N] [seed=N]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int sig;
+    char *val;
+    sigset_t set;
+    struct bench_sim sim;
+
+    bench_sim_init(&sim);
+    sim.port = 1502;
+
+    for (i = 1; i < argc; i++) {
+        val = strchr(argv[i], '=');
+        if (val == NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        *val++ = '\0';
+        if (bench_sim_set(&sim, argv[i], val) == -1) {
+            fprintf(stderr, "Invalid setting %s=%s\n", argv[i], val);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* Waited for below, the simulator thread inherits the mask */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (bench_sim_start(&sim) == -1) {
+        return 1;
+    }
+
+    if (sim.backend == BENCH_SIM_TCP) {
+        printf("Serving %d points of each type on 127.0.0.1:%d\n",
+               sim.points, sim.port);
+    }
+    else {
+        printf("Serving %d points of each type as slave %d on %s\n",
+               sim.points, sim.unit_id, sim.device);
+    }
+    fflush(stdout);
+
+    sigwait(&set, &sig);
+
+    bench_sim_stop(&sim);
+    printf("%" PRIu64 " requests\n", sim.requests);
+
+    return 0;
+}
@@ -0,0 +1,274 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+/*
+ * Flush chunks of setpoint records to the simulated slave with out_modbus
+ * as fast as it takes them, and report the writes per second and the
+ * flush latencies. Arguments are key=value: 'duration' (seconds),
+ * 'records' per chunk, 'writes' per record, 'type' (holding_registers or
+ * coils), 'sim.*' settings of the simulator and properties of the
+ * instance.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <msgpack.h>
+
+#include <fluent-bit/flb_time.h>
+
+#include "bench_flb.h"
+#include "bench_sim.h"
+#include "out_modbus.h"
+
+#define MAX_PROPS 128
+
+extern struct flb_output_plugin out_modbus_plugin;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [duration=S] [records=N] [writes=N] "
+            "[type=holding_registers|coils]\n"
+            "          [sim.KEY=VALUE...] [PROPERTY=VALUE...]\n", prog);
+}
+
+static char *prop(const char *key, const char *val)
+{
+    char *ret;
+
+    ret = malloc(strlen(key) + strlen(val) + 2);
+    if (ret) {
+        sprintf(ret, "%s=%s", key, val);
+    }
+
+    return ret;
+}
+
+/* Records of 'writes' consecutive addresses, new values on every flush */
+static void pack_chunk(msgpack_packer *mp_pck, const char *type,
+                       int records, int writes, int points, int unit_id,
+                       uint64_t flush)
+{
+    int i;
+    int j;
+    int addr;
+    struct flb_time tm;
+
+    flb_time_get(&tm);
+    for (i = 0; i < records; i++) {
+        msgpack_pack_array(mp_pck, 2);
+        flb_time_append_to_msgpack(&tm, mp_pck, 0);
+        msgpack_pack_map(mp_pck, 2);
+
+        msgpack_pack_str(mp_pck, 7);
+        msgpack_pack_str_body(mp_pck, "unit_id", 7);
+        msgpack_pack_uint8(mp_pck, unit_id);
+
+        msgpack_pack_str(mp_pck, strlen(type));
+        msgpack_pack_str_body(mp_pck, type, strlen(type));
+        msgpack_pack_array(mp_pck, writes);
+        for (j = 0; j < writes; j++) {
+            addr = (i * writes + j) % points;
+            msgpack_pack_map(mp_pck, 2);
+            msgpack_pack_str(mp_pck, 7);
+            msgpack_pack_str_body(mp_pck, "address", 7);
+            msgpack_pack_uint16(mp_pck, addr);
+            msgpack_pack_str(mp_pck, 5);
+            msgpack_pack_str_body(mp_pck, "value", 5);
+            if (strcmp(type, "coils") == 0) {
+                msgpack_pack_uint8(mp_pck, (flush + addr) & 1);
+            }
+            else {
+                msgpack_pack_uint16(mp_pck, (flush + addr) & 0xffff);
+            }
+        }
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int ret;
+    int nprops = 0;
+    int duration = 10;
+    int records = 100;
+    int writes = 10;
+    const char *type = "holding_registers";
+    char *val;
+    char num[16];
+    char *props[MAX_PROPS];
+    uint64_t start;
+    uint64_t end;
+    uint64_t flushes = 0;
+    uint64_t retries = 0;
+    uint64_t errors = 0;
+    uint64_t nlat = 0;
+    uint64_t size = 1024;
+    uint64_t *lat;
+    uint64_t *tmp;
+    uint64_t bytes = 0;
+    uint64_t requests;
+    double secs;
+    msgpack_sbuffer mp_sbuf;
+    msgpack_packer mp_pck;
+    struct bench_sim sim;
+    struct bench_flb flb;
+    struct flb_output_instance *ins;
+    struct flb_out_modbus_config *ctx;
+
+    bench_sim_init(&sim);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 1; i < argc; i++) {
+        val = strchr(argv[i], '=');
+        if (val == NULL || nprops >= MAX_PROPS - 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(argv[i], "duration=", 9) == 0) {
+            duration = atoi(val + 1);
+        }
+        else if (strncmp(argv[i], "records=", 8) == 0) {
+            records = atoi(val + 1);
+        }
+        else if (strncmp(argv[i], "writes=", 7) == 0) {
+            writes = atoi(val + 1);
+        }
+        else if (strncmp(argv[i], "type=", 5) == 0) {
+            type = val + 1;
+        }
+        else if (strncmp(argv[i], "sim.", 4) == 0) {
+            *val = '\0';
+            if (bench_sim_set(&sim, argv[i] + 4, val + 1) == -1) {
+                fprintf(stderr, "Invalid setting %s=%s\n", argv[i], val + 1);
+                return 1;
+            }
+        }
+        else {
+            props[nprops++] = argv[i];
+        }
+    }
+    if (records <= 0 || writes <= 0 || sim.points == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (bench_sim_start(&sim) == -1) {
+        fprintf(stderr, "Cannot start the simulated slave\n");
+        return 1;
+    }
+
+    /* Point the instance at the simulator */
+    if (sim.backend == BENCH_SIM_TCP) {
+        snprintf(num, sizeof(num), "%d", sim.port);
+        props[nprops++] = prop("address", "127.0.0.1");
+        props[nprops++] = prop("tcp_port", num);
+    }
+    else {
+        props[nprops++] = prop("backend", "rtu");
+        props[nprops++] = prop("address", sim.device);
+        props[nprops++] = prop("rate", "115200");
+    }
+
+    if (bench_flb_init(&flb) == -1) {
+        fprintf(stderr, "Cannot set Fluent Bit up\n");
+        return 1;
+    }
+    ins = bench_flb_output(&flb, &out_modbus_plugin, props, nprops);
+    if (ins == NULL) {
+        fprintf(stderr, "Cannot create the out_modbus instance\n");
+        return 1;
+    }
+    ctx = ins->context;
+
+    lat = malloc(size * sizeof(uint64_t));
+    if (lat == NULL) {
+        return 1;
+    }
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    end = bench_flb_time_us() + (uint64_t) duration * 1000000;
+    while (bench_flb_time_us() < end) {
+        msgpack_sbuffer_clear(&mp_sbuf);
+        pack_chunk(&mp_pck, type, records, writes, sim.points, sim.unit_id,
+                   flushes);
+
+        start = bench_flb_time_us();
+        ret = out_modbus_flush_chunk(ctx, mp_sbuf.data, mp_sbuf.size);
+        if (nlat == size) {
+            size *= 2;
+            tmp = realloc(lat, size * sizeof(uint64_t));
+            if (tmp == NULL) {
+                break;
+            }
+            lat = tmp;
+        }
+        lat[nlat++] = bench_flb_time_us() - start;
+
+        flushes++;
+        bytes += mp_sbuf.size;
+        if (ret == FLB_RETRY) {
+            /* Connection being reopened */
+            retries++;
+            usleep(1000);
+        }
+        else if (ret != FLB_OK) {
+            errors++;
+        }
+    }
+
+    secs = duration;
+    requests = bench_sim_requests(&sim);
+    qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+
+    printf("out_modbus: %" PRIu64 " flushes in %.1f s (%" PRIu64
+           " retried, %" PRIu64 " failed)\n", flushes, secs, retries, errors);
+    printf("  writes/s      %.1f (slave: %.1f requests/s)\n",
+           (flushes - retries - errors) * records * writes / secs,
+           requests / secs);
+    printf("  flush latency p50 %" PRIu64 " us, p99 %" PRIu64 " us\n",
+           nlat ? lat[(nlat - 1) / 2] : 0,
+           nlat ? lat[(nlat - 1) * 99 / 100] : 0);
+    printf("  bytes/write   %.2f\n",
+           flushes ? (double) bytes / (flushes * records * writes) : 0.0);
+
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    free(lat);
+    out_modbus_plugin.cb_exit(ctx, flb.config);
+    bench_sim_stop(&sim);
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+/*
+ * Encode blocks of values with in_modbus_pack_values and with the loop of
+ * one msgpack call per value it replaced, check both give the same bytes
+ * and report the time per value of each. Arguments are key=value:
+ * 'iterations' per block (10000 by default).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "in_modbus.h"
+
+/* Values of the blocks: how wide their encoding is */
+enum {
+    DIST_FIXINT = 0,    /* below 0x80, one byte */
+    DIST_UINT8,         /* below 0x100 */
+    DIST_UINT16,        /* any register */
+    DIST_MIXED,         /* mostly small, some wide */
+    DIST_BITS,          /* coils */
+    DIST_COUNT
+};
+
+static const char *dist_str[DIST_COUNT] = {
+    "fixint", "uint8", "uint16", "mixed", "bits"
+};
+
+static const int sizes[] = { 1, 10, 125, 2000 };
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill(void *inputs, int dist, int n, unsigned int *seed)
+{
+    int i;
+    uint8_t *bits = inputs;
+    uint16_t *registers = inputs;
+
+    for (i = 0; i < n; i++) {
+        switch (dist) {
+        case DIST_FIXINT:
+            registers[i] = rand_r(seed) % 0x80;
+            break;
+        case DIST_UINT8:
+            registers[i] = rand_r(seed) % 0x100;
+            break;
+        case DIST_UINT16:
+            registers[i] = rand_r(seed) % 0x10000;
+            break;
+        case DIST_MIXED:
+            registers[i] = rand_r(seed) % 8 ? rand_r(seed) % 0x80 :
+                           rand_r(seed) % 0x10000;
+            break;
+        default:
+            bits[i] = rand_r(seed) & 1;
+            break;
+        }
+    }
+}
+
+/* Time per value in ns, 'sbuf' keeps the encoding of the last run */
+static double run(void (*pack)(msgpack_packer *, int, void *,
+                               struct in_modbus_block *),
+                  int type, void *inputs, struct in_modbus_block *block,
+                  int iterations, msgpack_sbuffer *sbuf)
+{
+    int i;
+    uint64_t start;
+    msgpack_packer mp_pck;
+
+    msgpack_packer_init(&mp_pck, sbuf, msgpack_sbuffer_write);
+
+    start = time_ns();
+    for (i = 0; i < iterations; i++) {
+        msgpack_sbuffer_clear(sbuf);
+        pack(&mp_pck, type, inputs, block);
+    }
+
+    return (double) (time_ns() - start) / iterations / block->no;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int s;
+    int dist;
+    int type;
+    int failed = 0;
+    int iterations = 10000;
+    unsigned int seed = 1;
+    double slow;
+    double fast;
+    uint16_t inputs[2000];
+    msgpack_sbuffer slow_sbuf;
+    msgpack_sbuffer fast_sbuf;
+    struct in_modbus_block block;
+
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "iterations=", 11) == 0) {
+            iterations = atoi(argv[i] + 11);
+        }
+        else {
+            fprintf(stderr, "usage: %s [iterations=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        iterations = 1;
+    }
+
+    msgpack_sbuffer_init(&slow_sbuf);
+    msgpack_sbuffer_init(&fast_sbuf);
+
+    printf("%-8s %6s %12s %12s %8s\n", "values", "count", "loop ns/v",
+           "bulk ns/v", "speedup");
+
+    for (dist = 0; dist < DIST_COUNT; dist++) {
+        type = dist == DIST_BITS ? COILS : HOLDING_REGISTERS;
+
+        for (s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+            memset(&block, 0, sizeof(block));
+            block.no = sizes[s];
+            block.point = -1;
+            fill(inputs, dist, block.no, &seed);
+
+            slow = run(in_modbus_pack_values_slow, type, inputs, &block,
+                       iterations, &slow_sbuf);
+            fast = run(in_modbus_pack_values, type, inputs, &block,
+                       iterations, &fast_sbuf);
+
+            if (slow_sbuf.size != fast_sbuf.size ||
+                memcmp(slow_sbuf.data, fast_sbuf.data, slow_sbuf.size) != 0) {
+                fprintf(stderr, "%s x %d: encodings differ (%zu and %zu "
+                        "bytes)\n", dist_str[dist], block.no,
+                        slow_sbuf.size, fast_sbuf.size);
+                failed = 1;
+                continue;
+            }
+
+            printf("%-8s %6d %12.2f %12.2f %7.1fx\n", dist_str[dist],
+                   block.no, slow, fast, fast > 0 ? slow / fast : 0.0);
+        }
+    }
+
+    msgpack_sbuffer_destroy(&slow_sbuf);
+    msgpack_sbuffer_destroy(&fast_sbuf);
+
+    return failed;
+}
@@ -0,0 +1,621 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_log.h>
+#include <fluent-bit/flb_mem.h>
+#include <fluent-bit/flb_str.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <modbus.h>
+
+#include "modbus_conn.h"
+
+/*
+ * Links of the process, a single list as the plugins load this file as
+ * one shared library. 'conns_lock' guards the list, the reference counts
+ * and the reconnection schedule (failures, retry_ms).
+ */
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mk_list conns = { &conns, &conns };
+
+/* Background thread reopening the links that are down */
+static pthread_once_t reconnect_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t reconnect_cond;
+static pthread_t reconnect_thread;
+static int reconnect_running;
+static unsigned int reconnect_gen;  /* bumped to stop the thread */
+
+static unsigned int jitter_seed;
+
+bool connection_error(int error)
+{
+    return error == EBADF ||
+           error == ECONNRESET ||
+           error == EPIPE ||
+           error == ECONNREFUSED ||
+           error == ETIMEDOUT ||
+           error == ENOPROTOOPT ||
+           error == EINPROGRESS;
+}
+
+uint64_t modbus_conn_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Delay before reconnection attempt number 'failures' (from 0): doubles
+ * from 'min_ms' up to 'max_ms', half of it random so instances that lost
+ * the same gateway do not all come back at once.
+ */
+uint64_t modbus_conn_backoff_ms(int failures, int min_ms, int max_ms)
+{
+    int i;
+    uint32_t r;
+    uint64_t delay = min_ms;
+
+    for (i = 0; i < failures && delay < max_ms; i++) {
+        delay *= 2;
+    }
+    if (delay > max_ms) {
+        delay = max_ms;
+    }
+
+    r = __atomic_add_fetch(&jitter_seed, 2654435761u, __ATOMIC_RELAXED);
+    r ^= r >> 15;
+    r *= 0x2c1b3c6d;
+    r ^= r >> 12;
+
+    return delay / 2 + r % (delay / 2 + 1);
+}
+
+static modbus_t *new_modbus_ctx(const struct modbus_conn_params *params)
+{
+    char service[16];
+    modbus_t *modbus_ctx;
+
+    switch (params->backend) {
+    case TCP:
+        modbus_ctx = modbus_new_tcp(params->address, params->port);
+        break;
+    case TCP_PI:
+        snprintf(service, sizeof(service), "%d", params->port);
+        modbus_ctx = modbus_new_tcp_pi(params->address, service);
+        break;
+    default:
+        modbus_ctx = modbus_new_rtu(params->address, params->rate,
+                                    params->parity, params->data_bits,
+                                    params->stop_bits);
+        break;
+    }
+
+    if (modbus_ctx == NULL) {
+        return NULL;
+    }
+
+    //modbus_set_debug(modbus_ctx, TRUE);
+    modbus_set_error_recovery(modbus_ctx, MODBUS_ERROR_RECOVERY_PROTOCOL);
+    if (params->response_timeout_ms > 0) {
+        modbus_set_response_timeout(modbus_ctx,
+                                    params->response_timeout_ms / 1000,
+                                    (params->response_timeout_ms % 1000) *
+                                    1000);
+    }
+    if (params->byte_timeout_ms > 0) {
+        modbus_set_byte_timeout(modbus_ctx, params->byte_timeout_ms / 1000,
+                                (params->byte_timeout_ms % 1000) * 1000);
+    }
+
+    return modbus_ctx;
+}
+
+/*
+ * Silence that ends an RTU frame: 3.5 characters of start, data, parity
+ * and stop bits, or 1750 us above 19200 bd as the specification allows.
+ */
+static uint64_t frame_gap_us(const struct modbus_conn_params *params)
+{
+    int bits;
+
+    if (params->backend != RTU || params->rate <= 0) {
+        return 0;
+    }
+    if (params->rate > 19200) {
+        return 1750;
+    }
+
+    bits = 1 + params->data_bits + (params->parity != 'N') +
+           params->stop_bits;
+    return ((uint64_t) bits * 3500000 + params->rate - 1) / params->rate;
+}
+
+/* Wait for the turn of this transaction, then the link is ours */
+static void conn_lock(struct modbus_conn *conn)
+{
+    unsigned int ticket;
+
+    pthread_mutex_lock(&conn->lock);
+    ticket = conn->ticket++;
+    while (ticket != conn->serving) {
+        pthread_cond_wait(&conn->turn, &conn->lock);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void conn_unlock(struct modbus_conn *conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->serving++;
+    pthread_cond_broadcast(&conn->turn);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/* Called by the owner of the link, or before it is shared */
+static int conn_open(struct modbus_conn *conn)
+{
+    modbus_close(conn->modbus_ctx);
+
+    errno = 0;
+    if (modbus_connect(conn->modbus_ctx) == -1) {
+        conn->err = errno;
+        return -1;
+    }
+
+    conn->err = 0;
+    conn->opens++;
+    __atomic_store_n(&conn->up, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void conn_free(struct modbus_conn *conn)
+{
+    if (conn->modbus_ctx) {
+        modbus_close(conn->modbus_ctx);
+        modbus_free(conn->modbus_ctx);
+    }
+    pthread_cond_destroy(&conn->turn);
+    pthread_mutex_destroy(&conn->lock);
+    flb_free(conn->key);
+    flb_free(conn->address);
+    flb_free(conn);
+}
+
+/* Drop a reference with conns_lock held, 1 when the caller has to free */
+static int conn_unref(struct modbus_conn *conn)
+{
+    if (--conn->refs > 0) {
+        return 0;
+    }
+
+    mk_list_del(&conn->_head);
+    return 1;
+}
+
+/* Schedule reconnection attempt 'conn->failures', conns_lock held */
+static void conn_schedule(struct modbus_conn *conn)
+{
+    conn->retry_ms = modbus_conn_time_ms() +
+        modbus_conn_backoff_ms(conn->failures, conn->backoff_min_ms,
+                               conn->backoff_max_ms);
+    pthread_cond_signal(&reconnect_cond);
+}
+
+static void *reconnect_worker(void *data)
+{
+    int ret;
+    uint64_t now;
+    uint64_t next;
+    struct timespec ts;
+    struct mk_list *head;
+    struct modbus_conn *conn;
+    struct modbus_conn *due;
+    unsigned int gen = (uintptr_t) data;
+
+    pthread_mutex_lock(&conns_lock);
+    while (gen == reconnect_gen) {
+        now = modbus_conn_time_ms();
+        next = UINT64_MAX;
+        due = NULL;
+
+        mk_list_foreach(head, &conns) {
+            conn = mk_list_entry(head, struct modbus_conn, _head);
+            if (modbus_conn_up(conn)) {
+                continue;
+            }
+            if (conn->retry_ms <= now) {
+                due = conn;
+                break;
+            }
+            if (conn->retry_ms < next) {
+                next = conn->retry_ms;
+            }
+        }
+
+        if (due == NULL) {
+            if (next == UINT64_MAX) {
+                pthread_cond_wait(&reconnect_cond, &conns_lock);
+            }
+            else {
+                ts.tv_sec = next / 1000;
+                ts.tv_nsec = (next % 1000) * 1000000;
+                pthread_cond_timedwait(&reconnect_cond, &conns_lock, &ts);
+            }
+            continue;
+        }
+
+        /* Connect without conns_lock, the plugins keep going meanwhile */
+        due->refs++;
+        pthread_mutex_unlock(&conns_lock);
+
+        conn_lock(due);
+        ret = conn_open(due);
+        conn_unlock(due);
+
+        pthread_mutex_lock(&conns_lock);
+        if (ret == 0) {
+            flb_info("[modbus] Reconnected to %s after %d attempts",
+                     due->address, due->failures + 1);
+            due->failures = 0;
+        }
+        else {
+            due->failures++;
+            conn_schedule(due);
+            flb_debug("[modbus] Reconnection to %s failed: %s, next attempt "
+                      "in %" PRIu64 " ms", due->address,
+                      modbus_strerror(due->err), due->retry_ms - now);
+        }
+
+        if (conn_unref(due)) {
+            pthread_mutex_unlock(&conns_lock);
+            conn_free(due);
+            pthread_mutex_lock(&conns_lock);
+
+            /* The last user went away while we were connecting */
+            if (mk_list_is_empty(&conns) == 0 && gen == reconnect_gen) {
+                reconnect_gen++;
+                reconnect_running = 0;
+                pthread_detach(pthread_self());
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+
+    return NULL;
+}
+
+static void reconnect_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reconnect_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    jitter_seed = (unsigned int) time(NULL);
+}
+
+/*
+ * Take another reference on a link, conns_lock held. A serial line is
+ * opened once, with the settings of its first user.
+ */
+static void conn_ref(struct modbus_conn *conn,
+                     const struct modbus_conn_params *params)
+{
+    conn->refs++;
+
+    if (conn->backend == RTU &&
+        (conn->rate != params->rate || conn->parity != params->parity ||
+         conn->data_bits != params->data_bits ||
+         conn->stop_bits != params->stop_bits)) {
+        flb_warn("[modbus] %s is already open at %d %d%c%d, ignoring "
+                 "%d %d%c%d", conn->address, conn->rate, conn->data_bits,
+                 conn->parity, conn->stop_bits, params->rate,
+                 params->data_bits, params->parity, params->stop_bits);
+    }
+}
+
+/*
+ * Return the link described by 'params', opening it on first use. A
+ * slave that cannot be reached yet is not an error: the link starts
+ * down and is retried in the background.
+ */
+struct modbus_conn *modbus_conn_get(const struct modbus_conn_params *params)
+{
+    int ret;
+    char key[320];
+    char path[PATH_MAX];
+    struct mk_list *head;
+    struct modbus_conn *conn;
+    struct modbus_conn *other;
+    struct modbus_conn_params p = *params;
+
+    pthread_once(&reconnect_once, reconnect_init);
+
+    /* 8N1 unless told otherwise */
+    if (p.parity == 0) {
+        p.parity = 'N';
+    }
+    if (p.data_bits == 0) {
+        p.data_bits = 8;
+    }
+    if (p.stop_bits == 0) {
+        p.stop_bits = 1;
+    }
+
+    /* A serial port reached through a symlink is still the same bus */
+    if (p.backend == RTU && realpath(p.address, path) != NULL) {
+        snprintf(key, sizeof(key), "%d:%s:0", p.backend, path);
+    }
+    else {
+        snprintf(key, sizeof(key), "%d:%s:%d", p.backend, p.address,
+                 p.backend == RTU ? 0 : p.port);
+    }
+
+    pthread_mutex_lock(&conns_lock);
+    mk_list_foreach(head, &conns) {
+        conn = mk_list_entry(head, struct modbus_conn, _head);
+        if (strcmp(conn->key, key) == 0) {
+            conn_ref(conn, &p);
+            pthread_mutex_unlock(&conns_lock);
+            return conn;
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+
+    conn = flb_calloc(1, sizeof(struct modbus_conn));
+    if (!conn) {
+        flb_errno();
+        return NULL;
+    }
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->turn, NULL);
+    conn->refs = 1;
+    conn->backend = p.backend;
+    conn->backoff_min_ms = p.backoff_min_ms;
+    conn->backoff_max_ms = p.backoff_max_ms;
+    conn->rate = p.rate;
+    conn->parity = p.parity;
+    conn->data_bits = p.data_bits;
+    conn->stop_bits = p.stop_bits;
+    conn->gap_us = frame_gap_us(&p);
+
+    conn->key = flb_strdup(key);
+    conn->address = flb_strdup(p.address);
+    if (!conn->key || !conn->address) {
+        flb_errno();
+        conn_free(conn);
+        return NULL;
+    }
+
+    conn->modbus_ctx = new_modbus_ctx(&p);
+    if (conn->modbus_ctx == NULL) {
+        flb_error("[modbus] Unable to allocate modbus context");
+        conn_free(conn);
+        return NULL;
+    }
+
+    ret = conn_open(conn);
+    if (ret == -1) {
+        flb_error("[modbus] Connection to Modbus slave %s failed: %s, "
+                  "retrying in the background", conn->address,
+                  modbus_strerror(conn->err));
+    }
+
+    pthread_mutex_lock(&conns_lock);
+
+    /* Another instance may have opened the same link meanwhile */
+    mk_list_foreach(head, &conns) {
+        other = mk_list_entry(head, struct modbus_conn, _head);
+        if (strcmp(other->key, key) == 0) {
+            conn_ref(other, &p);
+            pthread_mutex_unlock(&conns_lock);
+            conn_free(conn);
+            return other;
+        }
+    }
+
+    mk_list_add(&conn->_head, &conns);
+    if (!reconnect_running) {
+        if (pthread_create(&reconnect_thread, NULL, reconnect_worker,
+                           (void *) (uintptr_t) reconnect_gen) != 0) {
+            flb_error("[modbus] Unable to start the reconnection thread");
+        }
+        else {
+            reconnect_running = 1;
+        }
+    }
+    if (ret == -1) {
+        conn_schedule(conn);
+    }
+
+    pthread_mutex_unlock(&conns_lock);
+
+    return conn;
+}
+
+/* Release a link, the last user closes it */
+void modbus_conn_put(struct modbus_conn *conn)
+{
+    int join = 0;
+    pthread_t thread;
+
+    pthread_mutex_lock(&conns_lock);
+    if (!conn_unref(conn)) {
+        pthread_mutex_unlock(&conns_lock);
+        return;
+    }
+
+    if (mk_list_is_empty(&conns) == 0 && reconnect_running) {
+        reconnect_gen++;
+        reconnect_running = 0;
+        pthread_cond_broadcast(&reconnect_cond);
+        thread = reconnect_thread;
+        join = 1;
+    }
+    pthread_mutex_unlock(&conns_lock);
+
+    if (join) {
+        pthread_join(thread, NULL);
+    }
+    conn_free(conn);
+}
+
+/*
+ * Take the link for a transaction, after the ones already waiting for
+ * it. Returns -1 right away, without blocking, when the link is down.
+ */
+int modbus_conn_acquire(struct modbus_conn *conn)
+{
+    if (!modbus_conn_up(conn)) {
+        return -1;
+    }
+
+    conn_lock(conn);
+    if (!modbus_conn_up(conn)) {
+        conn_unlock(conn);
+        return -1;
+    }
+
+    modbus_conn_pace(conn);
+    return 0;
+}
+
+void modbus_conn_release(struct modbus_conn *conn)
+{
+    modbus_conn_frame_end(conn);
+    conn_unlock(conn);
+}
+
+/*
+ * RTU: with the link acquired, wait until the bus has been silent for
+ * t3.5 since the last frame ended. Only what is left of the gap is
+ * slept, the time spent on the previous response already counts.
+ */
+void modbus_conn_pace(struct modbus_conn *conn)
+{
+    uint64_t now;
+    uint64_t wait;
+    struct timespec ts;
+
+    if (conn->gap_us == 0) {
+        return;
+    }
+
+    now = time_us();
+    if (now >= conn->quiet_us) {
+        return;
+    }
+
+    wait = conn->quiet_us - now;
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = (wait % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        /* Signal, sleep what is left */
+    }
+}
+
+/* RTU: a transaction is over, the bus is silent from now on */
+void modbus_conn_frame_end(struct modbus_conn *conn)
+{
+    if (conn->gap_us > 0) {
+        conn->quiet_us = time_us() + conn->gap_us;
+    }
+}
+
+/* Serial parity from its option value: none, even or odd */
+int modbus_conn_parity(const char *str)
+{
+    if (str == NULL || strcasecmp(str, "none") == 0 ||
+        strcasecmp(str, "n") == 0) {
+        return 'N';
+    }
+    if (strcasecmp(str, "even") == 0 || strcasecmp(str, "e") == 0) {
+        return 'E';
+    }
+    if (strcasecmp(str, "odd") == 0 || strcasecmp(str, "o") == 0) {
+        return 'O';
+    }
+
+    return -1;
+}
+
+/*
+ * Address the following requests to 'unit_id', with the link acquired.
+ * The link may be shared, so -1 resets the TCP default unit id; a serial
+ * line has no default and never keeps the unit id selected by another
+ * user of the link.
+ */
+int modbus_conn_select(struct modbus_conn *conn, int unit_id)
+{
+    if (unit_id >= 0) {
+        return modbus_set_slave(conn->modbus_ctx, unit_id);
+    }
+    if (conn->backend == RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return modbus_set_slave(conn->modbus_ctx, MODBUS_TCP_SLAVE);
+}
+
+/*
+ * Report the outcome of a failed transaction, with the link acquired.
+ * Connection errors take the link down and hand it to the background
+ * thread, Modbus exceptions leave it alone.
+ */
+void modbus_conn_fail(struct modbus_conn *conn, int err)
+{
+    if (!connection_error(err) || !modbus_conn_up(conn)) {
+        return;
+    }
+
+    conn->err = err;
+    __atomic_store_n(&conn->up, 0, __ATOMIC_RELEASE);
+    flb_error("[modbus] Connection to Modbus slave %s lost: %s",
+              conn->address, modbus_strerror(err));
+
+    pthread_mutex_lock(&conns_lock);
+    conn->failures = 0;
+    conn_schedule(conn);
+    pthread_mutex_unlock(&conns_lock);
+}
@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_MODBUS_CONN_H
+#define FLB_MODBUS_CONN_H
+
+#include <fluent-bit/flb_info.h>
+#include <monkey/mk_core.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <modbus.h>
+
+enum {
+    TCP,
+    TCP_PI,
+    RTU
+};
+
+/* Where a link goes and how it is opened */
+struct modbus_conn_params {
+    int backend;
+    const char *address;    /* host name or serial device */
+    int port;
+    int response_timeout_ms;
+    int byte_timeout_ms;    /* between two bytes of a response, 0 default */
+
+    /* Serial line (RTU), 'N', 'E' or 'O' for the parity */
+    int rate;
+    char parity;
+    int data_bits;
+    int stop_bits;
+
+    /* First and largest delay between two reconnection attempts */
+    int backoff_min_ms;
+    int backoff_max_ms;
+};
+
+/*
+ * Link to a slave, a gateway or a serial line, shared by every input and
+ * output instance going to the same place: the registry lives in the
+ * flb-modbus-conn library, loaded once per process. libmodbus contexts
+ * are not thread safe, so transactions take turns: each one draws a
+ * ticket under 'lock' and owns the link once it is served, in arrival
+ * order. A broken link is marked down and reopened by a background
+ * thread with jittered exponential backoff, polls and flushes check 'up'
+ * and skip it meanwhile.
+ *
+ * A serial line is a single bus owned by its link: besides the queue,
+ * frames are kept apart by the t3.5 silence its baud rate requires.
+ */
+struct modbus_conn {
+    modbus_t *modbus_ctx;
+    int backend;
+    char *key;              /* backend, address and port */
+    char *address;
+    int refs;
+
+    int up;                 /* read without the lock */
+    unsigned int opens;     /* successful connections, by the owner */
+    int err;                /* errno of the failure that took it down */
+    int failures;           /* reconnection attempts since then */
+    uint64_t retry_ms;      /* monotonic, next reconnection attempt */
+    int backoff_min_ms;
+    int backoff_max_ms;
+
+    /* Line settings of the first user, for the later ones to compare */
+    int rate;
+    char parity;
+    int data_bits;
+    int stop_bits;
+
+    /* RTU: silence between two frames, when the last one ended (owner) */
+    uint64_t gap_us;
+    uint64_t quiet_us;
+
+    /* Queue of the transactions: next ticket drawn, ticket served */
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    unsigned int ticket;
+    unsigned int serving;
+
+    struct mk_list _head;
+};
+
+bool connection_error(int error);
+uint64_t modbus_conn_time_ms(void);
+uint64_t modbus_conn_backoff_ms(int failures, int min_ms, int max_ms);
+
+struct modbus_conn *modbus_conn_get(const struct modbus_conn_params *params);
+void modbus_conn_put(struct modbus_conn *conn);
+
+int modbus_conn_acquire(struct modbus_conn *conn);
+void modbus_conn_release(struct modbus_conn *conn);
+void modbus_conn_fail(struct modbus_conn *conn, int err);
+int modbus_conn_select(struct modbus_conn *conn, int unit_id);
+void modbus_conn_pace(struct modbus_conn *conn);
+void modbus_conn_frame_end(struct modbus_conn *conn);
+int modbus_conn_parity(const char *str);
+
+/* Cheap check done before taking the lock */
+static inline int modbus_conn_up(struct modbus_conn *conn)
+{
+    return __atomic_load_n(&conn->up, __ATOMIC_ACQUIRE);
+}
+
+#endif
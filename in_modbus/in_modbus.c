@@ -24,23 +24,23 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include <errno.h>
+#include <math.h>
 #include <modbus.h>
 
 #include "in_modbus.h"
-
-enum {
-    TCP,
-    TCP_PI,
-    RTU
-};
-
-enum {
-    COILS = 0,
-    DISCRETE_INPUTS,
-    HOLDING_REGISTERS,
-    INPUT_REGISTERS
-};
+#include "in_modbus_device.h"
+#include "in_modbus_async.h"
+#include "in_modbus_worker.h"
+#include "in_modbus_point.h"
+#include "in_modbus_bits.h"
+#include "in_modbus_sched.h"
+#include "in_modbus_stats.h"
+#include "in_modbus_clock.h"
 
 char *type_str[4] = {
     "coils",
@@ -49,11 +49,16 @@ char *type_str[4] = {
     "input_registers"
 };
 
-#define BIT_TYPE(type) type == COILS || type == DISCRETE_INPUTS
+char *blocks_str[4] = {
+    "coil_blocks",
+    "discrete_input_blocks",
+    "holding_reg_blocks",
+    "input_reg_blocks"
+};
 
-void pack_error(msgpack_packer *mp_pck)
+void pack_error(msgpack_packer *mp_pck, int errnum)
 {
-    const char *error = modbus_strerror(errno);
+    const char *error = modbus_strerror(errnum);
 
     msgpack_pack_map(mp_pck, 1);
     msgpack_pack_str(mp_pck, strlen("error"));
@@ -62,179 +67,868 @@ void pack_error(msgpack_packer *mp_pck)
     msgpack_pack_str_body(mp_pck, error, strlen(error));
 }
 
-bool connection_error(int error)
+/*
+ * One msgpack call per value, for packers not writing to an sbuffer. Also
+ * the reference bench/pack_values_bench checks the fast path against.
+ */
+void in_modbus_pack_values_slow(msgpack_packer *mp_pck, int type,
+                                void *inputs, struct in_modbus_block *block)
 {
-    return error == EBADF ||
-           error == ECONNRESET ||
-           error == EPIPE ||
-           error == ECONNREFUSED ||
-           error == ETIMEDOUT ||
-           error == ENOPROTOOPT ||
-           error == EINPROGRESS;
+    int i;
+    uint8_t *bits = (uint8_t *) inputs;
+    uint16_t *registers = (uint16_t *) inputs;
+
+    for (i = block->offset; i < block->offset + block->no; i++) {
+        if (BIT_TYPE(type)) {
+            msgpack_pack_uint8(mp_pck, bits[i]);
+        }
+        else {
+            msgpack_pack_uint16(mp_pck, registers[i]);
+        }
+    }
 }
 
-int in_modbus_connect(struct flb_in_modbus_config *ctx)
+/*
+ * Append the values of a block straight into the sbuffer. msgpack keeps
+ * integers in their smallest form, so the encoded size is known before
+ * writing: the buffer grows at most once per block and the values are
+ * encoded by a plain loop. Bits are 0 or 1, their own encoding.
+ */
+void in_modbus_pack_values(msgpack_packer *mp_pck, int type, void *inputs,
+                           struct in_modbus_block *block)
 {
-    errno = 0;
-    if (modbus_connect(ctx->modbus_ctx) == -1) {
-        ctx->err = errno;
-        flb_error("Connection to Modbus slave failed: %s\n",
-                  modbus_strerror(errno));
-        return -1;
+    int i;
+    int n = block->no;
+    size_t size;
+    uint8_t any = 0;
+    uint8_t *p;
+    const uint8_t *bits = (uint8_t *) inputs + block->offset;
+    const uint16_t *registers = (uint16_t *) inputs + block->offset;
+    msgpack_sbuffer *sbuf = mp_pck->data;
+
+    if (mp_pck->callback != msgpack_sbuffer_write) {
+        in_modbus_pack_values_slow(mp_pck, type, inputs, block);
+        return;
+    }
+
+    if (BIT_TYPE(type)) {
+        for (i = 0; i < n; i++) {
+            any |= bits[i];
+        }
+        if (any > 0x7f ||
+            in_modbus_sbuffer_reserve(sbuf, sbuf->size + n) == -1) {
+            in_modbus_pack_values_slow(mp_pck, type, inputs, block);
+            return;
+        }
+        memcpy(sbuf->data + sbuf->size, bits, n);
+        sbuf->size += n;
+        return;
+    }
+
+    /* positive fixint, uint8 (0xcc) or uint16 (0xcd) */
+    size = n;
+    for (i = 0; i < n; i++) {
+        size += (registers[i] > 0x7f) + (registers[i] > 0xff);
+    }
+    if (in_modbus_sbuffer_reserve(sbuf, sbuf->size + size) == -1) {
+        in_modbus_pack_values_slow(mp_pck, type, inputs, block);
+        return;
+    }
+
+    p = (uint8_t *) sbuf->data + sbuf->size;
+    for (i = 0; i < n; i++) {
+        if (registers[i] < 0x80) {
+            *p++ = registers[i];
+        }
+        else if (registers[i] < 0x100) {
+            *p++ = 0xcc;
+            *p++ = registers[i];
+        }
+        else {
+            *p++ = 0xcd;
+            *p++ = registers[i] >> 8;
+            *p++ = registers[i] & 0xff;
+        }
+    }
+    sbuf->size += size;
+}
+
+/*
+ * Bits of the raw blocks of a plan, or of 'only' that block, as a single
+ * bin: one bit per point, LSB first, in block order.
+ */
+static void pack_packed_bits(msgpack_packer *mp_pck,
+                             struct in_modbus_plan *plan, uint8_t *bits,
+                             struct in_modbus_block *only)
+{
+    int j;
+    int pos = 0;
+    struct in_modbus_block *block;
+    uint8_t packed[IN_MODBUS_ADDR_MAX / 8];
+
+    for (j = 0; j < plan->nblocks; j++) {
+        block = &plan->blocks[j];
+        if ((only && block != only) || !IN_MODBUS_RAW_BLOCK(block) ||
+            pos + block->no > IN_MODBUS_ADDR_MAX) {
+            continue;
+        }
+        pos = in_modbus_pack_bits(packed, pos, bits + block->offset,
+                                  block->no);
+    }
+
+    msgpack_pack_bin(mp_pck, (pos + 7) / 8);
+    msgpack_pack_bin_body(mp_pck, packed, (pos + 7) / 8);
+}
+
+int pack_inputs(msgpack_packer *mp_pck, struct in_modbus_plan *plan,
+                void *inputs, int num, int errnum, int packed)
+{
+    int j;
+
+    if (num == -1) { /* Non-connection error */
+        /* Error */
+        pack_error(mp_pck, errnum);
+    }
+    else if (packed && BIT_TYPE(plan->type)) {
+        pack_packed_bits(mp_pck, plan, inputs, NULL);
+    }
+    else {
+        /* Only the requested points, skipping the gaps read in between */
+        msgpack_pack_array(mp_pck, plan->points);
+
+        for (j = 0; j < plan->nblocks; j++) {
+            if (IN_MODBUS_RAW_BLOCK(&plan->blocks[j])) {
+                in_modbus_pack_values(mp_pck, plan->type, inputs,
+                                      &plan->blocks[j]);
+            }
+        }
     }
 
-    ctx->err = 0;
     return 0;
 }
 
-int pack_inputs(struct flb_in_modbus_config *ctx, msgpack_packer *mp_pck,
-                void *inputs, int type, int num)
+/*
+ * Blocks scanned at different rates are keyed by their start address,
+ * all of them or 'only' that one.
+ */
+static int pack_blocks(msgpack_packer *mp_pck, struct in_modbus_plan *plan,
+                       void *inputs, int num, int errnum, int packed,
+                       struct in_modbus_block *only)
 {
-    int i;
+    int j;
+    int len;
+    char key[8];
+    struct in_modbus_block *block;
+
+    for (j = 0; j < plan->nblocks; j++) {
+        block = &plan->blocks[j];
+        if ((only && block != only) || !IN_MODBUS_RAW_BLOCK(block)) {
+            continue;
+        }
 
-    uint8_t *bits = (uint8_t *) inputs;
-    uint16_t *registers = (uint16_t *) inputs;
+        len = snprintf(key, sizeof(key), "%d", block->addr);
+        msgpack_pack_str(mp_pck, len);
+        msgpack_pack_str_body(mp_pck, key, len);
+
+        if (num == -1) {
+            pack_error(mp_pck, errnum);
+        }
+        else if (packed && BIT_TYPE(plan->type)) {
+            pack_packed_bits(mp_pck, plan, inputs, block);
+        }
+        else {
+            msgpack_pack_array(mp_pck, block->no);
+            in_modbus_pack_values(mp_pck, plan->type, inputs, block);
+        }
+    }
 
-    ctx->err = 0;
+    return 0;
+}
 
-    if (connection_error(errno)) {
-        ctx->err = errno;
-        flb_error("Connection to Modbus slave failed: %s\n",
-                  modbus_strerror(errno));
-        return -1;
+/*
+ * Pack a typed point: the key bytes are copied as compiled, the value is
+ * decoded straight from the scan buffer.
+ */
+static inline void pack_point(struct in_modbus_point *point, char *buf,
+                              msgpack_packer *mp_pck)
+{
+    mp_pck->callback(mp_pck->data, point->key, point->key_len);
+    in_modbus_point_pack(point, (uint16_t *) (buf + point->buf_offset),
+                         mp_pck);
+}
+
+/*
+ * Time of the values at 'offset' of a plan buffer: when the response
+ * carrying them came in. Failed reads are dated when they are reported.
+ */
+static void pack_value_time(struct flb_in_modbus_config *ctx,
+                            struct in_modbus_device *dev, int plan_idx,
+                            int offset, msgpack_packer *mp_pck)
+{
+    int read;
+    struct flb_time tm;
+    struct in_modbus_plan *plan = &ctx->plans[plan_idx];
+
+    if (dev->result[plan_idx] == -1) {
+        flb_time_get(&tm);
+    }
+    else {
+        read = in_modbus_plan_read_of(plan, offset);
+        in_modbus_clock_time(ctx, dev->stamps[plan->first_read + read], &tm);
     }
+    flb_time_append_to_msgpack(&tm, mp_pck, 0);
+}
 
-    msgpack_pack_str(mp_pck, strlen(type_str[type]));
-    msgpack_pack_str_body(mp_pck, type_str[type], strlen(type_str[type]));
+/*
+ * Time of the record of a scan: the first response, so the record is
+ * dated when the slave was sampled rather than when it was packed.
+ */
+static void pack_scan_time(struct flb_in_modbus_config *ctx,
+                           struct in_modbus_device *dev, uint64_t scan,
+                           msgpack_packer *mp_pck)
+{
+    int i;
+    uint64_t stamp;
+    uint64_t first = 0;
+    struct flb_time tm;
+    struct in_modbus_plan *plan;
+
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        if (!in_modbus_plan_due(plan, scan) || dev->result[i] == -1) {
+            continue;
+        }
+        /* The requests of a plan are answered in order */
+        stamp = dev->stamps[plan->first_read];
+        if (first == 0 || stamp < first) {
+            first = stamp;
+        }
+    }
 
-    if (num == -1) { /* Non-connection error */
-        /* Error */
-        ctx->err = errno;
-        pack_error(mp_pck);
+    if (first == 0) {
+        flb_time_get(&tm);
     }
     else {
-        msgpack_pack_array(mp_pck, num);
+        in_modbus_clock_time(ctx, first, &tm);
+    }
+    flb_time_append_to_msgpack(&tm, mp_pck, 0);
+}
 
-        for (i = 0; i < num; i++)
-        {
-            if (BIT_TYPE(type)) {
-                msgpack_pack_uint8(mp_pck, bits[i]);
+/*
+ * One record per block due on 'scan', each dated by its own response:
+ * raw values keyed by type and start address, typed points by name.
+ */
+static int pack_per_block(struct flb_in_modbus_config *ctx,
+                          struct in_modbus_device *dev, char *buf,
+                          uint64_t scan, msgpack_packer *mp_pck)
+{
+    int i;
+    int j;
+    int type;
+    struct in_modbus_plan *plan;
+    struct in_modbus_block *block;
+    struct in_modbus_point *point;
+
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        type = plan->type;
+        if (!in_modbus_plan_due(plan, scan)) {
+            continue;
+        }
+
+        for (j = 0; j < plan->nblocks; j++) {
+            block = &plan->blocks[j];
+
+            msgpack_pack_array(mp_pck, 2);
+            pack_value_time(ctx, dev, i, block->offset, mp_pck);
+            msgpack_pack_map(mp_pck, 1 + (dev->unit_id >= 0));
+
+            if (dev->unit_id >= 0) {
+                msgpack_pack_str(mp_pck, 7);
+                msgpack_pack_str_body(mp_pck, "unit_id", 7);
+                msgpack_pack_uint8(mp_pck, dev->unit_id);
             }
-            else {
-                msgpack_pack_uint16(mp_pck, registers[i]);
+
+            if (!IN_MODBUS_RAW_BLOCK(block)) {
+                point = &ctx->points[block->point];
+                if (dev->result[i] == -1) {
+                    mp_pck->callback(mp_pck->data, point->key,
+                                     point->key_len);
+                    msgpack_pack_nil(mp_pck);
+                }
+                else {
+                    pack_point(point, buf, mp_pck);
+                }
+                continue;
             }
+
+            msgpack_pack_str(mp_pck, strlen(type_str[type]));
+            msgpack_pack_str_body(mp_pck, type_str[type],
+                                  strlen(type_str[type]));
+            msgpack_pack_map(mp_pck, 1);
+            pack_blocks(mp_pck, plan, buf + plan->buf_offset,
+                        dev->result[i], dev->errnum[i], ctx->packed_bits,
+                        block);
         }
     }
 
     return 0;
 }
 
-/* collect callback */
-static int in_modbus_collect(struct flb_input_instance *i_ins,
-                             struct flb_config *config, void *in_context)
+/*
+ * Whether a numeric point moved by more than its deadband from the value
+ * last reported, NaN being unknown.
+ */
+static inline int point_moved(struct in_modbus_point *point, double prev,
+                              double value)
 {
-    struct flb_in_modbus_config *ctx = in_context;
-    msgpack_packer mp_pck;
-    msgpack_sbuffer mp_sbuf;
+    if (isnan(prev) || isnan(value)) {
+        return FLB_TRUE;
+    }
+    return fabs(value - prev) > point->deadband;
+}
 
+/*
+ * Report by exception: pack only the points that changed since the last
+ * record, raw values keyed by address and typed points by name. Returns
+ * 0 without packing anything when no point moved and no read failed.
+ */
+static int pack_changes(struct flb_in_modbus_config *ctx,
+                        struct in_modbus_device *dev, char *buf,
+                        uint64_t scan, msgpack_packer *mp_pck)
+{
     int i;
-    int ret;
+    int j;
+    int k;
+    int len;
+    int type;
     int map_entries;
-    int nbits;
-    int nbytes;
+    int npoints;
+    int entries[IN_MODBUS_TYPES] = { 0 };
+    int errors[IN_MODBUS_TYPES] = { 0 };
+    int header[IN_MODBUS_TYPES] = { 0 };
+    char key[8];
+    double value;
+    const char *error;
+    uint8_t *changed;
     uint8_t *bits;
     uint16_t *registers;
+    struct in_modbus_plan *plan;
+    struct in_modbus_block *block;
+    struct in_modbus_point *point;
+
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        if (!in_modbus_plan_due(plan, scan)) {
+            continue;
+        }
 
-    /* If last call received connection error, try to reconnect */
-    if (connection_error(ctx->err)) {
-        modbus_close(ctx->modbus_ctx);
-        if (in_modbus_connect(ctx) == -1) {
-            return -1;
+        if (dev->result[i] == -1) {
+            errors[plan->type] = 1;
+            continue;
+        }
+
+        changed = dev->changed + plan->buf_offset;
+        if (!dev->valid[i]) {
+            /* No snapshot yet, every point is news */
+            memcpy(dev->prev + plan->buf_offset, buf + plan->buf_offset,
+                   plan->size * (BIT_TYPE(plan->type) ? 1 : 2));
+            memset(changed, 1, plan->size);
+            dev->valid[i] = 1;
+        }
+        else if (in_modbus_plan_diff(plan, buf + plan->buf_offset,
+                                     dev->prev + plan->buf_offset,
+                                     changed) == 0) {
+            continue;
+        }
+
+        for (j = 0; j < plan->nblocks; j++) {
+            block = &plan->blocks[j];
+            if (!IN_MODBUS_RAW_BLOCK(block)) {
+                continue;
+            }
+            for (k = block->offset; k < block->offset + block->no; k++) {
+                entries[plan->type] += changed[k];
+            }
+        }
+    }
+
+    /*
+     * A typed point is sent again when any of its registers moved and,
+     * for numbers, its value moved by more than its deadband since it
+     * was last reported.
+     */
+    npoints = 0;
+    for (i = 0; i < ctx->npoints; i++) {
+        point = &ctx->points[i];
+        dev->point_changed[i] = 0;
+        if (!in_modbus_plan_due(&ctx->plans[point->plan], scan) ||
+            dev->result[point->plan] == -1) {
+            continue;
         }
+
+        changed = dev->changed + ctx->plans[point->plan].buf_offset;
+        for (k = point->reg; k < point->reg + point->nregs; k++) {
+            dev->point_changed[i] |= changed[k];
+        }
+        if (dev->point_changed[i] &&
+            in_modbus_point_value(point,
+                                  (uint16_t *) (buf + point->buf_offset),
+                                  &value) == 0) {
+            dev->point_changed[i] = point_moved(point, dev->point_prev[i],
+                                                value);
+            if (dev->point_changed[i]) {
+                dev->point_prev[i] = value;
+            }
+        }
+        npoints += dev->point_changed[i];
+    }
+
+    map_entries = npoints;
+    for (type = 0; type < IN_MODBUS_TYPES; type++) {
+        map_entries += entries[type] + errors[type] > 0;
+    }
+    if (map_entries == 0) {
+        return 0;
+    }
+    map_entries += dev->unit_id >= 0;
+
+    msgpack_pack_array(mp_pck, 2);
+    pack_scan_time(ctx, dev, scan, mp_pck);
+    msgpack_pack_map(mp_pck, map_entries);
+
+    if (dev->unit_id >= 0) {
+        msgpack_pack_str(mp_pck, 7);
+        msgpack_pack_str_body(mp_pck, "unit_id", 7);
+        msgpack_pack_uint8(mp_pck, dev->unit_id);
     }
 
-    map_entries = (ctx->coil_no > 0) +
-                  (ctx->discrete_input_no > 0) +
-                  (ctx->holding_reg_no > 0) +
-                  (ctx->input_reg_no > 0);
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        type = plan->type;
+        if (!in_modbus_plan_due(plan, scan)) {
+            continue;
+        }
+
+        /* Once per type, at its first due plan */
+        if (!header[type] && entries[type] + errors[type] > 0) {
+            msgpack_pack_str(mp_pck, strlen(type_str[type]));
+            msgpack_pack_str_body(mp_pck, type_str[type],
+                                  strlen(type_str[type]));
+            msgpack_pack_map(mp_pck, entries[type] + errors[type]);
+            header[type] = 1;
+        }
+
+        if (dev->result[i] == -1) {
+            /* One error per type, whichever plan failed first */
+            if (errors[type]) {
+                error = modbus_strerror(dev->errnum[i]);
+                msgpack_pack_str(mp_pck, 5);
+                msgpack_pack_str_body(mp_pck, "error", 5);
+                msgpack_pack_str(mp_pck, strlen(error));
+                msgpack_pack_str_body(mp_pck, error, strlen(error));
+                errors[type] = 0;
+            }
+            continue;
+        }
+
+        changed = (uint8_t *) dev->changed + plan->buf_offset;
+        bits = (uint8_t *) (buf + plan->buf_offset);
+        registers = (uint16_t *) (buf + plan->buf_offset);
+
+        for (j = 0; j < plan->nblocks; j++) {
+            block = &plan->blocks[j];
+            if (!IN_MODBUS_RAW_BLOCK(block)) {
+                continue;
+            }
+
+            for (k = block->offset; k < block->offset + block->no; k++) {
+                if (!changed[k]) {
+                    continue;
+                }
+
+                len = snprintf(key, sizeof(key), "%d",
+                               block->addr + k - block->offset);
+                msgpack_pack_str(mp_pck, len);
+                msgpack_pack_str_body(mp_pck, key, len);
+                if (BIT_TYPE(type)) {
+                    msgpack_pack_uint8(mp_pck, bits[k]);
+                }
+                else {
+                    msgpack_pack_uint16(mp_pck, registers[k]);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < ctx->npoints; i++) {
+        point = &ctx->points[i];
+        if (dev->point_changed[i]) {
+            pack_point(point, buf, mp_pck);
+        }
+    }
 
-    /* Initializing Message Pack */
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    return 0;
+}
+
+/* Whether the next record of a slave reports every point */
+static int integrity_due(struct flb_in_modbus_config *ctx,
+                         struct in_modbus_device *dev)
+{
+    uint64_t now;
+
+    if (!ctx->report_by_exception) {
+        return FLB_TRUE;
+    }
+
+    now = in_modbus_time_ms();
+    if (now < dev->integrity_ms) {
+        return FLB_FALSE;
+    }
+
+    /* 0 sends a single full record, at the first scan */
+    if (ctx->integrity_interval_ms > 0) {
+        dev->integrity_ms = now + ctx->integrity_interval_ms;
+    }
+    else {
+        dev->integrity_ms = UINT64_MAX;
+    }
+
+    return FLB_TRUE;
+}
+
+/*
+ * Pack the outcome of a scan of a slave as a record, only the plans due
+ * on that scan are part of it. 'buf' holds the values of every plan at
+ * plan->buf_offset. Typed points come after the raw values, by name.
+ */
+int in_modbus_pack_device(struct flb_in_modbus_config *ctx,
+                          struct in_modbus_device *dev, char *buf,
+                          uint64_t scan, msgpack_packer *mp_pck)
+{
+    int i;
+    int type;
+    int map_entries;
+    int entries[IN_MODBUS_TYPES] = { 0 };
+    struct in_modbus_plan *plan;
+    struct in_modbus_point *point;
+
+    if (ctx->record_per_block) {
+        return pack_per_block(ctx, dev, buf, scan, mp_pck);
+    }
+
+    if (!integrity_due(ctx, dev)) {
+        return pack_changes(ctx, dev, buf, scan, mp_pck);
+    }
+
+    map_entries = dev->unit_id >= 0;
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        if (in_modbus_plan_due(plan, scan)) {
+            entries[plan->type] += plan->nraw;
+        }
+    }
+    for (type = 0; type < IN_MODBUS_TYPES; type++) {
+        map_entries += entries[type] > 0;
+    }
+    for (i = 0; i < ctx->npoints; i++) {
+        map_entries += in_modbus_plan_due(&ctx->plans[ctx->points[i].plan],
+                                          scan);
+    }
 
-    msgpack_pack_array(&mp_pck, 2);
-    flb_pack_time_now(&mp_pck);
+    msgpack_pack_array(mp_pck, 2);
+    pack_scan_time(ctx, dev, scan, mp_pck);
 
     /* Coils, Discrete Inputs */
-    msgpack_pack_map(&mp_pck, map_entries);
+    msgpack_pack_map(mp_pck, map_entries);
 
-    nbits = ctx->coil_no > ctx->discrete_input_no ?
-            ctx->coil_no : ctx->discrete_input_no;
-    bits = (uint8_t *) flb_calloc(nbits, sizeof(uint8_t));
-    if (!bits) {
-        flb_errno();
+    if (dev->unit_id >= 0) {
+        msgpack_pack_str(mp_pck, 7);
+        msgpack_pack_str_body(mp_pck, "unit_id", 7);
+        msgpack_pack_uint8(mp_pck, dev->unit_id);
+    }
+
+    /* Plans are sorted by type, the blocks of a type stay together */
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        type = plan->type;
+        if (!in_modbus_plan_due(plan, scan)) {
+            continue;
+        }
+
+        /* Integrity record, changes are tracked from these values on */
+        if (ctx->report_by_exception && dev->result[i] != -1) {
+            memcpy(dev->prev + plan->buf_offset, buf + plan->buf_offset,
+                   plan->size * (BIT_TYPE(type) ? 1 : 2));
+            dev->valid[i] = 1;
+        }
+
+        if (plan->nraw == 0) {
+            continue;
+        }
+
+        if (entries[type] > 0) {
+            msgpack_pack_str(mp_pck, strlen(type_str[type]));
+            msgpack_pack_str_body(mp_pck, type_str[type],
+                                  strlen(type_str[type]));
+            if (ctx->keyed[type]) {
+                msgpack_pack_map(mp_pck, entries[type]);
+            }
+            entries[type] = 0;
+        }
+
+        if (ctx->keyed[type]) {
+            pack_blocks(mp_pck, plan, buf + plan->buf_offset,
+                        dev->result[i], dev->errnum[i], ctx->packed_bits,
+                        NULL);
+        }
+        else {
+            pack_inputs(mp_pck, plan, buf + plan->buf_offset,
+                        dev->result[i], dev->errnum[i], ctx->packed_bits);
+        }
+    }
+
+    /* Points of a failed read are nil */
+    for (i = 0; i < ctx->npoints; i++) {
+        point = &ctx->points[i];
+        if (!in_modbus_plan_due(&ctx->plans[point->plan], scan)) {
+            continue;
+        }
+
+        if (dev->result[point->plan] == -1) {
+            mp_pck->callback(mp_pck->data, point->key, point->key_len);
+            msgpack_pack_nil(mp_pck);
+        }
+        else {
+            pack_point(point, buf, mp_pck);
+        }
+
+        /* Deadbands of the points count from the reported values */
+        if (ctx->report_by_exception &&
+            (dev->result[point->plan] == -1 ||
+             in_modbus_point_value(point,
+                                   (uint16_t *) (buf + point->buf_offset),
+                                   &dev->point_prev[i]) == -1)) {
+            dev->point_prev[i] = NAN;
+        }
+    }
+
+    return 0;
+}
+
+/* Whether any plan has to be read on this scan */
+int in_modbus_scan_due(struct flb_in_modbus_config *ctx, uint64_t scan)
+{
+    int i;
+
+    for (i = 0; i < ctx->nplans; i++) {
+        if (in_modbus_plan_due(&ctx->plans[i], scan)) {
+            return FLB_TRUE;
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * Read the plans of one slave due on 'scan' into 'buf'. Returns -1 at
+ * once when the connection is down or the slave is backed off for being
+ * slow. On a connection error the remaining
+ * reads are skipped and the connection is handed over for reconnection.
+ */
+int in_modbus_collect_device(struct flb_in_modbus_config *ctx,
+                             struct in_modbus_device *dev, char *buf,
+                             uint64_t scan)
+{
+    int i;
+    uint64_t start;
+    uint64_t latency;
+    struct in_modbus_plan *plan;
+    struct modbus_conn *link = dev->conn->link;
+
+    if (in_modbus_sched_skip(ctx, dev)) {
         return -1;
     }
 
-    nbytes = ctx->holding_reg_no > ctx->input_reg_no ?
-             ctx->holding_reg_no : ctx->input_reg_no;
-    registers = (uint16_t *) flb_calloc(nbytes, sizeof(uint16_t));
-    if (!registers) {
-        flb_errno();
+    if (modbus_conn_acquire(link) == -1) {
         return -1;
     }
+    start = in_modbus_stats_time_us();
 
-    /* Read coil values */
-    if (ctx->coil_no > 0) {
-        errno = 0;
-        ret = modbus_read_bits(ctx->modbus_ctx,
-                               ctx->coil_addr,
-                               ctx->coil_no, bits);
-        if (pack_inputs(ctx, &mp_pck, bits, COILS, ret) == -1) {
-            goto cleanup;
-        }
+    if (in_modbus_device_select(dev) == -1) {
+        flb_error("[in_modbus] Invalid unit id %d", dev->unit_id);
+        modbus_conn_release(link);
+        return -1;
     }
 
-    /* Read input bits values */
-    if (ctx->discrete_input_no > 0) {
-        errno = 0;
-        ret = modbus_read_input_bits(ctx->modbus_ctx,
-                                     ctx->discrete_input_addr,
-                                     ctx->discrete_input_no, bits);
-        if (pack_inputs(ctx, &mp_pck, bits, DISCRETE_INPUTS, ret) == -1) {
-            goto cleanup;
+    /*
+     * Read every plan, the plan splits each range into as many
+     * requests as the PDU size allows and stores them in one array.
+     */
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        if (!in_modbus_plan_due(plan, scan)) {
+            continue;
         }
+
+        dev->result[i] = in_modbus_plan_read(plan, link,
+                                             buf + plan->buf_offset,
+                                             dev->stamps + plan->first_read);
+        dev->errnum[i] = errno;
+
+        if (dev->result[i] == -1 && connection_error(errno)) {
+            if (ctx->stats) {
+                in_modbus_stats_error(ctx, dev, dev->errnum[i]);
+            }
+            modbus_conn_fail(link, dev->errnum[i]);
+            modbus_conn_release(link);
+            return -1;
+        }
+    }
+
+    modbus_conn_release(link);
+
+    latency = in_modbus_stats_time_us() - start;
+    if (ctx->stats) {
+        in_modbus_stats_device(ctx, dev, scan, latency);
     }
+    in_modbus_sched_scanned(ctx, dev, latency);
+
+    return 0;
+}
 
-    /* Read register values */
-    if (ctx->holding_reg_no > 0) {
-        errno = 0;
-        ret = modbus_read_registers(ctx->modbus_ctx,
-                                    ctx->holding_reg_addr,
-                                    ctx->holding_reg_no, registers);
-        if (pack_inputs(ctx, &mp_pck, registers, HOLDING_REGISTERS, ret) == -1) {
-            goto cleanup;
+/* Usual size of the record of one slave, in bytes */
+size_t in_modbus_pack_size(struct flb_in_modbus_config *ctx)
+{
+    int i;
+    size_t size;
+    struct in_modbus_plan *plan;
+
+    /* Array, timestamp, map and unit id */
+    size = 32;
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        /* Type key, array or error map, one key per block when keyed */
+        size += 24 + 64 + plan->nblocks * 16 + plan->points * 3;
+        if (ctx->report_by_exception) {
+            /* Every point keyed by its address */
+            size += plan->points * 6;
         }
+        if (ctx->record_per_block) {
+            /* Array, timestamp, map, unit id and type key per block */
+            size += plan->nblocks * 48;
+        }
+    }
+
+    for (i = 0; i < ctx->npoints; i++) {
+        size += ctx->points[i].key_len + 10 + ctx->points[i].nregs * 2;
     }
 
-    /* Read input register values */
-    if (ctx->input_reg_no > 0) {
-        errno = 0;
-        ret = modbus_read_input_registers(ctx->modbus_ctx,
-                                          ctx->input_reg_addr,
-                                          ctx->input_reg_no, registers);
-        if (pack_inputs(ctx, &mp_pck, registers, INPUT_REGISTERS, ret) == -1) {
-            goto cleanup;
+    return size;
+}
+
+/*
+ * Grow 'sbuf' to hold at least 'size' bytes, at least doubling it so
+ * appends stay amortized. Returns 1 when it had to grow.
+ */
+int in_modbus_sbuffer_reserve(msgpack_sbuffer *sbuf, size_t size)
+{
+    char *data;
+
+    if (sbuf->alloc >= size) {
+        return 0;
+    }
+    if (size < sbuf->alloc * 2) {
+        size = sbuf->alloc * 2;
+    }
+
+    /* msgpack releases the buffer with free() */
+    data = realloc(sbuf->data, size);
+    if (!data) {
+        flb_errno();
+        return -1;
+    }
+    sbuf->data = data;
+    sbuf->alloc = size;
+
+    return 1;
+}
+
+/* collect callback */
+static int in_modbus_collect(struct flb_input_instance *i_ins,
+                             struct flb_config *config, void *in_context)
+{
+    struct flb_in_modbus_config *ctx = in_context;
+    msgpack_packer mp_pck;
+
+    int i;
+    size_t size;
+    size_t alloc;
+    uint64_t scan;
+    uint64_t slot;
+    uint64_t start;
+    struct mk_list *head;
+    struct in_modbus_device *dev;
+
+    if (ctx->stats) {
+        in_modbus_stats_collect(ctx);
+    }
+    in_modbus_clock_sync(ctx);
+
+    if (ctx->async) {
+        in_modbus_async_scan(ctx);
+        ctx->scan++;
+        return 0;
+    }
+
+    /* Callbacks piled up behind a scan that ran over are dropped */
+    start = in_modbus_stats_time_us();
+    if (!in_modbus_sched_begin(ctx, start)) {
+        return 0;
+    }
+
+    /* Blocks with a longer interval are only read every few ticks */
+    slot = ctx->slot++;
+    scan = slot / ctx->nslots;
+    if (!in_modbus_scan_due(ctx, scan)) {
+        return 0;
+    }
+
+    /* Buffers are sized at configure time and reused by every scan */
+    msgpack_sbuffer_clear(&ctx->mp_sbuf);
+    msgpack_packer_init(&mp_pck, &ctx->mp_sbuf, msgpack_sbuffer_write);
+    alloc = ctx->mp_sbuf.alloc;
+
+    /*
+     * One record per slave of the slot. Slaves behind a broken link are
+     * skipped, it is reopened in the background.
+     */
+    i = 0;
+    mk_list_foreach(head, &ctx->devices) {
+        dev = mk_list_entry(head, struct in_modbus_device, _head);
+        if (i++ % ctx->nslots != slot % ctx->nslots) {
+            continue;
+        }
+        if (in_modbus_collect_device(ctx, dev, ctx->buf, scan) == 0) {
+            size = ctx->mp_sbuf.size;
+            in_modbus_pack_device(ctx, dev, ctx->buf, scan, &mp_pck);
+            if (ctx->stats) {
+                in_modbus_stats_bytes(ctx, dev, ctx->mp_sbuf.size - size);
+            }
         }
     }
 
-    flb_input_chunk_append_raw(i_ins, NULL, 0, mp_sbuf.data, mp_sbuf.size);
+    if (ctx->mp_sbuf.size > 0) {
+        flb_input_chunk_append_raw(i_ins, NULL, 0, ctx->mp_sbuf.data,
+                                   ctx->mp_sbuf.size);
+        ctx->appends++;
+    }
 
-cleanup:
-    msgpack_sbuffer_destroy(&mp_sbuf);
+    if (ctx->mp_sbuf.alloc != alloc) {
+        ctx->allocs++;
+    }
 
-    flb_free(bits);
-    flb_free(registers);
+    in_modbus_sched_end(ctx, start, in_modbus_stats_time_us());
 
     return 0;
 }
@@ -252,22 +946,318 @@ int value_from_cfg(struct flb_input_instance *in, char *key, int def)
     }
 }
 
+/*
+ * Parse a list of blocks such as "100:5, 200:10@250~4" (address:number,
+ * optionally followed by a scan interval in milliseconds and a deadband).
+ * The blocks are appended to 'blocks', which has room for 'max' entries.
+ */
+static int parse_blocks(const char *str, struct in_modbus_block *blocks,
+                        int max, int interval_ms, int deadband)
+{
+    int n = 0;
+    long addr;
+    long no;
+    long interval;
+    long db;
+    char *end;
+
+    while (*str) {
+        while (*str == ' ' || *str == ',') {
+            str++;
+        }
+        if (*str == '\0') {
+            break;
+        }
+
+        addr = strtol(str, &end, 10);
+        if (end == str || *end != ':') {
+            return -1;
+        }
+        str = end + 1;
+        no = strtol(str, &end, 10);
+        if (end == str || n == max) {
+            return -1;
+        }
+        str = end;
+
+        interval = interval_ms;
+        if (*str == '@') {
+            str++;
+            interval = strtol(str, &end, 10);
+            if (end == str || interval <= 0) {
+                return -1;
+            }
+            str = end;
+        }
+
+        db = deadband;
+        if (*str == '~') {
+            str++;
+            db = strtol(str, &end, 10);
+            if (end == str || db < 0) {
+                return -1;
+            }
+            str = end;
+        }
+
+        blocks[n].addr = addr;
+        blocks[n].no = no;
+        blocks[n].offset = 0;
+        blocks[n].interval_ms = interval;
+        blocks[n].deadband = db;
+        blocks[n].point = -1;
+        n++;
+
+        while (*str == ' ') {
+            str++;
+        }
+        if (*str != '\0' && *str != ',') {
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+static int gcd(int a, int b)
+{
+    int t;
+
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* Build one plan per distinct interval of the blocks of a data type */
+static int add_plans(struct flb_in_modbus_config *ctx, int type,
+                     struct in_modbus_block *blocks, int nblocks)
+{
+    int i;
+    int n;
+    int ret;
+    int max;
+    int gap;
+    int interval;
+    int nintervals = 0;
+    struct in_modbus_plan *plans;
+    struct in_modbus_plan *plan;
+    struct in_modbus_block *group;
+
+    /* max_gap is given in registers, bits may skip as many bytes */
+    if (BIT_TYPE(type)) {
+        max = ctx->max_read_bits;
+        gap = ctx->max_gap * 16;
+    }
+    else {
+        max = ctx->max_read_registers;
+        gap = ctx->max_gap;
+    }
+
+    group = flb_malloc(nblocks * sizeof(struct in_modbus_block));
+    if (!group) {
+        flb_errno();
+        return -1;
+    }
+
+    /* Intervals are taken in increasing order, each one only once */
+    interval = 0;
+    while (1) {
+        n = 0;
+        for (i = 0; i < nblocks; i++) {
+            if (blocks[i].interval_ms > interval &&
+                (n == 0 || blocks[i].interval_ms < group[0].interval_ms)) {
+                group[0] = blocks[i];
+                n = 1;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        interval = group[0].interval_ms;
+
+        n = 0;
+        for (i = 0; i < nblocks; i++) {
+            if (blocks[i].interval_ms == interval) {
+                group[n++] = blocks[i];
+            }
+        }
+
+        plans = flb_realloc(ctx->plans,
+                            (ctx->nplans + 1) * sizeof(struct in_modbus_plan));
+        if (!plans) {
+            flb_errno();
+            flb_free(group);
+            return -1;
+        }
+        ctx->plans = plans;
+
+        plan = &ctx->plans[ctx->nplans];
+        ret = in_modbus_plan_build(plan, type, group, n, max, gap);
+        if (ret == -1) {
+            flb_free(group);
+            return -1;
+        }
+        ctx->nplans++;
+        nintervals += plan->nraw > 0;
+
+        flb_debug("[in_modbus] %s every %d ms: %d blocks, %d points, "
+                  "%d requests", type_str[type], interval, n, plan->points,
+                  plan->nreads);
+    }
+
+    /* Raw blocks on different schedules no longer fit a single array */
+    ctx->keyed[type] = nintervals > 1;
+
+    flb_free(group);
+    return 0;
+}
+
+static int configure_plans(struct flb_in_modbus_config *ctx,
+                           struct flb_input_instance *in)
+{
+    int i;
+    int j;
+    int ret;
+    int type;
+    int max;
+    int nblocks;
+    const char *str;
+    struct in_modbus_block *blocks;
+    struct in_modbus_plan *plan;
+    struct in_modbus_point *point;
+
+    /* Single range given with <type>_addr and <type>_no */
+    int addr[IN_MODBUS_TYPES] = {
+        ctx->coil_addr, ctx->discrete_input_addr,
+        ctx->holding_reg_addr, ctx->input_reg_addr
+    };
+    int no[IN_MODBUS_TYPES] = {
+        ctx->coil_no, ctx->discrete_input_no,
+        ctx->holding_reg_no, ctx->input_reg_no
+    };
+
+    for (type = 0; type < IN_MODBUS_TYPES; type++) {
+        str = flb_input_get_property(blocks_str[type], in);
+        max = 1 + (str ? strlen(str) / 2 : 0) + ctx->npoints;
+
+        blocks = flb_malloc(max * sizeof(struct in_modbus_block));
+        if (!blocks) {
+            flb_errno();
+            return -1;
+        }
+
+        nblocks = 0;
+        if (no[type] > 0) {
+            blocks[0].addr = addr[type];
+            blocks[0].no = no[type];
+            blocks[0].offset = 0;
+            blocks[0].interval_ms = ctx->interval_ms;
+            blocks[0].deadband = ctx->deadband;
+            blocks[0].point = -1;
+            nblocks++;
+        }
+
+        if (str) {
+            ret = parse_blocks(str, blocks + nblocks, max - nblocks,
+                               ctx->interval_ms, ctx->deadband);
+            if (ret == -1) {
+                flb_error("[in_modbus] Invalid %s '%s': has to be a list of "
+                          "address:number[@interval_ms][~deadband]",
+                          blocks_str[type], str);
+                flb_free(blocks);
+                return -1;
+            }
+            nblocks += ret;
+        }
+
+        /* Typed points are read by blocks of their own */
+        for (i = 0; i < ctx->npoints; i++) {
+            point = &ctx->points[i];
+            if (point->type != type) {
+                continue;
+            }
+            blocks[nblocks].addr = point->addr;
+            blocks[nblocks].no = point->nregs;
+            blocks[nblocks].offset = 0;
+            blocks[nblocks].interval_ms = ctx->interval_ms;
+            blocks[nblocks].deadband = 0;   /* on the value, pack_changes */
+            blocks[nblocks].point = i;
+            nblocks++;
+        }
+
+        ret = add_plans(ctx, type, blocks, nblocks);
+        flb_free(blocks);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    /* The collector ticks at the largest period every interval divides */
+    ctx->tick_ms = ctx->interval_ms;
+    for (i = 0; i < ctx->nplans; i++) {
+        ctx->tick_ms = gcd(ctx->plans[i].interval_ms, ctx->tick_ms);
+    }
+    for (i = 0; i < ctx->nplans; i++) {
+        ctx->plans[i].period = ctx->plans[i].interval_ms / ctx->tick_ms;
+    }
+
+    /* Each request of a scan has its response stamped */
+    ctx->nreads = 0;
+    for (i = 0; i < ctx->nplans; i++) {
+        ctx->plans[i].first_read = ctx->nreads;
+        ctx->nreads += ctx->plans[i].nreads;
+    }
+
+    /* One buffer holds a scan of a slave: bits first, then registers */
+    ctx->buf_size = 0;
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        if (!BIT_TYPE(plan->type)) {
+            ctx->buf_size += ctx->buf_size & 1;
+        }
+        plan->buf_offset = ctx->buf_size;
+        ctx->buf_size += plan->size * (BIT_TYPE(plan->type) ?
+                                       sizeof(uint8_t) : sizeof(uint16_t));
+    }
+
+    /* Locate the registers of every typed point */
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        for (j = 0; j < plan->nblocks; j++) {
+            if (!IN_MODBUS_RAW_BLOCK(&plan->blocks[j])) {
+                point = &ctx->points[plan->blocks[j].point];
+                point->plan = i;
+                point->reg = plan->blocks[j].offset;
+                point->buf_offset = plan->buf_offset +
+                                    point->reg * sizeof(uint16_t);
+            }
+        }
+    }
+
+    return 0;
+}
+
 static int configure(struct flb_in_modbus_config *ctx,
                      struct flb_input_instance *in)
 {
     const char *str;
-    const char *addr;
-    const char *port;
     const char *rate;
-    const char *tid;
-    int use_backend;
-    modbus_t *modbus_ctx;
 
-    modbus_ctx = NULL;
+    mk_list_init(&ctx->conns);
+    mk_list_init(&ctx->devices);
 
-    ctx->err = 0;
-    /* Interval settings (1 sec default scan) */
-    ctx->time_interval_sec = value_from_cfg(in, "time_interval", 1);
+    /* Interval settings (1 sec default scan), time_interval_ms wins */
+    ctx->interval_ms = value_from_cfg(in, "time_interval", 1) * 1000;
+    ctx->interval_ms = value_from_cfg(in, "time_interval_ms",
+                                      ctx->interval_ms);
+    if (ctx->interval_ms <= 0) {
+        flb_error("[in_modbus] time_interval has to be positive");
+        return -1;
+    }
 
     /* Modbus coils to scan */
     ctx->coil_addr = value_from_cfg(in, "coil_addr", 0);
@@ -285,17 +1275,75 @@ static int configure(struct flb_in_modbus_config *ctx,
     ctx->input_reg_addr = value_from_cfg(in, "input_reg_addr", 0);
     ctx->input_reg_no = value_from_cfg(in, "input_reg_no", 0);
 
+    /* Ranges larger than this are split over several requests */
+    ctx->max_read_bits = value_from_cfg(in, "max_read_bits",
+                                        MODBUS_MAX_READ_BITS);
+    ctx->max_read_registers = value_from_cfg(in, "max_read_registers",
+                                             MODBUS_MAX_READ_REGISTERS);
+    if (ctx->max_read_bits < 1 || ctx->max_read_bits > MODBUS_MAX_READ_BITS) {
+        flb_error("[in_modbus] max_read_bits has to be between 1 and %d",
+                  MODBUS_MAX_READ_BITS);
+        return -1;
+    }
+    if (ctx->max_read_registers < 1 ||
+        ctx->max_read_registers > MODBUS_MAX_READ_REGISTERS) {
+        flb_error("[in_modbus] max_read_registers has to be between 1 and %d",
+                  MODBUS_MAX_READ_REGISTERS);
+        return -1;
+    }
+
+    /* Hole between two blocks still read with a single request */
+    ctx->max_gap = value_from_cfg(in, "max_gap", 10);
+    if (ctx->max_gap < 0) {
+        ctx->max_gap = 0;
+    }
+
+    /* Coils and discrete inputs as bitfields instead of integer arrays */
+    str = flb_input_get_property("packed_bits", in);
+    ctx->packed_bits = str != NULL && flb_utils_bool(str);
+
+    /* Report by exception, only changed points between full records */
+    str = flb_input_get_property("report_by_exception", in);
+    ctx->report_by_exception = str != NULL && flb_utils_bool(str);
+    ctx->integrity_interval_ms = value_from_cfg(in, "integrity_interval",
+                                                60) * 1000;
+    if (ctx->integrity_interval_ms < 0) {
+        ctx->integrity_interval_ms = 0;
+    }
+    ctx->deadband = value_from_cfg(in, "deadband", 0);
+    if (ctx->deadband < 0) {
+        ctx->deadband = 0;
+    }
+
+    /* One record per block, dated by the response that carried it */
+    str = flb_input_get_property("record_per_block", in);
+    ctx->record_per_block = str != NULL && flb_utils_bool(str);
+    if (ctx->record_per_block && ctx->report_by_exception) {
+        flb_error("[in_modbus] record_per_block cannot be used with "
+                  "report_by_exception");
+        return -1;
+    }
+
+    /* Registers decoded as named, typed values */
+    if (in_modbus_points_configure(ctx, in) == -1) {
+        return -1;
+    }
+
+    if (configure_plans(ctx, in) == -1) {
+        return -1;
+    }
+
     /* Initializing Modbus connection */
     str = flb_input_get_property("backend", in);
     if (str != NULL) {
         if (strcmp(str, "tcp") == 0) {
-            use_backend = TCP;
+            ctx->backend = TCP;
         }
         else if (strcmp(str, "tcppi") == 0) {
-            use_backend = TCP_PI;
+            ctx->backend = TCP_PI;
         }
         else if (strcmp(str, "rtu") == 0) {
-            use_backend = RTU;
+            ctx->backend = RTU;
         }
         else {
             flb_error("[in_modbus] Backend %s unknown: has to be [tcp|tcppi|rtu]",
@@ -304,60 +1352,111 @@ static int configure(struct flb_in_modbus_config *ctx,
         }
     }
     else {
-        use_backend = TCP;
+        ctx->backend = TCP;
     }
 
-    /* Modbus slave (server) information */
-    addr = flb_input_get_property("address", in);
-    port = flb_input_get_property("tcp_port", in);
+    /* Serial line speed and framing, 8N1 by default */
     rate = flb_input_get_property("rate", in);
-
-    switch (use_backend) {
-    case TCP:
-        if (addr == NULL) {
-            flb_error("[in_modbus] Slave (tcp) address %s unknown");
-            return -1;
-        }
-        if (port == NULL) {
-            port = "502";
-        }
-        modbus_ctx = modbus_new_tcp(addr, atoi(port));
-        break;
-    case TCP_PI:
-        if (addr == NULL) {
-            flb_error("[in_modbus] Slave (tcppi) address %s unknown");
-            return -1;
-        }
-        if (port == NULL) {
-            port = "502";
-        }
-        modbus_ctx = modbus_new_tcp_pi(addr, port);
-        break;
-    default:
-        if (addr == NULL) {
-            flb_error("[in_modbus] Slave (rtu) device %s unknown");
+    if (ctx->backend == RTU) {
+        if (rate == NULL) {
+            flb_error("[in_modbus] Connection rate unknown");
             return -1;
         }
-        if (rate == NULL) {
-            flb_error("[in_modbus] Connection rate %s unknown");
+        ctx->rate = atoi(rate);
+        if (ctx->rate <= 0) {
+            flb_error("[in_modbus] Invalid connection rate %s", rate);
             return -1;
         }
-        modbus_ctx = modbus_new_rtu(addr, atoi(rate), 'N', 8, 1);
-        break;
     }
 
-    if (modbus_ctx == NULL) {
-        flb_error("[in_modbus] Unable to allocate modbus context");
+    str = flb_input_get_property("parity", in);
+    ctx->parity = modbus_conn_parity(str);
+    if (ctx->parity == -1) {
+        flb_error("[in_modbus] Parity %s unknown: has to be "
+                  "[none|even|odd]", str);
+        return -1;
+    }
+    ctx->data_bits = value_from_cfg(in, "data_bits", 8);
+    if (ctx->data_bits < 5 || ctx->data_bits > 8) {
+        flb_error("[in_modbus] data_bits has to be between 5 and 8");
+        return -1;
+    }
+    ctx->stop_bits = value_from_cfg(in, "stop_bits", 1);
+    if (ctx->stop_bits != 1 && ctx->stop_bits != 2) {
+        flb_error("[in_modbus] stop_bits has to be 1 or 2");
         return -1;
     }
 
-    //modbus_set_debug(modbus_ctx, TRUE);
-    modbus_set_error_recovery(modbus_ctx,
-                              MODBUS_ERROR_RECOVERY_PROTOCOL);
+    /* Responses slower than this are treated as a lost connection */
+    ctx->response_timeout_ms = value_from_cfg(in, "response_timeout", 500);
 
-    ctx->modbus_ctx = modbus_ctx;
+    /* Silence within a response that ends it, 0 keeps libmodbus' */
+    ctx->byte_timeout_ms = value_from_cfg(in, "byte_timeout", 0);
+    if (ctx->byte_timeout_ms < 0) {
+        ctx->byte_timeout_ms = 0;
+    }
 
-    if (in_modbus_connect(ctx) == -1) {
+    /* Reconnection backoff, doubling from min to max */
+    ctx->reconnect_min_ms = value_from_cfg(in, "reconnect_min_ms", 1000);
+    ctx->reconnect_max_ms = value_from_cfg(in, "reconnect_max_ms", 60000);
+    if (ctx->reconnect_min_ms < 1 ||
+        ctx->reconnect_max_ms < ctx->reconnect_min_ms) {
+        flb_error("[in_modbus] reconnect_min_ms has to be positive and not "
+                  "above reconnect_max_ms");
+        return -1;
+    }
+
+    /* Non-blocking transport, Modbus TCP only */
+    str = flb_input_get_property("async", in);
+    ctx->async = str != NULL && flb_utils_bool(str);
+    if (ctx->async && ctx->backend != TCP) {
+        flb_error("[in_modbus] async is only available with the tcp backend");
+        return -1;
+    }
+
+    /* Requests kept in flight on one connection (async only) */
+    ctx->pipeline_depth = value_from_cfg(in, "pipeline_depth", 1);
+    if (ctx->pipeline_depth < 1 ||
+        ctx->pipeline_depth > IN_MODBUS_MAX_PIPELINE) {
+        flb_error("[in_modbus] pipeline_depth has to be between 1 and %d",
+                  IN_MODBUS_MAX_PIPELINE);
+        return -1;
+    }
+
+    /* Polling threads, 0 polls from the engine thread */
+    ctx->workers = value_from_cfg(in, "workers", 0);
+    if (ctx->workers < 0) {
+        ctx->workers = 0;
+    }
+    if (ctx->workers > 0 && ctx->async) {
+        flb_error("[in_modbus] workers and async cannot be used together");
+        return -1;
+    }
+
+    /* Modbus slaves (servers) and the connections to reach them */
+    if (in_modbus_devices_configure(ctx, in) == -1) {
+        return -1;
+    }
+
+    /* Overruns, slaves spread over the tick and slow slaves */
+    if (in_modbus_sched_configure(ctx, in) == -1) {
+        return -1;
+    }
+
+    /* Counters per instance and per slave, summarized on exit */
+    if (in_modbus_stats_configure(ctx, in) == -1) {
+        return -1;
+    }
+
+    /* Scan and record buffers of the engine thread, reused by every scan */
+    ctx->buf = flb_calloc(1, ctx->buf_size + 1);
+    if (!ctx->buf) {
+        flb_errno();
+        return -1;
+    }
+    msgpack_sbuffer_init(&ctx->mp_sbuf);
+    if (in_modbus_sbuffer_reserve(&ctx->mp_sbuf, in_modbus_pack_size(ctx) *
+                                  mk_list_size(&ctx->devices)) == -1) {
         return -1;
     }
 
@@ -366,7 +1465,35 @@ static int configure(struct flb_in_modbus_config *ctx,
 
 static void config_destroy(struct flb_in_modbus_config *ctx)
 {
-    modbus_free(ctx->modbus_ctx);
+    int i;
+
+    in_modbus_pool_destroy(ctx);
+
+    if (ctx->stats) {
+        in_modbus_stats_report(ctx);
+        in_modbus_stats_destroy(ctx);
+    }
+
+    if (ctx->overruns > 0) {
+        flb_info("[in_modbus] %" PRIu64 " scans ran over their tick, "
+                 "%" PRIu64 " ticks %s", ctx->overruns, ctx->overrun_ticks,
+                 ctx->overrun_policy == IN_MODBUS_OVERRUN_SKIP ?
+                 "skipped" : "stretched");
+    }
+
+    if (ctx->appends > 0) {
+        flb_debug("[in_modbus] %" PRIu64 " appends, %" PRIu64 " allocations "
+                  "on the collect path", ctx->appends, ctx->allocs);
+    }
+
+    for (i = 0; i < ctx->nplans; i++) {
+        in_modbus_plan_destroy(&ctx->plans[i]);
+    }
+    flb_free(ctx->plans);
+    in_modbus_points_destroy(ctx);
+    in_modbus_devices_destroy(ctx);
+    flb_free(ctx->buf);
+    msgpack_sbuffer_destroy(&ctx->mp_sbuf);
     flb_free(ctx);
 }
 
@@ -378,10 +1505,12 @@ static int in_modbus_init(struct flb_input_instance *in,
 
     struct flb_in_modbus_config *ctx = NULL;
 
-    ctx = flb_malloc(sizeof(struct flb_in_modbus_config));
+    ctx = flb_calloc(1, sizeof(struct flb_in_modbus_config));
     if (ctx == NULL) {
         return -1;
     }
+    ctx->ins = in;
+    ctx->evl = config->evl;
 
     /* Initialize head config */
     ret = configure(ctx, in);
@@ -391,11 +1520,28 @@ static int in_modbus_init(struct flb_input_instance *in,
     }
 
     flb_input_set_context(in, ctx);
-    ret = flb_input_set_collector_time(in,
-                                       in_modbus_collect,
-                                       ctx->time_interval_sec,
-                                       0,
-                                       config);
+
+    /* Polling threads hand their records over through a pipe */
+    if (ctx->workers > 0) {
+        ret = in_modbus_pool_create(ctx);
+        if (ret == 0) {
+            ret = flb_input_set_collector_event(in,
+                                                in_modbus_pool_collect,
+                                                ctx->pool->ch[0],
+                                                config);
+        }
+        if (ret >= 0) {
+            ret = in_modbus_pool_start(ctx);
+        }
+    }
+    else {
+        /* One callback per slot, the whole tick without spread */
+        ret = flb_input_set_collector_time(in,
+                                           in_modbus_collect,
+                                           ctx->slot_us / 1000000,
+                                           (ctx->slot_us % 1000000) * 1000,
+                                           config);
+    }
 
     if (ret < 0) {
         flb_error("could not set collector for dummy input plugin");
@@ -24,15 +24,75 @@
 #ifndef FLB_IN_MODBUS_H
 #define FLB_IN_MODBUS_H
 
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_pack.h>
 #include <modbus.h>
 
+#include "modbus_conn.h"
+#include "in_modbus_plan.h"
+
+enum {
+    COILS = 0,
+    DISCRETE_INPUTS,
+    HOLDING_REGISTERS,
+    INPUT_REGISTERS
+};
+
+#define IN_MODBUS_TYPES 4
+
+#define BIT_TYPE(type) ((type) == COILS || (type) == DISCRETE_INPUTS)
+
 struct flb_in_modbus_config {
-    /* 'no' postfix stands for Number of Points */
-    modbus_t *modbus_ctx;
-    int err;
+    int backend;
+
+    /* Serial line (rtu): speed, parity, character size */
+    int rate;
+    int parity;         /* N, E or O */
+    int data_bits;
+    int stop_bits;
+
+    /* Slaves to poll and the connections (gateways, serial lines) to them */
+    struct mk_list conns;
+    struct mk_list devices;
 
-    int time_interval_sec;
+    /* Delays between attempts to reopen a broken connection */
+    int reconnect_min_ms;
+    int reconnect_max_ms;
 
+    /* Non-blocking Modbus TCP transport driven by the engine event loop */
+    int async;
+    int response_timeout_ms;
+    int byte_timeout_ms;
+    int pipeline_depth;
+
+    /* Optional polling threads, each owning a share of the connections */
+    int workers;
+    struct in_modbus_pool *pool;
+
+    /* Default scan interval and the collector tick driving every block */
+    int interval_ms;
+    int tick_ms;
+    uint64_t scan;      /* number of the next scan, counted in ticks */
+
+    /*
+     * Blocking transport on the engine thread: the tick is cut in
+     * 'nslots' slots, each scanning its share of the slaves (spread).
+     */
+    int spread;
+    int nslots;
+    uint64_t slot;      /* number of the next slot */
+    uint64_t slot_us;
+    uint64_t next_us;   /* monotonic, when the next slot is due */
+
+    /* Scans running over the next tick, and slaves slowing them down */
+    int overrun_policy;
+    uint64_t overruns;
+    uint64_t overrun_ticks;
+    uint64_t overrun_log_us;
+    int slow_scan_ms;
+    int slow_backoff_max;
+
+    /* 'no' postfix stands for Number of Points */
     int coil_addr;
     int coil_no;
 
@@ -44,6 +104,80 @@ struct flb_in_modbus_config {
 
     int input_reg_addr;
     int input_reg_no;
+
+    /* Largest request sent to the slave, per data width */
+    int max_read_bits;
+    int max_read_registers;
+
+    /* Largest hole between two blocks read with a single request */
+    int max_gap;
+
+    /* Coils and discrete inputs packed 8 per byte in a msgpack bin */
+    int packed_bits;
+
+    /* Report by exception: changed points only, full record periodically */
+    int report_by_exception;
+    int integrity_interval_ms;
+    int deadband;
+
+    /* One record per block, stamped with the response that carried it */
+    int record_per_block;
+
+    /* Realtime minus monotonic clock, to date the response stamps */
+    int64_t clock_offset_ns;
+
+    /* Named values decoded from registers */
+    struct in_modbus_point *points;
+    int npoints;
+
+    /*
+     * Requests issued by the scans, one plan per data type and interval,
+     * ordered by type. Types with several intervals are keyed by block.
+     */
+    struct in_modbus_plan *plans;
+    int nplans;
+    int nreads;         /* requests of every plan, one stamp each */
+    int keyed[IN_MODBUS_TYPES];
+
+    /* Size of the values of one slave scan, the plans lay out the rest */
+    size_t buf_size;
+
+    /* Buffers of the engine thread, sized once and reused by every scan */
+    char *buf;
+    msgpack_sbuffer mp_sbuf;
+
+    /*
+     * Heap allocations made while collecting: expected to stay at 0 on the
+     * engine thread, one per scan of a polling thread for its buffer
+     */
+    uint64_t appends;
+    uint64_t allocs;
+
+    /* Scan counters and latencies, as metrics and on exit (optional) */
+    struct in_modbus_stats *stats;
+    int stats_interval_ms;      /* per-slave records, 0 for none */
+
+    struct flb_input_instance *ins;
+    struct mk_event_loop *evl;
 };
 
+struct in_modbus_device;
+struct in_modbus_pool;
+struct in_modbus_stats;
+
+int in_modbus_collect_device(struct flb_in_modbus_config *ctx,
+                             struct in_modbus_device *dev, char *buf,
+                             uint64_t scan);
+int in_modbus_pack_device(struct flb_in_modbus_config *ctx,
+                          struct in_modbus_device *dev, char *buf,
+                          uint64_t scan, msgpack_packer *mp_pck);
+size_t in_modbus_pack_size(struct flb_in_modbus_config *ctx);
+void in_modbus_pack_values(msgpack_packer *mp_pck, int type, void *inputs,
+                           struct in_modbus_block *block);
+void in_modbus_pack_values_slow(msgpack_packer *mp_pck, int type,
+                                void *inputs, struct in_modbus_block *block);
+int in_modbus_sbuffer_reserve(msgpack_sbuffer *sbuf, size_t size);
+int in_modbus_scan_due(struct flb_in_modbus_config *ctx, uint64_t scan);
+int value_from_cfg(struct flb_input_instance *in, char *key, int def);
+
 #endif
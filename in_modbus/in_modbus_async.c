@@ -0,0 +1,671 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_engine.h>
+#include <fluent-bit/flb_pack.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <modbus.h>
+
+#include "in_modbus.h"
+#include "in_modbus_device.h"
+#include "in_modbus_async.h"
+#include "in_modbus_sched.h"
+#include "in_modbus_stats.h"
+#include "in_modbus_clock.h"
+
+/* Function codes of the four data types */
+static const uint8_t read_fc[IN_MODBUS_TYPES] = { 0x01, 0x02, 0x03, 0x04 };
+
+uint64_t in_modbus_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int async_event(void *data);
+
+static int async_register(struct in_modbus_conn *conn, uint32_t mask)
+{
+    struct in_modbus_async *async = conn->async;
+
+    return mk_event_add(async->ctx->evl, async->fd, FLB_ENGINE_EV_CUSTOM,
+                        mask, &conn->event);
+}
+
+static void async_close(struct in_modbus_conn *conn)
+{
+    struct in_modbus_async *async = conn->async;
+
+    if (async->fd != -1) {
+        mk_event_del(async->ctx->evl, &conn->event);
+        close(async->fd);
+        async->fd = -1;
+    }
+
+    async->state = ASYNC_DOWN;
+    async->busy = 0;
+    async->inflight = 0;
+    memset(async->reqs, 0, sizeof(async->reqs));
+    async->rlen = 0;
+    async->wlen = 0;
+    async->woff = 0;
+}
+
+/*
+ * Drop the link, the slaves left in the scan get no record. It is
+ * reopened once the backoff delay is over.
+ */
+static void async_fail(struct in_modbus_conn *conn, int err)
+{
+    int i;
+    struct in_modbus_async *async = conn->async;
+
+    conn->err = err;
+    if (async->ctx->stats) {
+        for (i = 0; i < conn->ndevs; i++) {
+            in_modbus_stats_error(async->ctx, conn->devs[i], err);
+        }
+    }
+    flb_error("Connection to Modbus slave %s failed: %s\n",
+              conn->address, modbus_strerror(err));
+    async_close(conn);
+
+    async->retry_ms = in_modbus_time_ms() +
+        modbus_conn_backoff_ms(async->failures++,
+                               async->ctx->reconnect_min_ms,
+                               async->ctx->reconnect_max_ms);
+}
+
+static int async_connect(struct in_modbus_conn *conn)
+{
+    int fd;
+    int ret;
+    int on = 1;
+    struct in_modbus_async *async = conn->async;
+
+    fd = socket(async->addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        async_fail(conn, errno);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    async->fd = fd;
+    async->deadline = in_modbus_time_ms() + async->ctx->response_timeout_ms;
+
+    ret = connect(fd, (struct sockaddr *) &async->addr, async->addr_len);
+    if (ret == -1 && errno != EINPROGRESS) {
+        async_fail(conn, errno);
+        return -1;
+    }
+
+    /* Writable once the handshake is over */
+    async->state = ASYNC_CONNECTING;
+    if (async_register(conn, MK_EVENT_WRITE) == -1) {
+        async_fail(conn, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void emit_device(struct flb_in_modbus_config *ctx,
+                        struct in_modbus_device *dev, uint64_t scan,
+                        uint64_t start_us)
+{
+    size_t alloc;
+    msgpack_packer mp_pck;
+
+    /* Records are appended one at a time, the engine buffer is reused */
+    msgpack_sbuffer_clear(&ctx->mp_sbuf);
+    msgpack_packer_init(&mp_pck, &ctx->mp_sbuf, msgpack_sbuffer_write);
+    alloc = ctx->mp_sbuf.alloc;
+
+    in_modbus_pack_device(ctx, dev, dev->buf, scan, &mp_pck);
+    flb_input_chunk_append_raw(ctx->ins, NULL, 0, ctx->mp_sbuf.data,
+                               ctx->mp_sbuf.size);
+
+    ctx->appends++;
+    if (ctx->mp_sbuf.alloc != alloc) {
+        ctx->allocs++;
+    }
+
+    if (ctx->stats) {
+        in_modbus_stats_device(ctx, dev, scan,
+                               in_modbus_stats_time_us() - start_us);
+        in_modbus_stats_bytes(ctx, dev, ctx->mp_sbuf.size);
+    }
+}
+
+static int flush_write(struct in_modbus_conn *conn)
+{
+    ssize_t ret;
+    struct in_modbus_async *async = conn->async;
+
+    while (async->woff < async->wlen) {
+        ret = send(async->fd, async->wbuf + async->woff,
+                   async->wlen - async->woff, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return async_register(conn, MK_EVENT_READ | MK_EVENT_WRITE);
+            }
+            async_fail(conn, errno);
+            return -1;
+        }
+        async->woff += ret;
+    }
+
+    async->wlen = 0;
+    async->woff = 0;
+
+    return async_register(conn, MK_EVENT_READ);
+}
+
+/* Queue the frame of a request, it is sent by the next flush_write() */
+static void queue_request(struct in_modbus_conn *conn,
+                          struct in_modbus_device *dev, int plan_idx,
+                          struct in_modbus_read *read)
+{
+    int i;
+    unsigned char *p;
+    struct in_modbus_async *async = conn->async;
+    struct in_modbus_async_req *req = NULL;
+
+    for (i = 0; i < IN_MODBUS_MAX_PIPELINE; i++) {
+        if (!async->reqs[i].used) {
+            req = &async->reqs[i];
+            break;
+        }
+    }
+
+    async->tid++;
+
+    req->used = 1;
+    req->tid = async->tid;
+    req->dev_idx = async->dev_idx;
+    req->plan_idx = plan_idx;
+    req->read_idx = async->read_idx;
+    req->deadline = in_modbus_time_ms() + async->ctx->response_timeout_ms;
+
+    async->inflight++;
+    dev->pending++;
+
+    /* Keep the unsent bytes at the start of the buffer */
+    if (async->woff > 0) {
+        memmove(async->wbuf, async->wbuf + async->woff,
+                async->wlen - async->woff);
+        async->wlen -= async->woff;
+        async->woff = 0;
+    }
+
+    p = async->wbuf + async->wlen;
+    p[0] = async->tid >> 8;
+    p[1] = async->tid & 0xff;
+    p[2] = 0;
+    p[3] = 0;
+    p[4] = 0;
+    p[5] = 6;
+    p[6] = dev->unit_id >= 0 ? dev->unit_id : 0xff;
+    p[7] = read_fc[async->ctx->plans[plan_idx].type];
+    p[8] = read->addr >> 8;
+    p[9] = read->addr & 0xff;
+    p[10] = read->no >> 8;
+    p[11] = read->no & 0xff;
+
+    async->wlen += IN_MODBUS_REQ_LENGTH;
+}
+
+/* Append the record of a slave once all its requests are answered */
+static void device_done(struct flb_in_modbus_config *ctx,
+                        struct in_modbus_device *dev,
+                        struct in_modbus_async *async)
+{
+    if (dev->issued && dev->pending == 0) {
+        emit_device(ctx, dev, async->scan, async->start_us);
+    }
+}
+
+/*
+ * Fill the pipeline with the next requests of the scan and send them.
+ * The scan is over once every request went out and came back.
+ */
+static void scan_next(struct in_modbus_conn *conn)
+{
+    int queued = 0;
+    struct in_modbus_async *async = conn->async;
+    struct flb_in_modbus_config *ctx = async->ctx;
+    struct in_modbus_device *dev;
+    struct in_modbus_plan *plan;
+
+    while (async->dev_idx < conn->ndevs &&
+           async->inflight < ctx->pipeline_depth) {
+        dev = conn->devs[async->dev_idx];
+
+        plan = async->plan_idx < ctx->nplans ?
+               &ctx->plans[async->plan_idx] : NULL;
+        if (plan) {
+            if (in_modbus_plan_due(plan, async->scan) &&
+                dev->result[async->plan_idx] != -1 &&
+                async->read_idx < plan->nreads) {
+                queue_request(conn, dev, async->plan_idx,
+                              &plan->reads[async->read_idx]);
+                async->read_idx++;
+                queued++;
+            }
+            else {
+                async->plan_idx++;
+                async->read_idx = 0;
+            }
+            continue;
+        }
+
+        /* Every request of this slave is out */
+        dev->issued = 1;
+        device_done(ctx, dev, async);
+
+        async->dev_idx++;
+        async->plan_idx = 0;
+        async->read_idx = 0;
+    }
+
+    if (queued > 0) {
+        flush_write(conn);
+    }
+    else if (async->dev_idx == conn->ndevs && async->inflight == 0) {
+        async->busy = 0;
+    }
+}
+
+static void scan_start(struct in_modbus_conn *conn)
+{
+    int i;
+    int j;
+    struct in_modbus_async *async = conn->async;
+    struct flb_in_modbus_config *ctx = async->ctx;
+    struct in_modbus_device *dev;
+
+    /* Nothing to read on this tick */
+    if (!in_modbus_scan_due(ctx, ctx->scan)) {
+        return;
+    }
+
+    for (i = 0; i < conn->ndevs; i++) {
+        dev = conn->devs[i];
+        dev->pending = 0;
+        dev->issued = 0;
+        for (j = 0; j < ctx->nplans; j++) {
+            dev->result[j] = ctx->plans[j].size;
+            dev->errnum[j] = 0;
+        }
+    }
+
+    async->busy = 1;
+    async->scan = ctx->scan;
+    async->start_us = in_modbus_stats_time_us();
+    async->dev_idx = 0;
+    async->plan_idx = 0;
+    async->read_idx = 0;
+
+    scan_next(conn);
+}
+
+/* Store a complete response frame into the request it answers */
+static int handle_response(struct in_modbus_conn *conn)
+{
+    int i;
+    int tid;
+    int type;
+    int count;
+    struct in_modbus_plan *plan;
+    unsigned char *p;
+    unsigned char *data;
+    uint8_t *bits;
+    uint16_t *registers;
+    struct in_modbus_async *async = conn->async;
+    struct flb_in_modbus_config *ctx = async->ctx;
+    struct in_modbus_async_req *req = NULL;
+    struct in_modbus_device *dev;
+    struct in_modbus_read *read;
+
+    p = async->rbuf;
+    tid = (p[0] << 8) | p[1];
+
+    for (i = 0; i < IN_MODBUS_MAX_PIPELINE; i++) {
+        if (async->reqs[i].used && async->reqs[i].tid == tid) {
+            req = &async->reqs[i];
+            break;
+        }
+    }
+
+    if (!req || p[2] != 0 || p[3] != 0) {
+        async_fail(conn, EMBBADDATA);
+        return -1;
+    }
+
+    plan = &ctx->plans[req->plan_idx];
+    type = plan->type;
+    dev = conn->devs[req->dev_idx];
+
+    /* A gateway answering for another unit than the one asked */
+    if (p[6] != (dev->unit_id >= 0 ? dev->unit_id : 0xff)) {
+        async_fail(conn, EMBBADDATA);
+        return -1;
+    }
+    read = &plan->reads[req->read_idx];
+    dev->stamps[plan->first_read + req->read_idx] = in_modbus_clock_ns();
+
+    if (p[7] == (read_fc[type] | 0x80)) {
+        /* Exception: the rest of this plan is skipped */
+        dev->result[req->plan_idx] = -1;
+        dev->errnum[req->plan_idx] = MODBUS_ENOBASE + p[8];
+    }
+    else {
+        count = BIT_TYPE(type) ? (read->no + 7) / 8 : read->no * 2;
+        if (p[7] != read_fc[type] || p[8] != count ||
+            async->rlen != IN_MODBUS_MBAP_LENGTH + 2 + count) {
+            async_fail(conn, EMBBADDATA);
+            return -1;
+        }
+
+        data = p + IN_MODBUS_MBAP_LENGTH + 2;
+        if (BIT_TYPE(type)) {
+            bits = (uint8_t *) (dev->buf + plan->buf_offset) +
+                   read->offset;
+            for (i = 0; i < read->no; i++) {
+                bits[i] = (data[i / 8] >> (i % 8)) & 1;
+            }
+        }
+        else {
+            registers = (uint16_t *) (dev->buf + plan->buf_offset) +
+                        read->offset;
+            for (i = 0; i < read->no; i++) {
+                registers[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+            }
+        }
+    }
+
+    req->used = 0;
+    async->inflight--;
+    dev->pending--;
+    device_done(ctx, dev, async);
+
+    scan_next(conn);
+
+    return 0;
+}
+
+static int on_readable(struct in_modbus_conn *conn)
+{
+    int need;
+    ssize_t ret;
+    struct in_modbus_async *async = conn->async;
+
+    while (1) {
+        /* Header first, then whatever its length field announces */
+        if (async->rlen < IN_MODBUS_MBAP_LENGTH) {
+            need = IN_MODBUS_MBAP_LENGTH;
+        }
+        else {
+            need = 6 + ((async->rbuf[4] << 8) | async->rbuf[5]);
+            if (need > sizeof(async->rbuf) || need < IN_MODBUS_MBAP_LENGTH + 2) {
+                async_fail(conn, EMBBADDATA);
+                return -1;
+            }
+        }
+
+        ret = recv(async->fd, async->rbuf + async->rlen, need - async->rlen, 0);
+        if (ret == 0) {
+            async_fail(conn, ECONNRESET);
+            return -1;
+        }
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            async_fail(conn, errno);
+            return -1;
+        }
+        async->rlen += ret;
+
+        if (async->rlen >= IN_MODBUS_MBAP_LENGTH + 2 && async->rlen == need) {
+            if (async->inflight == 0) {
+                /* Nothing was asked */
+                async_fail(conn, EMBBADDATA);
+                return -1;
+            }
+            if (handle_response(conn) == -1) {
+                return -1;
+            }
+            async->rlen = 0;
+            if (async->fd == -1) {
+                return 0;
+            }
+        }
+    }
+}
+
+/* Event loop callback of a connection socket */
+static int async_event(void *data)
+{
+    int err;
+    socklen_t len;
+    struct mk_event *event = data;
+    struct in_modbus_conn *conn = (struct in_modbus_conn *) event;
+    struct in_modbus_async *async = conn->async;
+
+    if (async->state == ASYNC_CONNECTING) {
+        err = 0;
+        len = sizeof(err);
+        if (getsockopt(async->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+            err = errno;
+        }
+        if (err != 0) {
+            async_fail(conn, err);
+            return 0;
+        }
+
+        async->state = ASYNC_UP;
+        async->failures = 0;
+        conn->err = 0;
+        flb_debug("[in_modbus] Connected to %s", conn->address);
+
+        scan_start(conn);
+        if (!async->busy && async->fd != -1) {
+            async_register(conn, MK_EVENT_READ);
+        }
+        return 0;
+    }
+
+    if (event->mask & MK_EVENT_WRITE) {
+        if (flush_write(conn) == -1) {
+            return 0;
+        }
+    }
+
+    if (event->mask & MK_EVENT_READ) {
+        on_readable(conn);
+    }
+
+    return 0;
+}
+
+static int resolve(struct in_modbus_conn *conn)
+{
+    int ret;
+    char port[16];
+    struct addrinfo hints;
+    struct addrinfo *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(port, sizeof(port), "%d", conn->port);
+    ret = getaddrinfo(conn->address, port, &hints, &res);
+    if (ret != 0) {
+        flb_error("[in_modbus] Cannot resolve %s: %s", conn->address,
+                  gai_strerror(ret));
+        return -1;
+    }
+
+    memcpy(&conn->async->addr, res->ai_addr, res->ai_addrlen);
+    conn->async->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/*
+ * Prepare the async transport: resolve every gateway once and give each
+ * slave its own buffer since several scans run at the same time.
+ */
+int in_modbus_async_init(struct flb_in_modbus_config *ctx)
+{
+    int i;
+    struct mk_list *head;
+    struct in_modbus_conn *conn;
+    struct in_modbus_device *dev;
+
+    mk_list_foreach(head, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+
+        conn->async = flb_calloc(1, sizeof(struct in_modbus_async));
+        if (!conn->async) {
+            flb_errno();
+            return -1;
+        }
+        conn->async->ctx = ctx;
+        conn->async->fd = -1;
+        conn->async->state = ASYNC_DOWN;
+
+        MK_EVENT_NEW(&conn->event);
+        conn->event.handler = async_event;
+
+        if (resolve(conn) == -1) {
+            return -1;
+        }
+
+        for (i = 0; i < conn->ndevs; i++) {
+            dev = conn->devs[i];
+            dev->buf = flb_calloc(1, ctx->buf_size + 1);
+            if (!dev->buf) {
+                flb_errno();
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void in_modbus_async_destroy(struct flb_in_modbus_config *ctx)
+{
+    struct mk_list *head;
+    struct in_modbus_conn *conn;
+
+    mk_list_foreach(head, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+        if (conn->async) {
+            async_close(conn);
+            flb_free(conn->async);
+            conn->async = NULL;
+        }
+    }
+}
+
+static uint64_t oldest_deadline(struct in_modbus_async *async)
+{
+    int i;
+    uint64_t deadline = UINT64_MAX;
+
+    for (i = 0; i < IN_MODBUS_MAX_PIPELINE; i++) {
+        if (async->reqs[i].used && async->reqs[i].deadline < deadline) {
+            deadline = async->reqs[i].deadline;
+        }
+    }
+
+    return deadline;
+}
+
+/*
+ * Timer tick: start a scan on every idle connection. Connections still
+ * busy with the previous scan past the response timeout are dropped and
+ * reconnected on the next tick, the others are left alone.
+ */
+int in_modbus_async_scan(struct flb_in_modbus_config *ctx)
+{
+    uint64_t now;
+    struct mk_list *head;
+    struct in_modbus_conn *conn;
+    struct in_modbus_async *async;
+
+    now = in_modbus_time_ms();
+
+    mk_list_foreach(head, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+        async = conn->async;
+
+        switch (async->state) {
+        case ASYNC_DOWN:
+            /* The scan starts as soon as the connection is up */
+            if (now >= async->retry_ms) {
+                async_connect(conn);
+            }
+            break;
+        case ASYNC_CONNECTING:
+            if (now > async->deadline) {
+                async_fail(conn, ETIMEDOUT);
+            }
+            break;
+        default:
+            if (!async->busy) {
+                scan_start(conn);
+            }
+            else if (oldest_deadline(async) < now) {
+                async_fail(conn, ETIMEDOUT);
+            }
+            else {
+                /* The scan of this connection skips the tick */
+                in_modbus_sched_overrun(ctx, in_modbus_stats_time_us() -
+                                        async->start_us, 1);
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_ASYNC_H
+#define FLB_IN_MODBUS_ASYNC_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <modbus.h>
+
+#include "in_modbus.h"
+
+/* MBAP header: transaction id, protocol id, length, unit id */
+#define IN_MODBUS_MBAP_LENGTH 7
+
+/* Read request frame: MBAP header, function code, address, quantity */
+#define IN_MODBUS_REQ_LENGTH (IN_MODBUS_MBAP_LENGTH + 5)
+
+/* Largest number of requests in flight on one connection */
+#define IN_MODBUS_MAX_PIPELINE 16
+
+enum {
+    ASYNC_DOWN = 0,
+    ASYNC_CONNECTING,
+    ASYNC_UP
+};
+
+/* Request waiting for its response, matched by transaction id */
+struct in_modbus_async_req {
+    int used;
+    uint16_t tid;
+    int dev_idx;
+    int plan_idx;
+    int read_idx;
+    uint64_t deadline;  /* monotonic ms */
+};
+
+/*
+ * Modbus TCP client state of one connection. The socket is non-blocking
+ * and registered with the engine event loop. Up to ctx->pipeline_depth
+ * requests are kept in flight and responses are matched to them by their
+ * MBAP transaction id, in whatever order the slave answers.
+ */
+struct in_modbus_async {
+    struct flb_in_modbus_config *ctx;
+
+    int fd;
+    int state;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    /* Scan in progress: next slave, plan and request to send */
+    int busy;
+    uint64_t scan;
+    int dev_idx;
+    int plan_idx;
+    int read_idx;
+    uint16_t tid;
+    uint64_t deadline;  /* monotonic ms, connection attempt */
+    uint64_t start_us;  /* monotonic, scan start */
+
+    /* Backoff after a failure, same schedule as the shared links */
+    int failures;
+    uint64_t retry_ms;  /* monotonic ms, next connection attempt */
+
+    int inflight;
+    struct in_modbus_async_req reqs[IN_MODBUS_MAX_PIPELINE];
+
+    unsigned char wbuf[IN_MODBUS_MAX_PIPELINE * IN_MODBUS_REQ_LENGTH];
+    int wlen;
+    int woff;
+
+    unsigned char rbuf[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rlen;
+};
+
+int in_modbus_async_init(struct flb_in_modbus_config *ctx);
+void in_modbus_async_destroy(struct flb_in_modbus_config *ctx);
+int in_modbus_async_scan(struct flb_in_modbus_config *ctx);
+
+uint64_t in_modbus_time_ms(void);
+
+#endif
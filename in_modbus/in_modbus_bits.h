@@ -0,0 +1,101 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_BITS_H
+#define FLB_IN_MODBUS_BITS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Pack 'n' bits stored one per byte (as libmodbus reads them) into 'out',
+ * starting at bit 'pos'. Bits are packed LSB first, like Modbus puts them
+ * on the wire. Bytes of 'out' past 'pos' are written, not merged, so it
+ * has to be filled in order. Returns the next bit position.
+ */
+static inline int in_modbus_pack_bits(uint8_t *out, int pos,
+                                      const uint8_t *bits, int n)
+{
+    int i = 0;
+    uint64_t x;
+
+    /* Unaligned head, one bit at a time */
+    for (; i < n && (pos & 7); i++, pos++) {
+        out[pos >> 3] = (out[pos >> 3] & ((1 << (pos & 7)) - 1)) |
+                        ((bits[i] != 0) << (pos & 7));
+    }
+
+#if defined(__SSE2__)
+    /* 16 bits per step: movemask gathers the top bit of every byte */
+    for (; i + 16 <= n; i += 16, pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bits + i));
+        int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+        out[pos >> 3] = mask & 0xff;
+        out[(pos >> 3) + 1] = (mask >> 8) & 0xff;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    /* 16 bits per step: weight every byte by its bit, add across lanes */
+    {
+        static const uint8_t weights[16] = {
+            1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+        };
+        uint8x16_t w = vld1q_u8(weights);
+
+        for (; i + 16 <= n; i += 16, pos += 16) {
+            uint8x16_t v = vandq_u8(vtstq_u8(vld1q_u8(bits + i),
+                                             vdupq_n_u8(0xff)), w);
+
+            out[pos >> 3] = vaddv_u8(vget_low_u8(v));
+            out[(pos >> 3) + 1] = vaddv_u8(vget_high_u8(v));
+        }
+    }
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* 8 bits per step: one multiply moves every byte to its bit */
+    for (; i + 8 <= n; i += 8, pos += 8) {
+        memcpy(&x, bits + i, sizeof(x));
+        /* Top bit of every non-zero byte, without carries between them */
+        x = (((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x) &
+            0x8080808080808080ULL;
+        out[pos >> 3] = ((x >> 7) * 0x0102040810204080ULL) >> 56;
+    }
+#endif
+
+    /* Tail */
+    for (; i < n; i++, pos++) {
+        out[pos >> 3] = (out[pos >> 3] & ((1 << (pos & 7)) - 1)) |
+                        ((bits[i] != 0) << (pos & 7));
+    }
+
+    return pos;
+}
+
+#endif
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <time.h>
+
+#include "in_modbus_clock.h"
+
+/*
+ * Responses are stamped with the monotonic clock, which a step of the
+ * system time cannot reorder, and turned into realtime when packed.
+ */
+uint64_t in_modbus_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Measure the offset of the realtime clock from the monotonic one, read
+ * between two monotonic samples to halve the error. Called once per
+ * scan, so the records follow NTP adjustments within a tick.
+ */
+void in_modbus_clock_sync(struct flb_in_modbus_config *ctx)
+{
+    uint64_t before;
+    uint64_t after;
+    int64_t offset;
+    struct timespec ts;
+
+    before = in_modbus_clock_ns();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    after = in_modbus_clock_ns();
+
+    offset = (int64_t) ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) -
+             (int64_t) (before + (after - before) / 2);
+
+    /* Polling threads read it while packing */
+    __atomic_store_n(&ctx->clock_offset_ns, offset, __ATOMIC_RELAXED);
+}
+
+/* Realtime of a monotonic stamp */
+void in_modbus_clock_time(struct flb_in_modbus_config *ctx, uint64_t ns,
+                          struct flb_time *tm)
+{
+    uint64_t t;
+
+    t = ns + __atomic_load_n(&ctx->clock_offset_ns, __ATOMIC_RELAXED);
+    tm->tm.tv_sec = t / 1000000000;
+    tm->tm.tv_nsec = t % 1000000000;
+}
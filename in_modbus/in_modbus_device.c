@@ -0,0 +1,370 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_str.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <modbus.h>
+
+#include "in_modbus.h"
+#include "in_modbus_device.h"
+#include "in_modbus_async.h"
+
+/* Return the connection to address:port, creating it on first use */
+static struct in_modbus_conn *conn_get(struct flb_in_modbus_config *ctx,
+                                       const char *address, int port)
+{
+    struct mk_list *head;
+    struct in_modbus_conn *conn;
+    struct modbus_conn_params params;
+
+    mk_list_foreach(head, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+        if (conn->port == port && strcmp(conn->address, address) == 0) {
+            return conn;
+        }
+    }
+
+    conn = flb_calloc(1, sizeof(struct in_modbus_conn));
+    if (!conn) {
+        flb_errno();
+        return NULL;
+    }
+
+    conn->address = flb_strdup(address);
+    conn->port = port;
+    if (!conn->address) {
+        flb_errno();
+        flb_free(conn);
+        return NULL;
+    }
+
+    /* The async transport opens its own socket from the event loop */
+    if (!ctx->async) {
+        params.backend = ctx->backend;
+        params.address = address;
+        params.port = port;
+        params.rate = ctx->rate;
+        params.parity = ctx->parity;
+        params.data_bits = ctx->data_bits;
+        params.stop_bits = ctx->stop_bits;
+        params.response_timeout_ms = ctx->response_timeout_ms;
+        params.byte_timeout_ms = ctx->byte_timeout_ms;
+        params.backoff_min_ms = ctx->reconnect_min_ms;
+        params.backoff_max_ms = ctx->reconnect_max_ms;
+
+        conn->link = modbus_conn_get(&params);
+        if (!conn->link) {
+            flb_free(conn->address);
+            flb_free(conn);
+            return NULL;
+        }
+    }
+
+    mk_list_add(&conn->_head, &ctx->conns);
+
+    return conn;
+}
+
+static int device_add(struct flb_in_modbus_config *ctx,
+                      struct in_modbus_conn *conn, int unit_id)
+{
+    int i;
+    struct in_modbus_device *dev;
+
+    dev = flb_calloc(1, sizeof(struct in_modbus_device));
+    if (!dev) {
+        flb_errno();
+        return -1;
+    }
+
+    dev->unit_id = unit_id;
+    dev->conn = conn;
+    mk_list_add(&dev->_head, &ctx->devices);
+
+    dev->result = flb_calloc(ctx->nplans + 1, sizeof(int));
+    dev->errnum = flb_calloc(ctx->nplans + 1, sizeof(int));
+    dev->stamps = flb_calloc(ctx->nreads + 1, sizeof(uint64_t));
+    if (!dev->result || !dev->errnum || !dev->stamps) {
+        flb_errno();
+        return -1;
+    }
+
+    if (ctx->report_by_exception) {
+        dev->prev = flb_calloc(1, ctx->buf_size + 1);
+        dev->changed = flb_calloc(1, ctx->buf_size + 1);
+        dev->valid = flb_calloc(ctx->nplans + 1, sizeof(int));
+        dev->point_changed = flb_calloc(ctx->npoints + 1, sizeof(uint8_t));
+        dev->point_prev = flb_malloc((ctx->npoints + 1) * sizeof(double));
+        if (!dev->prev || !dev->changed || !dev->valid ||
+            !dev->point_changed || !dev->point_prev) {
+            flb_errno();
+            return -1;
+        }
+        for (i = 0; i < ctx->npoints; i++) {
+            dev->point_prev[i] = NAN;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Parse one entry of the 'slaves' list: unit[-unit][@address[:port]].
+ * Entries without an address go through the instance 'address'.
+ */
+static int parse_slave(struct flb_in_modbus_config *ctx, const char *entry,
+                       const char *def_address, int def_port)
+{
+    int i;
+    int port;
+    long first;
+    long last;
+    char *end;
+    char *sep;
+    char address[256];
+    struct in_modbus_conn *conn;
+
+    first = strtol(entry, &end, 10);
+    last = first;
+    if (end == entry) {
+        return -1;
+    }
+    if (*end == '-') {
+        entry = end + 1;
+        last = strtol(entry, &end, 10);
+        if (end == entry) {
+            return -1;
+        }
+    }
+    if (first < 0 || last > 255 || first > last) {
+        return -1;
+    }
+
+    port = def_port;
+    if (*end == '@') {
+        if (strlen(end + 1) >= sizeof(address)) {
+            return -1;
+        }
+        strcpy(address, end + 1);
+
+        /* Serial devices have no port */
+        sep = strrchr(address, ':');
+        if (sep && ctx->backend != RTU) {
+            *sep = '\0';
+            port = atoi(sep + 1);
+        }
+    }
+    else if (*end == '\0') {
+        if (def_address == NULL) {
+            return -1;
+        }
+        strcpy(address, def_address);
+    }
+    else {
+        return -1;
+    }
+
+    conn = conn_get(ctx, address, port);
+    if (!conn) {
+        return -1;
+    }
+
+    for (i = first; i <= last; i++) {
+        if (device_add(ctx, conn, i) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int parse_slaves(struct flb_in_modbus_config *ctx, const char *str,
+                        const char *def_address, int def_port)
+{
+    int len;
+    char entry[300];
+    const char *end;
+
+    while (*str) {
+        while (*str == ' ' || *str == ',') {
+            str++;
+        }
+        if (*str == '\0') {
+            break;
+        }
+
+        end = str;
+        while (*end && *end != ',' && *end != ' ') {
+            end++;
+        }
+
+        len = end - str;
+        if (len >= sizeof(entry)) {
+            return -1;
+        }
+        memcpy(entry, str, len);
+        entry[len] = '\0';
+
+        if (parse_slave(ctx, entry, def_address, def_port) == -1) {
+            flb_error("[in_modbus] Invalid slave '%s': has to be "
+                      "unit[-unit][@address[:port]]", entry);
+            return -1;
+        }
+        str = end;
+    }
+
+    return 0;
+}
+
+/*
+ * Build the list of slaves to poll and the connections they go through.
+ * Slaves behind the same gateway (or serial line) share one connection.
+ */
+int in_modbus_devices_configure(struct flb_in_modbus_config *ctx,
+                                struct flb_input_instance *in)
+{
+    int port;
+    int unit_id;
+    const char *addr;
+    const char *slaves;
+    struct mk_list *head;
+    struct mk_list *d_head;
+    struct in_modbus_conn *conn;
+    struct in_modbus_device *dev;
+
+    addr = flb_input_get_property("address", in);
+    port = value_from_cfg(in, "tcp_port", 502);
+    slaves = flb_input_get_property("slaves", in);
+
+    if (slaves != NULL) {
+        if (parse_slaves(ctx, slaves, addr, port) == -1) {
+            return -1;
+        }
+    }
+    else {
+        if (addr == NULL) {
+            flb_error("[in_modbus] Slave address unknown");
+            return -1;
+        }
+
+        conn = conn_get(ctx, addr, port);
+        if (!conn) {
+            return -1;
+        }
+
+        unit_id = value_from_cfg(in, "unit_id", -1);
+        if (unit_id > 255) {
+            flb_error("[in_modbus] Invalid unit_id %d", unit_id);
+            return -1;
+        }
+        if (unit_id == -1 && ctx->backend == RTU) {
+            flb_error("[in_modbus] unit_id is required with the rtu backend");
+            return -1;
+        }
+        if (device_add(ctx, conn, unit_id) == -1) {
+            return -1;
+        }
+    }
+
+    if (mk_list_is_empty(&ctx->devices) == 0) {
+        flb_error("[in_modbus] No slave to poll");
+        return -1;
+    }
+
+    /* Group slaves by connection */
+    mk_list_foreach(head, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+        conn->devs = flb_calloc(mk_list_size(&ctx->devices),
+                                sizeof(struct in_modbus_device *));
+        if (!conn->devs) {
+            flb_errno();
+            return -1;
+        }
+
+        mk_list_foreach(d_head, &ctx->devices) {
+            dev = mk_list_entry(d_head, struct in_modbus_device, _head);
+            if (dev->conn == conn) {
+                conn->devs[conn->ndevs++] = dev;
+            }
+        }
+    }
+
+    /* The async transport connects from the event loop */
+    if (ctx->async) {
+        if (in_modbus_async_init(ctx) == -1) {
+            return -1;
+        }
+    }
+
+    flb_debug("[in_modbus] Polling %d slaves over %d connections",
+              mk_list_size(&ctx->devices), mk_list_size(&ctx->conns));
+
+    return 0;
+}
+
+void in_modbus_devices_destroy(struct flb_in_modbus_config *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct in_modbus_conn *conn;
+    struct in_modbus_device *dev;
+
+    in_modbus_async_destroy(ctx);
+
+    mk_list_foreach_safe(head, tmp, &ctx->devices) {
+        dev = mk_list_entry(head, struct in_modbus_device, _head);
+        mk_list_del(&dev->_head);
+        flb_free(dev->buf);
+        flb_free(dev->result);
+        flb_free(dev->errnum);
+        flb_free(dev->stamps);
+        flb_free(dev->prev);
+        flb_free(dev->changed);
+        flb_free(dev->valid);
+        flb_free(dev->point_changed);
+        flb_free(dev->point_prev);
+        flb_free(dev);
+    }
+
+    mk_list_foreach_safe(head, tmp, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+        mk_list_del(&conn->_head);
+        flb_free(conn->devs);
+        if (conn->link) {
+            modbus_conn_put(conn->link);
+        }
+        flb_free(conn->address);
+        flb_free(conn);
+    }
+}
+
+/* Address the following requests of the connection to this slave */
+int in_modbus_device_select(struct in_modbus_device *dev)
+{
+    return modbus_conn_select(dev->conn->link, dev->unit_id);
+}
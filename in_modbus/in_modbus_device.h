@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_DEVICE_H
+#define FLB_IN_MODBUS_DEVICE_H
+
+#include <fluent-bit/flb_input.h>
+#include <modbus.h>
+
+#include "in_modbus.h"
+
+struct in_modbus_async;
+
+/* Link to a slave or gateway (TCP) or to a serial line (RTU) */
+struct in_modbus_conn {
+    struct mk_event event;      /* async transport, has to be first */
+
+    /* Shared with the other instances, the async transport has its own */
+    struct modbus_conn *link;
+    int err;
+
+    char *address;
+    int port;
+
+    /* Slaves reached through this connection */
+    struct in_modbus_device **devs;
+    int ndevs;
+    struct in_modbus_async *async;
+
+    struct mk_list _head;
+};
+
+/* A slave polled on every scan, several of them may share one conn */
+struct in_modbus_device {
+    int unit_id;        /* -1 when the slave id is left to libmodbus */
+    struct in_modbus_conn *conn;
+
+    /* Outcome of the last scan per plan: values read or -1 */
+    int *result;
+    int *errnum;
+
+    /* Monotonic time of the response to each request, per plan read */
+    uint64_t *stamps;
+
+    /* Report by exception: last reported values and what moved since */
+    char *prev;
+    uint8_t *changed;
+    int *valid;         /* per plan, 'prev' holds reported values */
+    uint8_t *point_changed;
+    double *point_prev;     /* value last reported per point, NaN unknown */
+    uint64_t integrity_ms;
+
+    /* Scans left to skip, and how many the next slow scan costs */
+    int skip;
+    int backoff;
+
+    /* Counters of this slave (optional) */
+    struct in_modbus_stats *stats;
+
+    /* Values of the scan in flight (async transport) */
+    char *buf;
+    int pending;        /* requests waiting for a response */
+    int issued;         /* every request of the scan has been sent */
+
+    struct mk_list _head;
+};
+
+int in_modbus_devices_configure(struct flb_in_modbus_config *ctx,
+                                struct flb_input_instance *in);
+void in_modbus_devices_destroy(struct flb_in_modbus_config *ctx);
+
+int in_modbus_device_select(struct in_modbus_device *dev);
+
+#endif
@@ -0,0 +1,339 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <modbus.h>
+
+#include "in_modbus.h"
+#include "in_modbus_plan.h"
+#include "in_modbus_clock.h"
+
+static int block_compare(const void *a, const void *b)
+{
+    const struct in_modbus_block *ba = *(const struct in_modbus_block **) a;
+    const struct in_modbus_block *bb = *(const struct in_modbus_block **) b;
+
+    if (ba->addr != bb->addr) {
+        return ba->addr - bb->addr;
+    }
+    return bb->no - ba->no;
+}
+
+/* Append the requests covering [start, end) to the plan */
+static void plan_add_span(struct in_modbus_plan *plan, int start, int end)
+{
+    int n;
+    int addr;
+
+    for (addr = start; addr < end; addr += n) {
+        n = end - addr > plan->max_per_read ? plan->max_per_read : end - addr;
+        plan->reads[plan->nreads].addr = addr;
+        plan->reads[plan->nreads].no = n;
+        plan->reads[plan->nreads].offset = plan->size;
+        plan->nreads++;
+        plan->size += n;
+    }
+}
+
+/* Spread the deadband of the blocks over the registers of the buffer */
+static int plan_set_deadband(struct in_modbus_plan *plan)
+{
+    int i;
+    int j;
+    struct in_modbus_block *b;
+
+    if (BIT_TYPE(plan->type)) {
+        return 0;
+    }
+
+    for (i = 0; i < plan->nblocks; i++) {
+        b = &plan->blocks[i];
+        if (b->deadband <= 0) {
+            continue;
+        }
+
+        if (!plan->deadband) {
+            plan->deadband = flb_calloc(plan->size, sizeof(uint16_t));
+            if (!plan->deadband) {
+                flb_errno();
+                in_modbus_plan_destroy(plan);
+                return -1;
+            }
+        }
+
+        for (j = b->offset; j < b->offset + b->no; j++) {
+            plan->deadband[j] = b->deadband > 0xffff ? 0xffff : b->deadband;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Build the read plan for 'type' from a list of blocks. Blocks are sorted
+ * by address and merged into one request when the hole between them is at
+ * most 'max_gap' points and the result still fits in 'max_per_read'; the
+ * few unused values cost less than another round trip. Blocks longer than
+ * 'max_per_read' are split into several requests.
+ */
+int in_modbus_plan_build(struct in_modbus_plan *plan, int type,
+                         struct in_modbus_block *blocks, int nblocks,
+                         int max_per_read, int max_gap)
+{
+    int i;
+    int end;
+    int start;
+    int nreads;
+    int span_offset;
+    struct in_modbus_block *b;
+    struct in_modbus_block **sorted;
+
+    plan->type = type;
+    plan->max_per_read = max_per_read;
+    plan->max_gap = max_gap;
+    plan->interval_ms = nblocks > 0 ? blocks[0].interval_ms : 0;
+    plan->period = 1;
+    plan->buf_offset = 0;
+    plan->nblocks = 0;
+    plan->blocks = NULL;
+    plan->nreads = 0;
+    plan->reads = NULL;
+    plan->size = 0;
+    plan->points = 0;
+    plan->nraw = 0;
+    plan->deadband = NULL;
+
+    if (nblocks == 0) {
+        return 0;
+    }
+
+    nreads = 0;
+    for (i = 0; i < nblocks; i++) {
+        if (blocks[i].addr < 0 || blocks[i].no < 1 ||
+            blocks[i].addr + blocks[i].no > IN_MODBUS_ADDR_MAX) {
+            flb_error("[in_modbus] Invalid block %d:%d", blocks[i].addr,
+                      blocks[i].no);
+            return -1;
+        }
+        nreads += (blocks[i].no + max_per_read - 1) / max_per_read;
+    }
+
+    plan->blocks = flb_malloc(nblocks * sizeof(struct in_modbus_block));
+    plan->reads = flb_malloc(nreads * sizeof(struct in_modbus_read));
+    sorted = flb_malloc(nblocks * sizeof(struct in_modbus_block *));
+    if (!plan->blocks || !plan->reads || !sorted) {
+        flb_errno();
+        flb_free(sorted);
+        in_modbus_plan_destroy(plan);
+        return -1;
+    }
+
+    /* Blocks keep the configured order, the record lists them that way */
+    for (i = 0; i < nblocks; i++) {
+        plan->blocks[i] = blocks[i];
+        sorted[i] = &plan->blocks[i];
+        if (IN_MODBUS_RAW_BLOCK(&blocks[i])) {
+            plan->points += blocks[i].no;
+            plan->nraw++;
+        }
+    }
+    plan->nblocks = nblocks;
+
+    qsort(sorted, nblocks, sizeof(struct in_modbus_block *), block_compare);
+
+    start = sorted[0]->addr;
+    end = start + sorted[0]->no;
+    span_offset = 0;
+    sorted[0]->offset = 0;
+
+    for (i = 1; i < nblocks; i++) {
+        b = sorted[i];
+
+        if (b->addr + b->no <= end ||
+            (b->addr <= end + max_gap &&
+             b->addr + b->no - start <= max_per_read)) {
+            if (b->addr + b->no > end) {
+                end = b->addr + b->no;
+            }
+        }
+        else {
+            plan_add_span(plan, start, end);
+            start = b->addr;
+            end = b->addr + b->no;
+            span_offset = plan->size;
+        }
+        b->offset = span_offset + (b->addr - start);
+    }
+    plan_add_span(plan, start, end);
+
+    flb_free(sorted);
+
+    return plan_set_deadband(plan);
+}
+
+void in_modbus_plan_destroy(struct in_modbus_plan *plan)
+{
+    flb_free(plan->blocks);
+    flb_free(plan->reads);
+    flb_free(plan->deadband);
+
+    plan->blocks = NULL;
+    plan->reads = NULL;
+    plan->deadband = NULL;
+    plan->nblocks = 0;
+    plan->nreads = 0;
+    plan->size = 0;
+    plan->points = 0;
+}
+
+static int read_one(int type, modbus_t *modbus_ctx,
+                    struct in_modbus_read *read, void *buf)
+{
+    uint8_t *bits = (uint8_t *) buf + read->offset;
+    uint16_t *registers = (uint16_t *) buf + read->offset;
+
+    switch (type) {
+    case COILS:
+        return modbus_read_bits(modbus_ctx, read->addr, read->no, bits);
+    case DISCRETE_INPUTS:
+        return modbus_read_input_bits(modbus_ctx, read->addr, read->no, bits);
+    case HOLDING_REGISTERS:
+        return modbus_read_registers(modbus_ctx, read->addr, read->no,
+                                     registers);
+    default:
+        return modbus_read_input_registers(modbus_ctx, read->addr, read->no,
+                                           registers);
+    }
+}
+
+/*
+ * Issue every request of the plan on the acquired 'link', 'stamps' gets
+ * the monotonic time of each response. Returns the number of values
+ * stored in 'buf' or -1 on the first failed request, with errno left
+ * untouched.
+ */
+int in_modbus_plan_read(struct in_modbus_plan *plan, struct modbus_conn *link,
+                        void *buf, uint64_t *stamps)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < plan->nreads; i++) {
+        /* Back-to-back requests on a serial bus, t3.5 apart */
+        modbus_conn_pace(link);
+        errno = 0;
+        ret = read_one(plan->type, link->modbus_ctx, &plan->reads[i], buf);
+        stamps[i] = in_modbus_clock_ns();
+        modbus_conn_frame_end(link);
+        if (ret != plan->reads[i].no) {
+            if (ret >= 0 && errno == 0) {
+                errno = EMBBADDATA;
+            }
+            return -1;
+        }
+    }
+
+    return plan->size;
+}
+
+/* Index of the request whose response holds value 'offset' of the buffer */
+int in_modbus_plan_read_of(struct in_modbus_plan *plan, int offset)
+{
+    int i;
+
+    for (i = plan->nreads - 1; i > 0; i--) {
+        if (plan->reads[i].offset <= offset) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Report by exception: flag in 'changed' the values of 'cur' that differ
+ * from 'prev' by more than their deadband, and bring 'prev' up to date
+ * for those values only, so slow drifts still add up to a change. The
+ * whole buffer is compared one request at a time, 'changed' is indexed
+ * like it. Returns the number of values flagged.
+ */
+int in_modbus_plan_diff(struct in_modbus_plan *plan, const void *cur,
+                        void *prev, uint8_t *changed)
+{
+    int i;
+    int j;
+    int d;
+    int db;
+    int n = 0;
+    int off;
+    int no;
+    const uint8_t *cbits = cur;
+    const uint16_t *cregs = cur;
+    uint8_t *pbits = prev;
+    uint16_t *pregs = prev;
+
+    for (j = 0; j < plan->nreads; j++) {
+        off = plan->reads[j].offset;
+        no = plan->reads[j].no;
+
+        if (BIT_TYPE(plan->type)) {
+            /* Steady state: nothing moved, one memcmp per request */
+            if (memcmp(cbits + off, pbits + off, no) == 0) {
+                memset(changed + off, 0, no);
+                continue;
+            }
+            for (i = off; i < off + no; i++) {
+                changed[i] = cbits[i] != pbits[i];
+                pbits[i] = cbits[i];
+                n += changed[i];
+            }
+        }
+        else if (!plan->deadband) {
+            if (memcmp(cregs + off, pregs + off, no * sizeof(uint16_t)) == 0) {
+                memset(changed + off, 0, no);
+                continue;
+            }
+            for (i = off; i < off + no; i++) {
+                changed[i] = cregs[i] != pregs[i];
+                pregs[i] = cregs[i];
+                n += changed[i];
+            }
+        }
+        else {
+            /* Branch free so the compiler can vectorize it */
+            for (i = off; i < off + no; i++) {
+                d = (int) cregs[i] - (int) pregs[i];
+                db = plan->deadband[i];
+                changed[i] = (d > db) | (d < -db);
+                pregs[i] = changed[i] ? cregs[i] : pregs[i];
+                n += changed[i];
+            }
+        }
+    }
+
+    return n;
+}
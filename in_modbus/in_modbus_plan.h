@@ -0,0 +1,108 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_PLAN_H
+#define FLB_IN_MODBUS_PLAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <modbus.h>
+
+/* Range of points requested by the configuration */
+struct in_modbus_block {
+    int addr;
+    int no;
+    int offset;         /* first value of the block in the plan buffer */
+    int interval_ms;    /* scan interval of the block */
+    int deadband;       /* change reported by exception, registers only */
+    int point;          /* typed point read by the block, -1 if none */
+};
+
+/* Blocks listed as raw values in the record, as opposed to typed points */
+#define IN_MODBUS_RAW_BLOCK(block) ((block)->point < 0)
+
+/* Upper bound of the 16-bit Modbus address space */
+#define IN_MODBUS_ADDR_MAX 65536
+
+/* A single Modbus request issued by the plan */
+struct in_modbus_read {
+    int addr;
+    int no;
+    int offset;         /* where the response is stored in the plan buffer */
+};
+
+/*
+ * Read plan of one data type: the configured blocks are turned into a list
+ * of protocol-legal requests whose responses land side by side in a single
+ * buffer of 'size' elements (uint8_t for bits, uint16_t for registers).
+ * Blocks closer than 'max_gap' points share a request, so the buffer may
+ * hold values nobody asked for; 'points' is what the record carries.
+ *
+ * Every block of a plan is scanned at the same interval, which is a
+ * multiple ('period') of the collector tick.
+ */
+struct in_modbus_plan {
+    int type;
+    int max_per_read;
+    int max_gap;
+
+    int interval_ms;
+    int period;
+    size_t buf_offset;  /* plan buffer within the scan buffer, in bytes */
+
+    int nblocks;
+    struct in_modbus_block *blocks;
+
+    int nreads;
+    struct in_modbus_read *reads;
+    int first_read;     /* stamp of the first request in the device */
+
+    int size;
+    int points;         /* values of the raw blocks */
+    int nraw;
+
+    /* Deadband of every register of the buffer, NULL when all are 0 */
+    uint16_t *deadband;
+};
+
+int in_modbus_plan_build(struct in_modbus_plan *plan, int type,
+                         struct in_modbus_block *blocks, int nblocks,
+                         int max_per_read, int max_gap);
+void in_modbus_plan_destroy(struct in_modbus_plan *plan);
+
+/* A plan is read on every 'period'-th scan */
+static inline int in_modbus_plan_due(struct in_modbus_plan *plan,
+                                     uint64_t scan)
+{
+    return plan->size > 0 && scan % plan->period == 0;
+}
+
+struct modbus_conn;
+
+int in_modbus_plan_read(struct in_modbus_plan *plan, struct modbus_conn *link,
+                        void *buf, uint64_t *stamps);
+int in_modbus_plan_read_of(struct in_modbus_plan *plan, int offset);
+int in_modbus_plan_diff(struct in_modbus_plan *plan, const void *cur,
+                        void *prev, uint8_t *changed);
+
+#endif
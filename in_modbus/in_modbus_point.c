@@ -0,0 +1,822 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_pack.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "in_modbus.h"
+#include "in_modbus_point.h"
+
+/* Registers taken by each data type, strings give their own length */
+static const struct {
+    const char *name;
+    int nregs;
+} dtypes[] = {
+    [POINT_INT16]   = { "int16",   1 },
+    [POINT_UINT16]  = { "uint16",  1 },
+    [POINT_INT32]   = { "int32",   2 },
+    [POINT_UINT32]  = { "uint32",  2 },
+    [POINT_FLOAT32] = { "float32", 2 },
+    [POINT_FLOAT64] = { "float64", 4 },
+    [POINT_STRING]  = { "string",  0 },
+};
+
+/* How each byte order departs from the Modbus (big endian) one */
+static const struct {
+    const char *name;
+    int word_swap;
+    int byte_swap;
+} orders[] = {
+    [ORDER_ABCD] = { "ABCD", 0, 0 },
+    [ORDER_CDAB] = { "CDAB", 1, 0 },
+    [ORDER_BADC] = { "BADC", 0, 1 },
+    [ORDER_DCBA] = { "DCBA", 1, 1 },
+};
+
+#define POINT_DTYPES (sizeof(dtypes) / sizeof(dtypes[0]))
+#define POINT_ORDERS (sizeof(orders) / sizeof(orders[0]))
+
+/* Longest string point, in registers */
+#define POINT_MAX_STRING 64
+
+/*
+ * Precompute where every byte of the value sits on the wire, so decoding
+ * is the same fixed loop for every type and byte order.
+ */
+static void point_set_perm(struct in_modbus_point *point)
+{
+    int i;
+    int word;
+    int byte;
+    int n = point->nregs * 2;
+
+    for (i = 0; i < 8; i++) {
+        if (i >= n) {
+            point->perm[i] = 8;
+            continue;
+        }
+
+        word = i / 2;
+        byte = i % 2;
+        if (orders[point->order].word_swap) {
+            word = point->nregs - 1 - word;
+        }
+        if (orders[point->order].byte_swap) {
+            byte = 1 - byte;
+        }
+        point->perm[i] = word * 2 + byte;
+    }
+
+    point->shift = 64 - n * 8;
+}
+
+/*
+ * Encode the msgpack str header and name of a point once, records then
+ * copy the bytes as they are.
+ */
+static int point_set_key(struct in_modbus_point *point, const char *name,
+                         int len)
+{
+    int hdr;
+    unsigned char *key;
+
+    if (len < 1 || len > 0xffff) {
+        return -1;
+    }
+    hdr = len < 32 ? 1 : len < 256 ? 2 : 3;
+
+    key = flb_malloc(hdr + len + 1);
+    if (!key) {
+        flb_errno();
+        return -1;
+    }
+
+    if (hdr == 1) {
+        key[0] = 0xa0 | len;
+    }
+    else if (hdr == 2) {
+        key[0] = 0xd9;
+        key[1] = len;
+    }
+    else {
+        key[0] = 0xda;
+        key[1] = len >> 8;
+        key[2] = len & 0xff;
+    }
+    memcpy(key + hdr, name, len);
+    key[hdr + len] = '\0';
+
+    point->key = (char *) key;
+    point->key_len = hdr + len;
+    point->name = point->key + hdr;
+    point->name_len = len;
+
+    return 0;
+}
+
+/* Room for one more point at the end of ctx->points */
+static struct in_modbus_point *point_new(struct flb_in_modbus_config *ctx)
+{
+    struct in_modbus_point *points;
+
+    points = flb_realloc(ctx->points,
+                         (ctx->npoints + 1) * sizeof(struct in_modbus_point));
+    if (!points) {
+        flb_errno();
+        return NULL;
+    }
+    ctx->points = points;
+
+    memset(&points[ctx->npoints], 0, sizeof(struct in_modbus_point));
+    return &points[ctx->npoints];
+}
+
+/*
+ * Set up a point from its description: 'reg' is <hr|ir>address, 'dtype'
+ * one of the data types and 'order' a byte order or NULL. Scale, offset
+ * and deadband keep their defaults and are set by the caller.
+ */
+static int point_init(struct in_modbus_point *point, const char *name,
+                      int name_len, const char *reg, const char *dtype,
+                      const char *order)
+{
+    int i;
+    int n;
+    char *end;
+
+    /* Register type and address */
+    if (strncasecmp(reg, "hr", 2) == 0) {
+        point->type = HOLDING_REGISTERS;
+    }
+    else if (strncasecmp(reg, "ir", 2) == 0) {
+        point->type = INPUT_REGISTERS;
+    }
+    else {
+        return -1;
+    }
+    point->addr = strtol(reg + 2, &end, 10);
+    if (end == reg + 2 || *end != '\0') {
+        return -1;
+    }
+
+    /* Data type, strings carry their length in registers */
+    point->dtype = -1;
+    for (i = 0; i < (int) POINT_DTYPES; i++) {
+        n = strlen(dtypes[i].name);
+        if (i == POINT_STRING && strncasecmp(dtype, dtypes[i].name, n) == 0) {
+            point->dtype = i;
+            point->nregs = strtol(dtype + n, &end, 10);
+            if (*end != '\0' || point->nregs < 1 ||
+                point->nregs > POINT_MAX_STRING) {
+                return -1;
+            }
+            break;
+        }
+        if (strcasecmp(dtype, dtypes[i].name) == 0) {
+            point->dtype = i;
+            point->nregs = dtypes[i].nregs;
+            break;
+        }
+    }
+    if (point->dtype == -1) {
+        return -1;
+    }
+
+    point->order = ORDER_ABCD;
+    if (order && *order) {
+        for (i = 0; i < (int) POINT_ORDERS; i++) {
+            if (strcasecmp(order, orders[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == (int) POINT_ORDERS) {
+            return -1;
+        }
+        point->order = i;
+    }
+
+    if (point->addr < 0 || point->addr + point->nregs > IN_MODBUS_ADDR_MAX) {
+        return -1;
+    }
+
+    point->scale = 1;
+    point->offset = 0;
+    point->scaled = FLB_FALSE;
+    point->deadband = 0;
+    point->plan = -1;
+    point->reg = 0;
+    point_set_perm(point);
+
+    return point_set_key(point, name, name_len);
+}
+
+/* Parse a number column, an empty one keeps 'def' */
+static int parse_number(const char *str, double def, double *number)
+{
+    char *end;
+
+    if (!str || *str == '\0') {
+        *number = def;
+        return 0;
+    }
+
+    *number = strtod(str, &end);
+    if (end == str || *end != '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+/* Apply scale and offset, only numbers can be scaled */
+static int point_set_scale(struct in_modbus_point *point, double scale,
+                           double offset)
+{
+    if (scale == 1 && offset == 0) {
+        return 0;
+    }
+    if (point->dtype == POINT_STRING) {
+        return -1;
+    }
+
+    point->scale = scale;
+    point->offset = offset;
+    point->scaled = FLB_TRUE;
+    return 0;
+}
+
+/*
+ * Parse one entry of 'points':
+ *
+ *   name=<hr|ir>address:type[:order][:scale[:offset]][~deadband]
+ *
+ * e.g. "flow=hr100:float32:CDAB:0.1~0.5" or "serial=ir20:string8".
+ */
+static int parse_point(struct flb_in_modbus_config *ctx, const char *entry,
+                       int len)
+{
+    int n = 0;
+    char buf[128];
+    char *tok;
+    char *save;
+    char *fields[6] = { NULL };     /* [5] is the byte order */
+    char *db;
+    double scale;
+    double offset;
+    double deadband;
+    struct in_modbus_point *point;
+
+    if (len >= (int) sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, entry, len);
+    buf[len] = '\0';
+
+    tok = strchr(buf, '=');
+    if (!tok || tok == buf) {
+        return -1;
+    }
+    *tok++ = '\0';
+
+    /* Deadband of the value, as in the register map */
+    db = strchr(tok, '~');
+    if (db) {
+        *db++ = '\0';
+    }
+
+    /* address, type, then an optional order before the numbers */
+    for (tok = strtok_r(tok, ":", &save); tok && n < 4;
+         tok = strtok_r(NULL, ":", &save)) {
+        if (n == 2 && (*tok < '0' || *tok > '9') && *tok != '-' &&
+            *tok != '.') {
+            fields[5] = tok;
+            continue;
+        }
+        fields[n++] = tok;
+    }
+    if (tok || n < 2) {
+        return -1;
+    }
+
+    point = point_new(ctx);
+    if (!point) {
+        return -1;
+    }
+
+    if (point_init(point, buf, strlen(buf), fields[0], fields[1],
+                   fields[5]) == -1 ||
+        parse_number(fields[2], 1, &scale) == -1 ||
+        parse_number(fields[3], 0, &offset) == -1 ||
+        point_set_scale(point, scale, offset) == -1 ||
+        (db && (parse_number(db, -1, &deadband) == -1 || deadband < 0))) {
+        flb_free(point->key);
+        return -1;
+    }
+    if (db) {
+        point->deadband = deadband;
+    }
+
+    ctx->npoints++;
+    return 0;
+}
+
+/*
+ * CSV register map, one point per line:
+ *
+ *   name,address,type,order,scale,offset,deadband
+ *
+ * Only the first three columns are required. Empty lines, lines starting
+ * with '#' and a header line starting with "name" are skipped.
+ */
+static int load_csv(struct flb_in_modbus_config *ctx, char *data,
+                    const char *path)
+{
+    int i;
+    int n;
+    int lineno = 0;
+    char *line;
+    char *next;
+    char *p;
+    char *fields[7];
+    double scale;
+    double offset;
+    double deadband;
+    struct in_modbus_point *point;
+
+    for (line = data; line; line = next) {
+        lineno++;
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+
+        /* Split in place, trimming every column */
+        n = 0;
+        p = line;
+        while (n < 7) {
+            fields[n++] = p;
+            p = strchr(p, ',');
+            if (!p) {
+                break;
+            }
+            *p++ = '\0';
+        }
+        if (p) {
+            goto error;
+        }
+        for (i = 0; i < n; i++) {
+            while (*fields[i] == ' ' || *fields[i] == '\t') {
+                fields[i]++;
+            }
+            p = fields[i] + strlen(fields[i]);
+            while (p > fields[i] && (p[-1] == ' ' || p[-1] == '\t' ||
+                                     p[-1] == '\r')) {
+                *--p = '\0';
+            }
+        }
+        for (i = n; i < 7; i++) {
+            fields[i] = NULL;
+        }
+
+        if ((n == 1 && *fields[0] == '\0') || *fields[0] == '#' ||
+            (lineno == 1 && strcasecmp(fields[0], "name") == 0)) {
+            continue;
+        }
+        if (n < 3) {
+            goto error;
+        }
+
+        point = point_new(ctx);
+        if (!point) {
+            return -1;
+        }
+        if (point_init(point, fields[0], strlen(fields[0]), fields[1],
+                       fields[2], fields[3]) == -1) {
+            goto error;
+        }
+        ctx->npoints++;
+
+        if (parse_number(fields[4], 1, &scale) == -1 ||
+            parse_number(fields[5], 0, &offset) == -1 ||
+            parse_number(fields[6], 0, &deadband) == -1 ||
+            point_set_scale(point, scale, offset) == -1 || deadband < 0) {
+            goto error;
+        }
+        point->deadband = deadband;
+    }
+
+    return 0;
+
+error:
+    flb_error("[in_modbus] %s:%d: invalid point, has to be "
+              "name,address,type[,order[,scale[,offset[,deadband]]]]",
+              path, lineno);
+    return -1;
+}
+
+/* Value of 'key' in a msgpack map, NULL if missing */
+static msgpack_object *map_get(msgpack_object *map, const char *key)
+{
+    int i;
+    int len = strlen(key);
+    msgpack_object_kv *kv;
+
+    for (i = 0; i < map->via.map.size; i++) {
+        kv = &map->via.map.ptr[i];
+        if (kv->key.type == MSGPACK_OBJECT_STR &&
+            kv->key.via.str.size == len &&
+            strncasecmp(kv->key.via.str.ptr, key, len) == 0) {
+            return &kv->val;
+        }
+    }
+
+    return NULL;
+}
+
+/* Copy a string member of a JSON point, "" when missing */
+static int map_get_str(msgpack_object *map, const char *key, char *buf,
+                       int size)
+{
+    msgpack_object *o = map_get(map, key);
+
+    buf[0] = '\0';
+    if (!o) {
+        return 0;
+    }
+    if (o->type != MSGPACK_OBJECT_STR || o->via.str.size >= size) {
+        return -1;
+    }
+    memcpy(buf, o->via.str.ptr, o->via.str.size);
+    buf[o->via.str.size] = '\0';
+    return 0;
+}
+
+/* Read a number member of a JSON point, 'def' when missing */
+static int map_get_number(msgpack_object *map, const char *key, double def,
+                          double *number)
+{
+    msgpack_object *o = map_get(map, key);
+
+    if (!o) {
+        *number = def;
+    }
+    else if (o->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        *number = o->via.u64;
+    }
+    else if (o->type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        *number = o->via.i64;
+    }
+    else if (o->type == MSGPACK_OBJECT_FLOAT) {
+        *number = o->via.f64;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * JSON register map, an array of objects with the same members as the
+ * CSV columns:
+ *
+ *   [{"name": "flow", "address": "hr100", "type": "float32",
+ *     "order": "CDAB", "scale": 0.1}]
+ */
+static int load_json(struct flb_in_modbus_config *ctx, char *data,
+                     size_t size, const char *path)
+{
+    int i;
+    int ret;
+    int root_type;
+    char *buf = NULL;
+    char reg[16];
+    char dtype[16];
+    char order[8];
+    size_t buf_size;
+    size_t off = 0;
+    double scale;
+    double offset;
+    double deadband;
+    msgpack_object *root;
+    msgpack_object *entry;
+    msgpack_object *name;
+    msgpack_unpacked result;
+    struct in_modbus_point *point;
+
+    ret = flb_pack_json(data, size, &buf, &buf_size, &root_type);
+    if (ret != 0) {
+        flb_error("[in_modbus] %s: invalid JSON", path);
+        return -1;
+    }
+
+    msgpack_unpacked_init(&result);
+    ret = msgpack_unpack_next(&result, buf, buf_size, &off);
+    root = &result.data;
+    if (ret != MSGPACK_UNPACK_SUCCESS || root->type != MSGPACK_OBJECT_ARRAY) {
+        flb_error("[in_modbus] %s: has to be an array of points", path);
+        ret = -1;
+        goto out;
+    }
+
+    ret = 0;
+    for (i = 0; i < root->via.array.size; i++) {
+        entry = &root->via.array.ptr[i];
+        if (entry->type != MSGPACK_OBJECT_MAP) {
+            ret = -1;
+            break;
+        }
+
+        name = map_get(entry, "name");
+        if (!name || name->type != MSGPACK_OBJECT_STR ||
+            map_get_str(entry, "address", reg, sizeof(reg)) == -1 ||
+            map_get_str(entry, "type", dtype, sizeof(dtype)) == -1 ||
+            map_get_str(entry, "order", order, sizeof(order)) == -1 ||
+            map_get_number(entry, "scale", 1, &scale) == -1 ||
+            map_get_number(entry, "offset", 0, &offset) == -1 ||
+            map_get_number(entry, "deadband", 0, &deadband) == -1 ||
+            deadband < 0) {
+            ret = -1;
+            break;
+        }
+
+        point = point_new(ctx);
+        if (!point) {
+            ret = -1;
+            break;
+        }
+        if (point_init(point, name->via.str.ptr, name->via.str.size, reg,
+                       dtype, order) == -1) {
+            ret = -1;
+            break;
+        }
+        ctx->npoints++;
+
+        if (point_set_scale(point, scale, offset) == -1) {
+            ret = -1;
+            break;
+        }
+        point->deadband = deadband;
+    }
+
+    if (ret == -1) {
+        flb_error("[in_modbus] %s: invalid point #%d", path, i + 1);
+    }
+
+out:
+    msgpack_unpacked_destroy(&result);
+    flb_free(buf);
+    return ret;
+}
+
+/* Load the points of a CSV or JSON register map file */
+static int load_map(struct flb_in_modbus_config *ctx, const char *path)
+{
+    int ret;
+    long size;
+    char *data;
+    char *p;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        flb_errno();
+        flb_error("[in_modbus] Cannot open register map %s", path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = flb_malloc(size + 1);
+    if (!data) {
+        flb_errno();
+        fclose(f);
+        return -1;
+    }
+    if (size > 0 && fread(data, size, 1, f) != 1) {
+        flb_errno();
+        flb_free(data);
+        fclose(f);
+        return -1;
+    }
+    data[size] = '\0';
+    fclose(f);
+
+    /* JSON maps are an array, anything else is read as CSV */
+    for (p = data; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; p++);
+    if (*p == '[') {
+        ret = load_json(ctx, data, size, path);
+    }
+    else {
+        ret = load_csv(ctx, data, path);
+    }
+
+    flb_free(data);
+    return ret;
+}
+
+/*
+ * Typed points come from the 'points' property, a comma separated list,
+ * and from the 'register_map' file, in that order.
+ */
+int in_modbus_points_configure(struct flb_in_modbus_config *ctx,
+                               struct flb_input_instance *in)
+{
+    int len;
+    const char *str;
+    const char *next;
+
+    str = flb_input_get_property("points", in);
+    while (str && *str) {
+        while (*str == ' ' || *str == ',') {
+            str++;
+        }
+        if (*str == '\0') {
+            break;
+        }
+
+        next = strchr(str, ',');
+        len = next ? next - str : (int) strlen(str);
+        while (len > 0 && str[len - 1] == ' ') {
+            len--;
+        }
+
+        if (parse_point(ctx, str, len) == -1) {
+            flb_error("[in_modbus] Invalid point '%.*s': has to be "
+                      "name=<hr|ir>address:type[:order][:scale[:offset]][~deadband]",
+                      len, str);
+            return -1;
+        }
+
+        str = next ? next : str + strlen(str);
+    }
+
+    str = flb_input_get_property("register_map", in);
+    if (str) {
+        if (load_map(ctx, str) == -1) {
+            return -1;
+        }
+        flb_debug("[in_modbus] %d points from %s", ctx->npoints, str);
+    }
+
+    return 0;
+}
+
+void in_modbus_points_destroy(struct flb_in_modbus_config *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->npoints; i++) {
+        flb_free(ctx->points[i].key);
+    }
+    flb_free(ctx->points);
+
+    ctx->points = NULL;
+    ctx->npoints = 0;
+}
+
+/* Bits of a numeric point in host order, right aligned */
+static uint64_t point_raw(struct in_modbus_point *point,
+                          const uint16_t *registers)
+{
+    int i;
+    uint8_t wire[9];
+    uint64_t raw;
+
+    /* Modbus sends registers big endian */
+    for (i = 0; i < point->nregs; i++) {
+        wire[i * 2] = registers[i] >> 8;
+        wire[i * 2 + 1] = registers[i] & 0xff;
+    }
+    wire[8] = 0;
+
+    /* Same eight steps whatever the width and order */
+    raw = 0;
+    for (i = 0; i < 8; i++) {
+        raw = (raw << 8) | wire[point->perm[i]];
+    }
+
+    return raw >> point->shift;
+}
+
+/*
+ * Value of a numeric point as reported, scale and offset applied. -1 for
+ * strings, which have no value to compare.
+ */
+int in_modbus_point_value(struct in_modbus_point *point,
+                          const uint16_t *registers, double *value)
+{
+    uint64_t raw;
+    uint32_t u32;
+    float f32;
+
+    if (point->dtype == POINT_STRING) {
+        return -1;
+    }
+
+    raw = point_raw(point, registers);
+    switch (point->dtype) {
+    case POINT_INT16:
+    case POINT_INT32:
+        *value = (int64_t) (raw << point->shift) >> point->shift;
+        break;
+    case POINT_FLOAT32:
+        u32 = raw;
+        memcpy(&f32, &u32, sizeof(f32));
+        *value = f32;
+        break;
+    case POINT_FLOAT64:
+        memcpy(value, &raw, sizeof(*value));
+        break;
+    default:
+        *value = raw;
+        break;
+    }
+
+    if (point->scaled) {
+        *value = *value * point->scale + point->offset;
+    }
+    return 0;
+}
+
+/* Pack the value of a point, 'registers' being its first register */
+void in_modbus_point_pack(struct in_modbus_point *point,
+                          const uint16_t *registers, msgpack_packer *mp_pck)
+{
+    int i;
+    int len;
+    int swap;
+    uint64_t raw;
+    uint32_t u32;
+    float f32;
+    double value;
+    char str[POINT_MAX_STRING * 2];
+
+    if (point->dtype == POINT_STRING) {
+        /* Two characters per register, NUL or space padded */
+        swap = orders[point->order].byte_swap;
+        for (i = 0; i < point->nregs; i++) {
+            str[i * 2 + swap] = registers[i] >> 8;
+            str[i * 2 + 1 - swap] = registers[i] & 0xff;
+        }
+        len = point->nregs * 2;
+        while (len > 0 && (str[len - 1] == '\0' || str[len - 1] == ' ')) {
+            len--;
+        }
+        msgpack_pack_str(mp_pck, len);
+        msgpack_pack_str_body(mp_pck, str, len);
+        return;
+    }
+
+    if (point->scaled) {
+        in_modbus_point_value(point, registers, &value);
+        msgpack_pack_double(mp_pck, value);
+        return;
+    }
+
+    raw = point_raw(point, registers);
+    switch (point->dtype) {
+    case POINT_INT16:
+    case POINT_INT32:
+        msgpack_pack_int64(mp_pck,
+                           (int64_t) (raw << point->shift) >> point->shift);
+        break;
+    case POINT_FLOAT32:
+        u32 = raw;
+        memcpy(&f32, &u32, sizeof(f32));
+        msgpack_pack_float(mp_pck, f32);
+        break;
+    case POINT_FLOAT64:
+        memcpy(&value, &raw, sizeof(value));
+        msgpack_pack_double(mp_pck, value);
+        break;
+    default:
+        msgpack_pack_uint64(mp_pck, raw);
+        break;
+    }
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_POINT_H
+#define FLB_IN_MODBUS_POINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <msgpack.h>
+
+struct flb_in_modbus_config;
+struct flb_input_instance;
+
+/* Data types a point can be decoded as */
+enum {
+    POINT_INT16 = 0,
+    POINT_UINT16,
+    POINT_INT32,
+    POINT_UINT32,
+    POINT_FLOAT32,
+    POINT_FLOAT64,
+    POINT_STRING
+};
+
+/* Byte order of a value, 'A' being the most significant byte */
+enum {
+    ORDER_ABCD = 0,     /* big endian words, big endian bytes */
+    ORDER_CDAB,         /* little endian words */
+    ORDER_BADC,         /* bytes swapped within each word */
+    ORDER_DCBA          /* little endian */
+};
+
+/*
+ * Named value decoded from one or more consecutive registers. The point
+ * is read by a block of its own, 'plan' and 'reg' locate its registers
+ * in the plan and 'buf_offset' in the scan buffer once the plans are
+ * built. 'key' holds the name already encoded as a msgpack str.
+ */
+struct in_modbus_point {
+    char *key;
+    int key_len;
+    const char *name;   /* within 'key' */
+    int name_len;
+
+    int type;           /* HOLDING_REGISTERS or INPUT_REGISTERS */
+    int addr;
+    int nregs;
+    int dtype;
+    int order;
+
+    /* value * scale + offset, only applied when 'scaled' */
+    double scale;
+    double offset;
+    int scaled;
+
+    /* Wire byte of each value byte (MSB first), 8 pads with a zero */
+    uint8_t perm[8];
+    int shift;          /* unused bits above the value once assembled */
+
+    /* Report by exception: change of the value, after scale and offset */
+    double deadband;
+
+    int plan;
+    int reg;
+    size_t buf_offset;
+};
+
+int in_modbus_points_configure(struct flb_in_modbus_config *ctx,
+                               struct flb_input_instance *in);
+void in_modbus_points_destroy(struct flb_in_modbus_config *ctx);
+void in_modbus_point_pack(struct in_modbus_point *point,
+                          const uint16_t *registers, msgpack_packer *mp_pck);
+int in_modbus_point_value(struct in_modbus_point *point,
+                          const uint16_t *registers, double *value);
+
+#endif
@@ -0,0 +1,208 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_utils.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "in_modbus.h"
+#include "in_modbus_device.h"
+#include "in_modbus_sched.h"
+#include "in_modbus_stats.h"
+
+/* Overruns are logged at most this often */
+#define OVERRUN_LOG_US (10 * 1000000ULL)
+
+int in_modbus_sched_configure(struct flb_in_modbus_config *ctx,
+                              struct flb_input_instance *in)
+{
+    int ndevs;
+    const char *str;
+
+    str = flb_input_get_property("overrun_policy", in);
+    if (str == NULL || strcmp(str, "skip") == 0) {
+        ctx->overrun_policy = IN_MODBUS_OVERRUN_SKIP;
+    }
+    else if (strcmp(str, "stretch") == 0) {
+        ctx->overrun_policy = IN_MODBUS_OVERRUN_STRETCH;
+    }
+    else {
+        flb_error("[in_modbus] overrun_policy %s unknown: has to be "
+                  "[skip|stretch]", str);
+        return -1;
+    }
+
+    /* Slaves scanned one after the other over the tick, not all at once */
+    str = flb_input_get_property("spread", in);
+    ctx->spread = str != NULL && flb_utils_bool(str);
+    if (ctx->spread && ctx->async) {
+        flb_error("[in_modbus] spread cannot be used with async");
+        return -1;
+    }
+
+    ctx->nslots = 1;
+    ndevs = mk_list_size(&ctx->devices);
+    if (ctx->spread && ctx->workers == 0 && ndevs > 1) {
+        ctx->nslots = ndevs < ctx->tick_ms ? ndevs : ctx->tick_ms;
+    }
+    ctx->slot_us = (uint64_t) ctx->tick_ms * 1000 / ctx->nslots;
+
+    /* Slaves slower than this are polled less often, 0 never */
+    ctx->slow_scan_ms = value_from_cfg(in, "slow_scan_ms", ctx->tick_ms);
+    ctx->slow_backoff_max = value_from_cfg(in, "slow_backoff_max", 16);
+    if (ctx->slow_scan_ms < 0 || ctx->slow_backoff_max < 1) {
+        flb_error("[in_modbus] slow_scan_ms cannot be negative and "
+                  "slow_backoff_max has to be positive");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Blocking transport, when the collector fires: whether the next slot
+ * runs now. After an overrun the timer has expired already and fires
+ * right away; that call is dropped (skip) or ignored until a full slot
+ * after the end of the overrun (stretch).
+ */
+int in_modbus_sched_begin(struct flb_in_modbus_config *ctx, uint64_t now_us)
+{
+    uint64_t missed;
+    uint64_t half = ctx->slot_us / 2;
+
+    if (ctx->next_us == 0) {
+        ctx->next_us = now_us;
+    }
+
+    if (now_us + half < ctx->next_us) {
+        return FLB_FALSE;
+    }
+
+    /* Late: go on from the closest tick, the ones in between are lost */
+    if (now_us > ctx->next_us + half) {
+        if (ctx->overrun_policy == IN_MODBUS_OVERRUN_SKIP) {
+            missed = (now_us - ctx->next_us + half) / ctx->slot_us;
+            ctx->slot += missed;
+            ctx->next_us += missed * ctx->slot_us;
+        }
+        else {
+            ctx->next_us = now_us;
+        }
+    }
+
+    ctx->next_us += ctx->slot_us;
+    return FLB_TRUE;
+}
+
+/* Blocking transport, once the slot is over */
+void in_modbus_sched_end(struct flb_in_modbus_config *ctx, uint64_t start_us,
+                         uint64_t end_us)
+{
+    if (end_us <= ctx->next_us) {
+        return;
+    }
+
+    in_modbus_sched_overrun(ctx, end_us - start_us,
+                            (end_us - ctx->next_us) / ctx->slot_us + 1);
+    if (ctx->overrun_policy == IN_MODBUS_OVERRUN_STRETCH) {
+        ctx->next_us = end_us + ctx->slot_us;
+    }
+}
+
+/* A scan took 'took_us', running over 'missed' ticks (or slots) */
+void in_modbus_sched_overrun(struct flb_in_modbus_config *ctx,
+                             uint64_t took_us, uint64_t missed)
+{
+    uint64_t now;
+    uint64_t last;
+    uint64_t overruns;
+
+    overruns = __atomic_add_fetch(&ctx->overruns, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ctx->overrun_ticks, missed, __ATOMIC_RELAXED);
+
+    now = in_modbus_stats_time_us();
+    last = __atomic_load_n(&ctx->overrun_log_us, __ATOMIC_RELAXED);
+    if ((last != 0 && now < last + OVERRUN_LOG_US) ||
+        !__atomic_compare_exchange_n(&ctx->overrun_log_us, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    flb_warn("[in_modbus] Scan took %" PRIu64 " ms, longer than its %" PRIu64
+             " ms slot, next scan %s (%" PRIu64 " overruns so far)",
+             took_us / 1000, ctx->slot_us / 1000,
+             ctx->overrun_policy == IN_MODBUS_OVERRUN_SKIP ?
+             "on the following tick" : "delayed", overruns);
+}
+
+/* Whether a slave backed off after slow scans sits this scan out */
+int in_modbus_sched_skip(struct flb_in_modbus_config *ctx,
+                         struct in_modbus_device *dev)
+{
+    if (dev->skip == 0) {
+        return FLB_FALSE;
+    }
+
+    dev->skip--;
+    return FLB_TRUE;
+}
+
+/*
+ * Slaves slower than 'slow_scan_ms' skip scans: one after the first slow
+ * scan, doubling up to 'slow_backoff_max' while they stay slow and
+ * halving again once they are fast.
+ */
+void in_modbus_sched_scanned(struct flb_in_modbus_config *ctx,
+                             struct in_modbus_device *dev,
+                             uint64_t latency_us)
+{
+    if (ctx->slow_scan_ms == 0) {
+        return;
+    }
+
+    if (latency_us > (uint64_t) ctx->slow_scan_ms * 1000) {
+        if (dev->backoff == 0) {
+            flb_warn("[in_modbus] Slave %d at %s took %" PRIu64 " ms, "
+                     "polling it less often", dev->unit_id,
+                     dev->conn->address, latency_us / 1000);
+            dev->backoff = 1;
+        }
+        else if (dev->backoff < ctx->slow_backoff_max) {
+            dev->backoff *= 2;
+            if (dev->backoff > ctx->slow_backoff_max) {
+                dev->backoff = ctx->slow_backoff_max;
+            }
+        }
+    }
+    else if (dev->backoff > 0) {
+        dev->backoff /= 2;
+        if (dev->backoff == 0) {
+            flb_info("[in_modbus] Slave %d at %s polled at full rate again",
+                     dev->unit_id, dev->conn->address);
+        }
+    }
+
+    dev->skip = dev->backoff;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_SCHED_H
+#define FLB_IN_MODBUS_SCHED_H
+
+#include <fluent-bit/flb_input.h>
+#include <stdint.h>
+
+#include "in_modbus.h"
+
+/* What happens to the ticks a scan ran over */
+enum {
+    IN_MODBUS_OVERRUN_SKIP = 0,     /* dropped, scans stay on the tick */
+    IN_MODBUS_OVERRUN_STRETCH       /* next scan a full tick after it */
+};
+
+struct in_modbus_device;
+
+int in_modbus_sched_configure(struct flb_in_modbus_config *ctx,
+                              struct flb_input_instance *in);
+int in_modbus_sched_begin(struct flb_in_modbus_config *ctx, uint64_t now_us);
+void in_modbus_sched_end(struct flb_in_modbus_config *ctx, uint64_t start_us,
+                         uint64_t end_us);
+void in_modbus_sched_overrun(struct flb_in_modbus_config *ctx,
+                             uint64_t took_us, uint64_t missed);
+int in_modbus_sched_skip(struct flb_in_modbus_config *ctx,
+                         struct in_modbus_device *dev);
+void in_modbus_sched_scanned(struct flb_in_modbus_config *ctx,
+                             struct in_modbus_device *dev,
+                             uint64_t latency_us);
+
+#endif
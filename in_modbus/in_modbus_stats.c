@@ -0,0 +1,472 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_utils.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <modbus.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <fluent-bit/flb_metrics.h>
+#endif
+
+#include "in_modbus.h"
+#include "in_modbus_device.h"
+#include "in_modbus_stats.h"
+
+#define SUB IN_MODBUS_STATS_SUB
+
+/* Ids of the instance metrics, after the ones of the engine */
+#define METRIC_ID_BASE 100
+
+static const char *metric_names[IN_MODBUS_STATS_METRICS] = {
+    "modbus_reads",
+    "modbus_errors",
+    "modbus_timeouts",
+    "modbus_exceptions",
+    "modbus_reconnects",
+    "modbus_overruns"
+};
+
+uint64_t in_modbus_stats_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct in_modbus_stats *stats_create(void)
+{
+    struct in_modbus_stats *stats;
+
+    stats = flb_calloc(1, sizeof(struct in_modbus_stats));
+    if (!stats) {
+        flb_errno();
+        return NULL;
+    }
+    stats->start_us = in_modbus_stats_time_us();
+
+    return stats;
+}
+
+/* Counters of the instance and of every slave, once the slaves are known */
+int in_modbus_stats_configure(struct flb_in_modbus_config *ctx,
+                              struct flb_input_instance *in)
+{
+    int i;
+    const char *str;
+    struct mk_list *head;
+    struct in_modbus_device *dev;
+
+    str = flb_input_get_property("stats", in);
+    if (str == NULL || !flb_utils_bool(str)) {
+        return 0;
+    }
+
+    /* Seconds between two records of per-slave counters, 0 for none */
+    ctx->stats_interval_ms = value_from_cfg(in, "stats_interval", 0) * 1000;
+    if (ctx->stats_interval_ms < 0) {
+        ctx->stats_interval_ms = 0;
+    }
+
+    ctx->stats = stats_create();
+    if (!ctx->stats) {
+        return -1;
+    }
+    ctx->stats->record_next_us = ctx->stats->start_us +
+                                 (uint64_t) ctx->stats_interval_ms * 1000;
+
+    mk_list_foreach(head, &ctx->devices) {
+        dev = mk_list_entry(head, struct in_modbus_device, _head);
+        dev->stats = stats_create();
+        if (!dev->stats) {
+            return -1;
+        }
+    }
+
+#ifdef FLB_HAVE_METRICS
+    for (i = 0; i < IN_MODBUS_STATS_METRICS; i++) {
+        flb_metrics_add(METRIC_ID_BASE + i, metric_names[i], in->metrics);
+    }
+#else
+    (void) i;
+#endif
+
+    return 0;
+}
+
+void in_modbus_stats_destroy(struct flb_in_modbus_config *ctx)
+{
+    struct mk_list *head;
+    struct in_modbus_device *dev;
+
+    if (!ctx->stats) {
+        return;
+    }
+
+    mk_list_foreach(head, &ctx->devices) {
+        dev = mk_list_entry(head, struct in_modbus_device, _head);
+        flb_free(dev->stats);
+        dev->stats = NULL;
+    }
+
+    flb_free(ctx->stats);
+    ctx->stats = NULL;
+}
+
+static int bucket(uint64_t us)
+{
+    int e;
+
+    if (us < 16) {
+        return us;
+    }
+
+    e = 63 - __builtin_clzll(us);
+    if (e >= 4 + 32) {
+        return IN_MODBUS_STATS_BUCKETS - 1;
+    }
+
+    return 16 + (e - 4) * SUB + ((us >> (e - 3)) & (SUB - 1));
+}
+
+/* Largest latency falling into bucket 'b' */
+static uint64_t bucket_max(int b)
+{
+    int e;
+    uint64_t low;
+
+    if (b < 16) {
+        return b;
+    }
+
+    e = (b - 16) / SUB + 4;
+    low = ((uint64_t) 1 << e) + ((uint64_t) ((b - 16) % SUB) << (e - 3));
+
+    return low + ((uint64_t) 1 << (e - 3)) - 1;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_get(uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Timeouts and exception responses are told apart by libmodbus errno */
+static void count_error(struct in_modbus_stats *stats, int err)
+{
+    if (err == ETIMEDOUT) {
+        stats_add(&stats->timeouts, 1);
+    }
+    else if (err > MODBUS_ENOBASE &&
+             err < MODBUS_ENOBASE + IN_MODBUS_STATS_EXCEPTIONS) {
+        stats_add(&stats->exceptions[err - MODBUS_ENOBASE], 1);
+    }
+
+    if (connection_error(err)) {
+        stats_add(&stats->reconnects, 1);
+    }
+}
+
+static void count_scan(struct in_modbus_stats *stats, uint64_t reads,
+                       uint64_t errors, uint64_t points,
+                       uint64_t latency_us, int overrun)
+{
+    stats_add(&stats->scans, 1);
+    stats_add(&stats->reads, reads);
+    stats_add(&stats->errors, errors);
+    stats_add(&stats->points, points);
+    stats_add(&stats->overruns, overrun);
+    stats_add(&stats->hist[bucket(latency_us)], 1);
+}
+
+/* Account for the scan of one slave that took 'latency_us' */
+void in_modbus_stats_device(struct flb_in_modbus_config *ctx,
+                            struct in_modbus_device *dev, uint64_t scan,
+                            uint64_t latency_us)
+{
+    int i;
+    int overrun;
+    uint64_t reads = 0;
+    uint64_t errors = 0;
+    uint64_t points = 0;
+    struct in_modbus_plan *plan;
+
+    for (i = 0; i < ctx->nplans; i++) {
+        plan = &ctx->plans[i];
+        if (!in_modbus_plan_due(plan, scan)) {
+            continue;
+        }
+
+        reads += plan->nreads;
+        if (dev->result[i] == -1) {
+            errors++;
+            count_error(ctx->stats, dev->errnum[i]);
+            count_error(dev->stats, dev->errnum[i]);
+        }
+        else {
+            points += dev->result[i];
+        }
+    }
+
+    overrun = latency_us > (uint64_t) ctx->tick_ms * 1000;
+    count_scan(ctx->stats, reads, errors, points, latency_us, overrun);
+    count_scan(dev->stats, reads, errors, points, latency_us, overrun);
+}
+
+/* A scan of the slave stopped on a connection error */
+void in_modbus_stats_error(struct flb_in_modbus_config *ctx,
+                           struct in_modbus_device *dev, int err)
+{
+    count_error(ctx->stats, err);
+    count_error(dev->stats, err);
+}
+
+/* Size of the record of a slave */
+void in_modbus_stats_bytes(struct flb_in_modbus_config *ctx,
+                           struct in_modbus_device *dev, size_t bytes)
+{
+    stats_add(&ctx->stats->bytes, bytes);
+    stats_add(&dev->stats->bytes, bytes);
+}
+
+/* Upper bound of the 'pct' percentile of the scan latencies, in us */
+uint64_t in_modbus_stats_percentile(struct in_modbus_stats *stats,
+                                    double pct)
+{
+    int i;
+    uint64_t rank;
+    uint64_t seen = 0;
+
+    rank = (uint64_t) (stats_get(&stats->scans) * pct / 100.0);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < IN_MODBUS_STATS_BUCKETS; i++) {
+        seen += stats_get(&stats->hist[i]);
+        if (seen >= rank) {
+            return bucket_max(i);
+        }
+    }
+
+    return bucket_max(IN_MODBUS_STATS_BUCKETS - 1);
+}
+
+static uint64_t exceptions_total(struct in_modbus_stats *stats)
+{
+    int i;
+    uint64_t n = 0;
+
+    for (i = 1; i < IN_MODBUS_STATS_EXCEPTIONS; i++) {
+        n += stats_get(&stats->exceptions[i]);
+    }
+
+    return n;
+}
+
+#ifdef FLB_HAVE_METRICS
+static uint64_t metric_value(struct in_modbus_stats *stats, int id)
+{
+    switch (id) {
+    case 0:
+        return stats_get(&stats->reads);
+    case 1:
+        return stats_get(&stats->errors);
+    case 2:
+        return stats_get(&stats->timeouts);
+    case 3:
+        return exceptions_total(stats);
+    case 4:
+        return stats_get(&stats->reconnects);
+    default:
+        return stats_get(&stats->overruns);
+    }
+}
+#endif
+
+static void pack_key(msgpack_packer *mp_pck, const char *key)
+{
+    msgpack_pack_str(mp_pck, strlen(key));
+    msgpack_pack_str_body(mp_pck, key, strlen(key));
+}
+
+static void pack_counter(msgpack_packer *mp_pck, const char *key,
+                         uint64_t *counter)
+{
+    pack_key(mp_pck, key);
+    msgpack_pack_uint64(mp_pck, stats_get(counter));
+}
+
+/*
+ * [time, {"address": a, "unit_id": u, "stats": {...}}], the counters of
+ * one slave since the start
+ */
+static void pack_stats(msgpack_packer *mp_pck, struct in_modbus_device *dev)
+{
+    int i;
+    int n;
+    int len;
+    char code[4];
+    struct in_modbus_stats *stats = dev->stats;
+
+    msgpack_pack_array(mp_pck, 2);
+    flb_pack_time_now(mp_pck);
+    msgpack_pack_map(mp_pck, 2 + (dev->unit_id >= 0));
+
+    pack_key(mp_pck, "address");
+    pack_key(mp_pck, dev->conn->address);
+
+    if (dev->unit_id >= 0) {
+        pack_key(mp_pck, "unit_id");
+        msgpack_pack_uint8(mp_pck, dev->unit_id);
+    }
+
+    pack_key(mp_pck, "stats");
+    msgpack_pack_map(mp_pck, 10);
+    pack_counter(mp_pck, "scans", &stats->scans);
+    pack_counter(mp_pck, "reads", &stats->reads);
+    pack_counter(mp_pck, "errors", &stats->errors);
+    pack_counter(mp_pck, "timeouts", &stats->timeouts);
+    pack_counter(mp_pck, "reconnects", &stats->reconnects);
+    pack_counter(mp_pck, "overruns", &stats->overruns);
+    pack_counter(mp_pck, "points", &stats->points);
+    pack_counter(mp_pck, "bytes", &stats->bytes);
+
+    /* Exception codes answered at least once */
+    n = 0;
+    for (i = 1; i < IN_MODBUS_STATS_EXCEPTIONS; i++) {
+        n += stats_get(&stats->exceptions[i]) > 0;
+    }
+    pack_key(mp_pck, "exceptions");
+    msgpack_pack_map(mp_pck, n);
+    for (i = 1; i < IN_MODBUS_STATS_EXCEPTIONS; i++) {
+        if (stats_get(&stats->exceptions[i]) > 0) {
+            len = snprintf(code, sizeof(code), "%d", i);
+            msgpack_pack_str(mp_pck, len);
+            msgpack_pack_str_body(mp_pck, code, len);
+            msgpack_pack_uint64(mp_pck, stats_get(&stats->exceptions[i]));
+        }
+    }
+
+    pack_key(mp_pck, "latency_us");
+    msgpack_pack_map(mp_pck, 3);
+    pack_key(mp_pck, "p50");
+    msgpack_pack_uint64(mp_pck, in_modbus_stats_percentile(stats, 50));
+    pack_key(mp_pck, "p99");
+    msgpack_pack_uint64(mp_pck, in_modbus_stats_percentile(stats, 99));
+    pack_key(mp_pck, "max");
+    msgpack_pack_uint64(mp_pck, in_modbus_stats_percentile(stats, 100));
+}
+
+/*
+ * Engine thread: add what was counted since the last call to the
+ * metrics, and every 'stats_interval' append one record per slave.
+ */
+void in_modbus_stats_collect(struct flb_in_modbus_config *ctx)
+{
+    int i;
+    uint64_t now;
+    uint64_t value;
+    msgpack_packer mp_pck;
+    msgpack_sbuffer mp_sbuf;
+    struct mk_list *head;
+    struct in_modbus_device *dev;
+    struct in_modbus_stats *stats = ctx->stats;
+
+#ifdef FLB_HAVE_METRICS
+    for (i = 0; i < IN_MODBUS_STATS_METRICS; i++) {
+        value = metric_value(stats, i);
+        if (value != stats->reported[i]) {
+            flb_metrics_sum(METRIC_ID_BASE + i, value - stats->reported[i],
+                            ctx->ins->metrics);
+            stats->reported[i] = value;
+        }
+    }
+#else
+    (void) i;
+    (void) value;
+#endif
+
+    if (ctx->stats_interval_ms == 0) {
+        return;
+    }
+    now = in_modbus_stats_time_us();
+    if (now < stats->record_next_us) {
+        return;
+    }
+    stats->record_next_us = now + (uint64_t) ctx->stats_interval_ms * 1000;
+
+    msgpack_sbuffer_init(&mp_sbuf);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    mk_list_foreach(head, &ctx->devices) {
+        dev = mk_list_entry(head, struct in_modbus_device, _head);
+        pack_stats(&mp_pck, dev);
+    }
+    flb_input_chunk_append_raw(ctx->ins, NULL, 0, mp_sbuf.data,
+                               mp_sbuf.size);
+    msgpack_sbuffer_destroy(&mp_sbuf);
+}
+
+/* Summary of the instance, logged when it stops */
+void in_modbus_stats_report(struct flb_in_modbus_config *ctx)
+{
+    double secs;
+    struct in_modbus_stats *stats = ctx->stats;
+
+    if (stats->scans == 0) {
+        return;
+    }
+
+    secs = (in_modbus_stats_time_us() - stats->start_us) / 1e6;
+    if (secs <= 0) {
+        secs = 1e-6;
+    }
+
+    flb_info("[in_modbus] %" PRIu64 " slave scans in %.1f s: %.1f reads/s, "
+             "%" PRIu64 " read errors (%" PRIu64 " timeouts, %" PRIu64
+             " exceptions), %" PRIu64 " reconnects, %" PRIu64 " overruns",
+             stats->scans, secs, stats->reads / secs, stats->errors,
+             stats->timeouts, exceptions_total(stats), stats->reconnects,
+             stats->overruns);
+    flb_info("[in_modbus] scan latency p50 %" PRIu64 " us, p99 %" PRIu64
+             " us, max %" PRIu64 " us",
+             in_modbus_stats_percentile(stats, 50),
+             in_modbus_stats_percentile(stats, 99),
+             in_modbus_stats_percentile(stats, 100));
+    flb_info("[in_modbus] %.2f bytes per point, %" PRIu64 " allocations "
+             "over %" PRIu64 " appends", stats->points ?
+             (double) stats->bytes / stats->points : 0.0,
+             ctx->allocs, ctx->appends);
+}
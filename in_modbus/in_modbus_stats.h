@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_STATS_H
+#define FLB_IN_MODBUS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Latency histogram in microseconds: exact below 16, then 8 buckets per
+ * power of two (12% wide at most) up to about 19 hours.
+ */
+#define IN_MODBUS_STATS_SUB     8
+#define IN_MODBUS_STATS_BUCKETS (16 + 32 * IN_MODBUS_STATS_SUB)
+
+/* Exception codes a slave can answer with, from 1 to 11 */
+#define IN_MODBUS_STATS_EXCEPTIONS 12
+
+/* Counters exported to the Fluent Bit metrics of the instance */
+#define IN_MODBUS_STATS_METRICS 6
+
+/*
+ * Counters of the scans of an instance or of one slave, kept since the
+ * start. Workers update them concurrently, so every field is written with
+ * atomic adds.
+ */
+struct in_modbus_stats {
+    uint64_t scans;         /* slaves scanned */
+    uint64_t reads;         /* requests sent */
+    uint64_t errors;        /* blocks that could not be read */
+    uint64_t timeouts;      /* responses that did not come in time */
+    uint64_t exceptions[IN_MODBUS_STATS_EXCEPTIONS];   /* by code */
+    uint64_t reconnects;    /* connections lost */
+    uint64_t overruns;      /* scans longer than the collector tick */
+    uint64_t points;        /* values read */
+    uint64_t bytes;         /* msgpack bytes appended to the engine */
+    uint64_t hist[IN_MODBUS_STATS_BUCKETS];
+
+    uint64_t start_us;      /* monotonic */
+
+    /* Instance only: values already added to the metrics, next record */
+    uint64_t reported[IN_MODBUS_STATS_METRICS];
+    uint64_t record_next_us;
+};
+
+struct flb_in_modbus_config;
+struct flb_input_instance;
+struct in_modbus_device;
+
+uint64_t in_modbus_stats_time_us(void);
+int in_modbus_stats_configure(struct flb_in_modbus_config *ctx,
+                              struct flb_input_instance *in);
+void in_modbus_stats_destroy(struct flb_in_modbus_config *ctx);
+void in_modbus_stats_device(struct flb_in_modbus_config *ctx,
+                            struct in_modbus_device *dev, uint64_t scan,
+                            uint64_t latency_us);
+void in_modbus_stats_error(struct flb_in_modbus_config *ctx,
+                           struct in_modbus_device *dev, int err);
+void in_modbus_stats_bytes(struct flb_in_modbus_config *ctx,
+                           struct in_modbus_device *dev, size_t bytes);
+uint64_t in_modbus_stats_percentile(struct in_modbus_stats *stats,
+                                    double pct);
+void in_modbus_stats_collect(struct flb_in_modbus_config *ctx);
+void in_modbus_stats_report(struct flb_in_modbus_config *ctx);
+
+#endif
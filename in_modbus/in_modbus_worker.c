@@ -0,0 +1,384 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_pipe.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <modbus.h>
+
+#include "in_modbus.h"
+#include "in_modbus_device.h"
+#include "in_modbus_worker.h"
+#include "in_modbus_sched.h"
+#include "in_modbus_stats.h"
+#include "in_modbus_clock.h"
+
+static int queue_push(struct in_modbus_queue *queue, char *data, size_t size)
+{
+    unsigned int head;
+    unsigned int tail;
+
+    tail = queue->tail;
+    head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head == IN_MODBUS_QUEUE_SIZE) {
+        return -1;
+    }
+
+    queue->items[tail & (IN_MODBUS_QUEUE_SIZE - 1)].data = data;
+    queue->items[tail & (IN_MODBUS_QUEUE_SIZE - 1)].size = size;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int queue_pop(struct in_modbus_queue *queue,
+                     struct in_modbus_queue_item *item)
+{
+    unsigned int head;
+    unsigned int tail;
+
+    head = queue->head;
+    tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return -1;
+    }
+
+    *item = queue->items[head & (IN_MODBUS_QUEUE_SIZE - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Sleep until 'ns' (CLOCK_MONOTONIC, so a step of the system time does
+ * not stall or rush the scans), -1 when the pool is stopped first.
+ */
+static int worker_wait(struct in_modbus_pool *pool, uint64_t ns)
+{
+    int stop;
+    struct timespec until;
+
+    until.tv_sec = ns / 1000000000ULL;
+    until.tv_nsec = ns % 1000000000ULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop &&
+           pthread_cond_timedwait(&pool->cond, &pool->lock,
+                                  &until) != ETIMEDOUT);
+    stop = pool->stop;
+    pthread_mutex_unlock(&pool->lock);
+
+    return stop ? -1 : 0;
+}
+
+/*
+ * Scan every slave of the worker and queue the records for the engine.
+ * With 'spread', the slaves are started evenly over the tick that began
+ * at 'start_ns' instead of back to back.
+ */
+static void worker_scan(struct in_modbus_worker *worker, uint64_t start_ns)
+{
+    int i;
+    int j;
+    int k = 0;
+    char c = 0;
+    size_t size;
+    uint64_t scan;
+    uint64_t tick_ns;
+    msgpack_packer mp_pck;
+    msgpack_sbuffer mp_sbuf;
+    struct in_modbus_pool *pool = worker->pool;
+    struct flb_in_modbus_config *ctx = pool->ctx;
+    struct in_modbus_conn *conn;
+    struct in_modbus_device *dev;
+
+    scan = worker->scan++;
+    if (!in_modbus_scan_due(ctx, scan)) {
+        return;
+    }
+
+    /*
+     * The buffer is handed over to the engine with the records, so each
+     * scan takes one allocation sized for all of them up front.
+     */
+    msgpack_sbuffer_init(&mp_sbuf);
+    if (in_modbus_sbuffer_reserve(&mp_sbuf, worker->pack_size) == -1) {
+        return;
+    }
+    __atomic_add_fetch(&ctx->allocs, 1, __ATOMIC_RELAXED);
+    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+
+    tick_ns = (uint64_t) ctx->tick_ms * 1000000ULL;
+    for (i = 0; i < worker->nconns; i++) {
+        conn = worker->conns[i];
+
+        /* Broken links are reopened in the background, skip them */
+        for (j = 0; j < conn->ndevs && modbus_conn_up(conn->link); j++) {
+            dev = conn->devs[j];
+            if (ctx->spread && k > 0 &&
+                worker_wait(pool, start_ns +
+                            tick_ns * k / worker->ndevs) == -1) {
+                break;
+            }
+            k++;
+
+            if (in_modbus_collect_device(ctx, dev, worker->buf, scan) == 0) {
+                size = mp_sbuf.size;
+                in_modbus_pack_device(ctx, dev, worker->buf, scan, &mp_pck);
+                if (ctx->stats) {
+                    in_modbus_stats_bytes(ctx, dev, mp_sbuf.size - size);
+                }
+            }
+        }
+    }
+
+    if (mp_sbuf.size == 0) {
+        msgpack_sbuffer_destroy(&mp_sbuf);
+        return;
+    }
+
+    if (queue_push(&worker->queue, mp_sbuf.data, mp_sbuf.size) == -1) {
+        /* The engine is not keeping up, drop this scan */
+        worker->dropped++;
+        msgpack_sbuffer_destroy(&mp_sbuf);
+        return;
+    }
+
+    /* A full pipe already has a wake up pending */
+    flb_pipe_w(pool->ch[1], &c, sizeof(c));
+}
+
+static void *worker_run(void *data)
+{
+    uint64_t now;
+    uint64_t next;
+    uint64_t start;
+    uint64_t missed;
+    uint64_t tick_ns;
+    struct in_modbus_worker *worker = data;
+    struct in_modbus_pool *pool = worker->pool;
+    struct flb_in_modbus_config *ctx = pool->ctx;
+
+    /* Spread the workers over the tick */
+    tick_ns = (uint64_t) ctx->tick_ms * 1000000ULL;
+    next = in_modbus_clock_ns() + tick_ns * worker->id / pool->nworkers;
+
+    /* Sleep until the next scan is due or the pool is stopped */
+    while (worker_wait(pool, next) == 0) {
+        start = next;
+        in_modbus_clock_sync(ctx);
+        worker_scan(worker, start);
+        next += tick_ns;
+
+        /* The scan ran over the next tick */
+        now = in_modbus_clock_ns();
+        if (now < next) {
+            continue;
+        }
+
+        missed = (now - next) / tick_ns + 1;
+        in_modbus_sched_overrun(ctx, (now - start) / 1000, missed);
+        if (ctx->overrun_policy == IN_MODBUS_OVERRUN_SKIP) {
+            next += missed * tick_ns;
+            worker->scan += missed;
+        }
+        else {
+            next = now + tick_ns;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Split the connections among the workers. Every slave of a connection
+ * stays with the same worker since a modbus_t cannot be shared between
+ * threads.
+ */
+int in_modbus_pool_create(struct flb_in_modbus_config *ctx)
+{
+    int i;
+    int nconns;
+    struct mk_list *head;
+    struct in_modbus_pool *pool;
+    struct in_modbus_worker *worker;
+    struct in_modbus_conn *conn;
+    pthread_condattr_t attr;
+
+    pool = flb_calloc(1, sizeof(struct in_modbus_pool));
+    if (!pool) {
+        flb_errno();
+        return -1;
+    }
+    pool->ctx = ctx;
+    pool->ch[0] = -1;
+    pool->ch[1] = -1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    ctx->pool = pool;
+
+    nconns = mk_list_size(&ctx->conns);
+    pool->nworkers = ctx->workers < nconns ? ctx->workers : nconns;
+    pool->workers = flb_calloc(pool->nworkers, sizeof(struct in_modbus_worker));
+    if (!pool->workers) {
+        flb_errno();
+        return -1;
+    }
+
+    for (i = 0; i < pool->nworkers; i++) {
+        worker = &pool->workers[i];
+        worker->id = i;
+        worker->pool = pool;
+        worker->conns = flb_calloc(nconns, sizeof(struct in_modbus_conn *));
+        worker->buf = flb_calloc(1, ctx->buf_size + 1);
+        if (!worker->conns || !worker->buf) {
+            flb_errno();
+            return -1;
+        }
+    }
+
+    i = 0;
+    mk_list_foreach(head, &ctx->conns) {
+        conn = mk_list_entry(head, struct in_modbus_conn, _head);
+        worker = &pool->workers[i++ % pool->nworkers];
+        worker->conns[worker->nconns++] = conn;
+        worker->ndevs += conn->ndevs;
+        worker->pack_size += conn->ndevs * in_modbus_pack_size(ctx);
+    }
+
+    if (flb_pipe_create(pool->ch) == -1) {
+        flb_errno();
+        return -1;
+    }
+    fcntl(pool->ch[0], F_SETFL, fcntl(pool->ch[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(pool->ch[1], F_SETFL, fcntl(pool->ch[1], F_GETFL, 0) | O_NONBLOCK);
+
+    return 0;
+}
+
+int in_modbus_pool_start(struct flb_in_modbus_config *ctx)
+{
+    int i;
+    struct in_modbus_pool *pool = ctx->pool;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_run,
+                           &pool->workers[i]) != 0) {
+            flb_error("[in_modbus] Cannot start polling thread %d", i);
+            return -1;
+        }
+        pool->started++;
+    }
+
+    flb_debug("[in_modbus] %d polling threads started", pool->nworkers);
+
+    return 0;
+}
+
+static void pool_drain(struct flb_in_modbus_config *ctx, int append)
+{
+    int i;
+    struct in_modbus_pool *pool = ctx->pool;
+    struct in_modbus_queue_item item;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        while (queue_pop(&pool->workers[i].queue, &item) == 0) {
+            if (append) {
+                flb_input_chunk_append_raw(ctx->ins, NULL, 0,
+                                           item.data, item.size);
+            }
+            flb_free(item.data);
+        }
+    }
+}
+
+/* Engine side: append whatever the workers queued */
+int in_modbus_pool_collect(struct flb_input_instance *i_ins,
+                           struct flb_config *config, void *in_context)
+{
+    char buf[64];
+    struct flb_in_modbus_config *ctx = in_context;
+
+    while (flb_pipe_r(ctx->pool->ch[0], buf, sizeof(buf)) > 0);
+
+    pool_drain(ctx, FLB_TRUE);
+
+    if (ctx->stats) {
+        in_modbus_stats_collect(ctx);
+    }
+
+    return 0;
+}
+
+void in_modbus_pool_destroy(struct flb_in_modbus_config *ctx)
+{
+    int i;
+    uint64_t dropped = 0;
+    struct in_modbus_pool *pool = ctx->pool;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    if (pool->workers) {
+        pool_drain(ctx, FLB_FALSE);
+        for (i = 0; i < pool->nworkers; i++) {
+            dropped += pool->workers[i].dropped;
+            flb_free(pool->workers[i].conns);
+            flb_free(pool->workers[i].buf);
+        }
+        flb_free(pool->workers);
+    }
+
+    if (dropped > 0) {
+        flb_warn("[in_modbus] %llu scans dropped, engine queue full",
+                 (unsigned long long) dropped);
+    }
+
+    if (pool->ch[0] != -1) {
+        flb_pipe_close(pool->ch[0]);
+        flb_pipe_close(pool->ch[1]);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    flb_free(pool);
+    ctx->pool = NULL;
+}
@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_IN_MODBUS_WORKER_H
+#define FLB_IN_MODBUS_WORKER_H
+
+#include <fluent-bit/flb_input.h>
+#include <fluent-bit/flb_pipe.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "in_modbus.h"
+
+/* Records a worker may have waiting for the engine, power of two */
+#define IN_MODBUS_QUEUE_SIZE 64
+
+struct in_modbus_queue_item {
+    char *data;
+    size_t size;
+};
+
+/*
+ * Lock-free single producer (worker) / single consumer (engine) ring of
+ * msgpack buffers. 'tail' is only written by the worker, 'head' only by
+ * the engine.
+ */
+struct in_modbus_queue {
+    unsigned int head;
+    unsigned int tail;
+    struct in_modbus_queue_item items[IN_MODBUS_QUEUE_SIZE];
+};
+
+struct in_modbus_pool;
+
+/* Polling thread, it owns its connections and everything behind them */
+struct in_modbus_worker {
+    int id;
+    pthread_t thread;
+    struct in_modbus_pool *pool;
+
+    struct in_modbus_conn **conns;
+    int nconns;
+    int ndevs;                  /* slaves behind the connections */
+
+    char *buf;                  /* values of the slave being scanned */
+    size_t pack_size;           /* usual size of the records of a scan */
+    uint64_t scan;              /* number of the next scan, in ticks */
+    uint64_t dropped;           /* scans lost because the queue was full */
+
+    struct in_modbus_queue queue;
+};
+
+struct in_modbus_pool {
+    struct flb_in_modbus_config *ctx;
+
+    int nworkers;
+    int started;
+    struct in_modbus_worker *workers;
+
+    /* Workers write a byte here when they queue a record */
+    flb_pipefd_t ch[2];
+
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+int in_modbus_pool_create(struct flb_in_modbus_config *ctx);
+int in_modbus_pool_start(struct flb_in_modbus_config *ctx);
+void in_modbus_pool_destroy(struct flb_in_modbus_config *ctx);
+int in_modbus_pool_collect(struct flb_input_instance *i_ins,
+                           struct flb_config *config, void *in_context);
+
+#endif
@@ -24,25 +24,19 @@
 #include <fluent-bit/flb_info.h>
 #include <fluent-bit/flb_output.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_utils.h>
 
 #include "out_modbus.h"
+#include "out_modbus_cursor.h"
+#include "out_modbus_target.h"
 
+/* Outcome of parsing a record of the chunk */
 enum {
-    TCP,
-    TCP_PI,
-    RTU
-};
-
-enum {
-    COILS = 0,
-    DISCRETE_INPUTS,
-    HOLDING_REGISTERS,
-    INPUT_REGISTERS
-};
-
-enum {
-    ADDRESS = 0,
-    VALUE
+    RECORD_OK = 0,
+    RECORD_UNROUTED = 1,
+    RECORD_NO_UNIT = 2,
+    RECORD_INVALID = -1,
+    RECORD_NOMEM = -2
 };
 
 char *type_str[4] = {
@@ -52,45 +46,43 @@ char *type_str[4] = {
     "input_registers"
 };
 
-char *key_str[2] = {
-    "address",
-    "value"
+/* Record keys, compared by length first */
+struct out_modbus_key {
+    const char *str;
+    uint32_t len;
 };
 
-int key_compare(char *key, const char *str, int size)
-{
-    if (strlen(key) == size) {
-        if (strncmp(key, str, size) == 0) {
-            return 0;
-        }
-    }
-
-    return -1;
-}
+#define OUT_MODBUS_KEY(s) { s, sizeof(s) - 1 }
 
-bool connection_error(int error)
-{
-    return error == EBADF ||
-           error == ECONNRESET ||
-           error == EPIPE ||
-           error == ECONNREFUSED ||
-           error == ETIMEDOUT ||
-           error == ENOPROTOOPT ||
-           error == EINPROGRESS;
-}
+static const struct out_modbus_key type_key[4] = {
+    OUT_MODBUS_KEY("coils"),
+    OUT_MODBUS_KEY("discrete_inputs"),
+    OUT_MODBUS_KEY("holding_registers"),
+    OUT_MODBUS_KEY("input_registers")
+};
 
-int out_modbus_connect(struct flb_out_modbus_config *ctx)
+static const struct out_modbus_key address_key = OUT_MODBUS_KEY("address");
+static const struct out_modbus_key value_key = OUT_MODBUS_KEY("value");
+static const struct out_modbus_key unit_id_key = OUT_MODBUS_KEY("unit_id");
+static const struct out_modbus_key target_key = OUT_MODBUS_KEY("target");
+
+static const struct out_modbus_key mask_write_key =
+    OUT_MODBUS_KEY("mask_write_registers");
+static const struct out_modbus_key write_read_key =
+    OUT_MODBUS_KEY("write_read_registers");
+static const struct out_modbus_key and_mask_key = OUT_MODBUS_KEY("and_mask");
+static const struct out_modbus_key or_mask_key = OUT_MODBUS_KEY("or_mask");
+static const struct out_modbus_key values_key = OUT_MODBUS_KEY("values");
+static const struct out_modbus_key read_address_key =
+    OUT_MODBUS_KEY("read_address");
+static const struct out_modbus_key read_count_key =
+    OUT_MODBUS_KEY("read_count");
+
+static inline int key_match(const struct out_modbus_key *key,
+                            const struct out_modbus_obj *obj)
 {
-    errno = 0;
-    if (modbus_connect(ctx->modbus_ctx) == -1) {
-        ctx->err = errno;
-        flb_error("Connection to Modbus slave failed: %s\n",
-                  modbus_strerror(errno));
-        return -1;
-    }
-
-    ctx->err = 0;
-    return 0;
+    return obj->type == CURSOR_STR && obj->size == key->len &&
+           memcmp(obj->ptr, key->str, key->len) == 0;
 }
 
 static int configure(struct flb_out_modbus_config *ctx,
@@ -100,13 +92,12 @@ static int configure(struct flb_out_modbus_config *ctx,
     const char *addr;
     const char *port;
     const char *rate;
-    const char *tid;
+    const char *targets;
     int use_backend;
-    modbus_t *modbus_ctx;
+    int parity;
+    struct modbus_conn_params params;
 
-    modbus_ctx = NULL;
-
-    ctx->err = 0;
+    mk_list_init(&ctx->retries);
 
     /* Initializing Modbus connection */
     str = flb_output_get_property("backend", in);
@@ -134,62 +125,118 @@ static int configure(struct flb_out_modbus_config *ctx,
     addr = flb_output_get_property("address", in);
     port = flb_output_get_property("tcp_port", in);
     rate = flb_output_get_property("rate", in);
+    targets = flb_output_get_property("targets", in);
+
+    memset(&params, 0, sizeof(params));
+    params.backend = use_backend;
+    params.address = addr;
 
     switch (use_backend) {
     case TCP:
-        if (addr == NULL) {
-            flb_error("[out_modbus] Slave (tcp) address %s unknown");
+        if (addr == NULL && targets == NULL) {
+            flb_error("[out_modbus] Slave (tcp) address unknown");
             return -1;
         }
         if (port == NULL) {
             port = "502";
         }
-        modbus_ctx = modbus_new_tcp(addr, atoi(port));
+        params.port = atoi(port);
         break;
     case TCP_PI:
-        if (addr == NULL) {
-            flb_error("[out_modbus] Slave (tcppi) address %s unknown");
+        if (addr == NULL && targets == NULL) {
+            flb_error("[out_modbus] Slave (tcppi) address unknown");
             return -1;
         }
         if (port == NULL) {
             port = "502";
         }
-        modbus_ctx = modbus_new_tcp_pi(addr, port);
+        params.port = atoi(port);
         break;
     default:
-        if (addr == NULL) {
-            flb_error("[out_modbus] Slave (rtu) device %s unknown");
+        if (addr == NULL && targets == NULL) {
+            flb_error("[out_modbus] Slave (rtu) device unknown");
             return -1;
         }
         if (rate == NULL) {
-            flb_error("[out_modbus] Connection rate %s unknown");
+            flb_error("[out_modbus] Connection rate unknown");
+            return -1;
+        }
+        params.rate = atoi(rate);
+        if (params.rate <= 0) {
+            flb_error("[out_modbus] Invalid connection rate %s", rate);
             return -1;
         }
-        modbus_ctx = modbus_new_rtu(addr, atoi(rate), 'N', 8, 1);
         break;
     }
 
-    if (modbus_ctx == NULL) {
-        flb_error("[out_modbus] Unable to allocate modbus context");
+    /* Serial framing, 8N1 by default */
+    str = flb_output_get_property("parity", in);
+    parity = modbus_conn_parity(str);
+    if (parity == -1) {
+        flb_error("[out_modbus] Parity %s unknown: has to be "
+                  "[none|even|odd]", str);
+        return -1;
+    }
+    params.parity = parity;
+    str = flb_output_get_property("data_bits", in);
+    params.data_bits = str ? atoi(str) : 8;
+    if (params.data_bits < 5 || params.data_bits > 8) {
+        flb_error("[out_modbus] data_bits has to be between 5 and 8");
+        return -1;
+    }
+    str = flb_output_get_property("stop_bits", in);
+    params.stop_bits = str ? atoi(str) : 1;
+    if (params.stop_bits != 1 && params.stop_bits != 2) {
+        flb_error("[out_modbus] stop_bits has to be 1 or 2");
         return -1;
     }
 
-    //modbus_set_debug(modbus_ctx, TRUE);
-    modbus_set_error_recovery(modbus_ctx,
-                              MODBUS_ERROR_RECOVERY_PROTOCOL);
-
-    ctx->modbus_ctx = modbus_ctx;
+    /* Response timeouts in milliseconds, 0 keeps the libmodbus ones */
+    str = flb_output_get_property("response_timeout", in);
+    params.response_timeout_ms = str ? atoi(str) : 0;
+    str = flb_output_get_property("byte_timeout", in);
+    params.byte_timeout_ms = str ? atoi(str) : 0;
+
+    /* Reconnection backoff, doubling from min to max */
+    str = flb_output_get_property("reconnect_min_ms", in);
+    params.backoff_min_ms = str ? atoi(str) : 1000;
+    str = flb_output_get_property("reconnect_max_ms", in);
+    params.backoff_max_ms = str ? atoi(str) : 60000;
+    if (params.backoff_min_ms < 1 ||
+        params.backoff_max_ms < params.backoff_min_ms) {
+        flb_error("[out_modbus] reconnect_min_ms has to be positive and not "
+                  "above reconnect_max_ms");
+        return -1;
+    }
 
-    if (out_modbus_connect(ctx) == -1) {
+    /* Slave of the records without "unit_id" */
+    str = flb_output_get_property("unit_id", in);
+    ctx->unit_id = str ? atoi(str) : -1;
+    if (ctx->unit_id < -1 || ctx->unit_id > 255) {
+        flb_error("[out_modbus] Invalid unit_id %s", str);
         return -1;
     }
+    ctx->backend = use_backend;
 
-    return 0;
+    /* Collapse the writes of a chunk to the last value of each point */
+    str = flb_output_get_property("dedup", in);
+    ctx->dedup = str != NULL && flb_utils_bool(str);
+
+    /* Skip writes of values the slaves already hold */
+    str = flb_output_get_property("shadow", in);
+    ctx->shadow = str != NULL && flb_utils_bool(str);
+
+    /* Seconds between two read-backs of the known values, 0 never */
+    str = flb_output_get_property("shadow_readback", in);
+    ctx->shadow_readback_ms = str ? atoi(str) * 1000 : 0;
+
+    /* The instance address and the 'targets' list */
+    return out_modbus_targets_configure(ctx, in, &params);
 }
 
 static void config_destroy(struct flb_out_modbus_config *ctx)
 {
-    modbus_free(ctx->modbus_ctx);
+    out_modbus_targets_destroy(ctx);
     flb_free(ctx);
 }
 
@@ -200,7 +247,7 @@ static int out_modbus_init(struct flb_output_instance *in,
 
     struct flb_out_modbus_config *ctx = NULL;
 
-    ctx = flb_malloc(sizeof(struct flb_out_modbus_config));
+    ctx = flb_calloc(1, sizeof(struct flb_out_modbus_config));
     if (ctx == NULL) {
         return -1;
     }
@@ -217,132 +264,400 @@ static int out_modbus_init(struct flb_output_instance *in,
     return 0;
 }
 
-static void out_modbus_flush(const void *data, size_t bytes,
-                             const char *tag, int tag_len,
-                             struct flb_input_instance *i_ins,
-                             void *out_context,
-                             struct flb_config *config)
+/*
+ * Register value of a record: unsigned, or signed for a register holding a
+ * two's complement int16. Returns -1 outside of 16 bits.
+ */
+static int register_value(const struct out_modbus_obj *val, uint16_t *value)
 {
-    int i;
-    int idata;
-    int ikey;
-    int rc;
-    int *addr = NULL;
-    uint16_t *value = NULL;
-    int map_size;
-    int data_size;
-    size_t off = 0;
-    msgpack_object root;
-    msgpack_object map;
-    msgpack_object key;
-    msgpack_object val;
-    /* data per */
-    msgpack_object data_map;
-    msgpack_object data_key;
-    msgpack_object data_val;
-    msgpack_unpacked result;
-    struct flb_out_modbus_config *ctx = out_context;
-
-    /* If last call received connection error, try to reconnect */
-    if (connection_error(ctx->err)) {
-        modbus_close(ctx->modbus_ctx);
-        if (out_modbus_connect(ctx) == -1) {
-            FLB_OUTPUT_RETURN(FLB_RETRY);
-            return;
-        }
-    }
-
-    msgpack_unpacked_init(&result);
-    while (msgpack_unpack_next(&result, data, bytes, &off) == MSGPACK_UNPACK_SUCCESS) {
-        root = result.data;
-
-        /* get the map data and it size (number of items) */
-        map   = root.via.array.ptr[1];
-        map_size = map.via.map.size;
-
-        for (i = 0; i < map_size; i++) {
-            key = map.via.map.ptr[i].key;
-            val = map.via.map.ptr[i].val;
-
-            /* [{index: i, value: v}, ...] */
-            if (val.type != MSGPACK_OBJECT_ARRAY) {
-                continue;
+    if (val->type == CURSOR_UINT && val->u64 <= 0xffff) {
+        *value = val->u64;
+        return 0;
+    }
+    if (val->type == CURSOR_INT && val->i64 >= INT16_MIN &&
+        val->i64 <= 0xffff) {
+        *value = (uint16_t) val->i64;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Collect the writes of one element, {"address": a, "value": v}. Other
+ * keys are ignored and an element missing either key writes nothing.
+ */
+static int parse_write(struct out_modbus_cursor *cur, uint32_t size,
+                       int unit_id, int type, struct out_modbus_batch *batch)
+{
+    uint32_t i;
+    int addr = -1;
+    int has_value = FLB_FALSE;
+    uint16_t value = 0;
+    struct out_modbus_obj key;
+    struct out_modbus_obj val;
+
+    for (i = 0; i < size; i++) {
+        if (out_modbus_cursor_value(cur, &key) == -1 ||
+            out_modbus_cursor_value(cur, &val) == -1) {
+            return RECORD_INVALID;
+        }
+
+        if (key_match(&address_key, &key)) {
+            /* Outside the 16-bit address space, the element is ignored */
+            if (val.type == CURSOR_UINT && val.u64 <= 0xffff) {
+                addr = val.u64;
+            }
+        }
+        else if (key_match(&value_key, &key)) {
+            /* Beyond 16 bits, the element is ignored */
+            if (register_value(&val, &value) == 0) {
+                has_value = FLB_TRUE;
+            }
+            else if (val.type == CURSOR_BOOL) {
+                value = val.boolean;
+                has_value = FLB_TRUE;
             }
+        }
+    }
 
-            data = val.via.array.ptr;
-            data_size = val.via.map.size;
+    if (addr == -1 || !has_value || type == -1) {
+        return RECORD_OK;
+    }
+    if (out_modbus_batch_add(batch, unit_id, type, addr, value) == -1) {
+        return RECORD_NOMEM;
+    }
 
-            for (ikey = 0; ikey < val.via.array.size; ikey++) {
-                /* {index: ind, value: val} */
-                data_map = val.via.array.ptr[ikey];
+    return RECORD_OK;
+}
 
-                if (data_map.type != MSGPACK_OBJECT_MAP) {
-                    break;
-                }
+/*
+ * Collect one command element:
+ *   mask_write_registers: {"address": a, "and_mask": m, "or_mask": o}
+ *   write_read_registers: {"address": a, "values": [v, ...],
+ *                          "read_address": r, "read_count": n}
+ * The masks default to leaving the register unchanged, the read to the
+ * written registers. Elements that are incomplete, out of the protocol
+ * limits or of the address space, or with a value beyond 16 bits are
+ * ignored.
+ */
+static int parse_command(struct out_modbus_cursor *cur, uint32_t size,
+                         int unit_id, int fc, struct out_modbus_batch *batch)
+{
+    int ret;
+    int num = 0;
+    int addr = -1;
+    int read_addr = -1;
+    int read_num = -1;
+    int and_mask = 0xffff;
+    int or_mask = 0;
+    uint32_t i;
+    uint32_t j;
+    uint16_t values[MODBUS_MAX_WR_WRITE_REGISTERS];
+    struct out_modbus_obj key;
+    struct out_modbus_obj val;
+    struct out_modbus_obj elem;
+
+    for (i = 0; i < size; i++) {
+        if (out_modbus_cursor_value(cur, &key) == -1 ||
+            out_modbus_cursor_next(cur, &val) == -1) {
+            return RECORD_INVALID;
+        }
 
-                data_size = data_map.via.map.size;
-
-                for (idata = 0; idata < data_size; idata++) {
-                    data_key = data_map.via.map.ptr[idata].key;
-                    data_val = data_map.via.map.ptr[idata].val;
-
-                    if (key_compare(key_str[ADDRESS], data_key.via.str.ptr,
-                                    data_key.via.str.size) == 0) {
-                        if (data_val.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
-                            addr = flb_malloc(sizeof(int));
-                            *addr = data_val.via.i64;
-                            continue;
-                        }
-                    }
-
-                    if (key_compare(key_str[VALUE], data_key.via.str.ptr,
-                                    data_key.via.str.size) == 0) {
-                        if (data_val.type == MSGPACK_OBJECT_POSITIVE_INTEGER ||
-                            data_val.type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
-                            value = flb_malloc(sizeof(uint16_t));
-                            *value = data_val.via.i64;
-                            continue;
-                        }
-                        else if (data_val.type == MSGPACK_OBJECT_BOOLEAN) {
-                            value = flb_malloc(sizeof(uint16_t));
-                            *value = (uint16_t) data_val.via.boolean;
-                            continue;
-                        }
-                    }
+        if (key_match(&values_key, &key) && val.type == CURSOR_ARRAY) {
+            num = val.size <= MODBUS_MAX_WR_WRITE_REGISTERS ? 0 : -1;
+            for (j = 0; j < val.size; j++) {
+                if (out_modbus_cursor_value(cur, &elem) == -1) {
+                    return RECORD_INVALID;
                 }
-
-                if (addr != NULL && value != NULL) {
-                    /* Coils */
-                    if (key_compare(type_str[COILS], key.via.str.ptr,
-                                    key.via.str.size) == 0) {
-                        rc = modbus_write_bit(ctx->modbus_ctx, *addr, (bool) *value);
-                        if (rc != 1) {
-                            flb_error("Error writing to coil at address = %d, value = %d: %s\n",
-                                      addr, value, modbus_strerror(errno));
-                        }
-                    }
-                    else if (key_compare(type_str[HOLDING_REGISTERS], key.via.str.ptr,
-                                         key.via.str.size) == 0) {
-                        rc = modbus_write_register(ctx->modbus_ctx, *addr, *value);
-                        if (rc != 1) {
-                            flb_error("Error writing to register at address = %d, value = %d: %s\n",
-                                      addr, value, modbus_strerror(errno));
-                        }
-                    }
+                if (num == -1) {
+                    continue;
                 }
-
-                if (addr) {
-                    flb_free(addr);
+                if (register_value(&elem, &values[num]) == -1) {
+                    num = -1;
+                    continue;
                 }
-                if (value) {
-                    flb_free(value);
+                num++;
+            }
+            continue;
+        }
+
+        if (out_modbus_cursor_skip_content(cur, &val) == -1) {
+            return RECORD_INVALID;
+        }
+        if (val.type != CURSOR_UINT || val.u64 > 0xffff) {
+            continue;
+        }
+
+        if (key_match(&address_key, &key)) {
+            addr = val.u64;
+        }
+        else if (key_match(&and_mask_key, &key)) {
+            and_mask = val.u64;
+        }
+        else if (key_match(&or_mask_key, &key)) {
+            or_mask = val.u64;
+        }
+        else if (key_match(&read_address_key, &key)) {
+            read_addr = val.u64;
+        }
+        else if (key_match(&read_count_key, &key)) {
+            read_num = val.u64;
+        }
+    }
+
+    if (addr == -1) {
+        return RECORD_OK;
+    }
+
+    if (fc == OUT_MODBUS_MASK_WRITE) {
+        ret = out_modbus_batch_add_mask(batch, unit_id, addr, and_mask,
+                                        or_mask);
+    }
+    else {
+        if (read_addr == -1) {
+            read_addr = addr;
+        }
+        if (read_num == -1) {
+            read_num = num;
+        }
+        if (num <= 0 || addr + num > 0x10000 || read_num < 1 ||
+            read_num > MODBUS_MAX_WR_READ_REGISTERS ||
+            read_addr + read_num > 0x10000) {
+            return RECORD_OK;
+        }
+        ret = out_modbus_batch_add_write_read(batch, unit_id, addr, values,
+                                              num, read_addr, read_num);
+    }
+
+    return ret == -1 ? RECORD_NOMEM : RECORD_OK;
+}
+
+/*
+ * Collect the writes of one record, [time, {type: [element, ...], ...}],
+ * reading the chunk in place. Only coils and holding registers are
+ * written, along with mask_write_registers (FC22) and write_read_registers
+ * (FC23) commands; an array stops at its first element that is not a map. A
+ * "unit_id" key addresses the writes of the record to that slave, instead
+ * of the 'unit_id' of the instance, and a "target" key sends them to that
+ * entry of 'targets'. A serial line has no default slave: a record
+ * addressed to none is dropped.
+ */
+static int parse_record(struct out_modbus_cursor *cur,
+                        struct flb_out_modbus_config *ctx)
+{
+    int i;
+    int ret;
+    int type;
+    int fc;
+    int unit_id = ctx->unit_id;
+    int name_len = 0;
+    const char *name = NULL;
+    uint32_t j;
+    uint32_t k;
+    struct out_modbus_cursor start;
+    struct out_modbus_cursor end;
+    struct out_modbus_target *target;
+    struct out_modbus_obj root;
+    struct out_modbus_obj map;
+    struct out_modbus_obj key;
+    struct out_modbus_obj val;
+    struct out_modbus_obj elem;
+
+    if (out_modbus_cursor_next(cur, &root) == -1) {
+        return RECORD_INVALID;
+    }
+    if (root.type != CURSOR_ARRAY || root.size < 2) {
+        return out_modbus_cursor_skip_content(cur, &root);
+    }
+
+    /* Timestamp */
+    if (out_modbus_cursor_skip(cur, 1) == -1 ||
+        out_modbus_cursor_next(cur, &map) == -1) {
+        return RECORD_INVALID;
+    }
+    if (map.type != CURSOR_MAP) {
+        if (out_modbus_cursor_skip_content(cur, &map) == -1) {
+            return RECORD_INVALID;
+        }
+        return out_modbus_cursor_skip(cur, root.size - 2);
+    }
+
+    /*
+     * Routing keys first, which also checks the whole record is there:
+     * a truncated record adds no write.
+     */
+    start = *cur;
+    for (j = 0; j < map.size; j++) {
+        if (out_modbus_cursor_value(cur, &key) == -1 ||
+            out_modbus_cursor_value(cur, &val) == -1) {
+            return RECORD_INVALID;
+        }
+
+        if (key_match(&unit_id_key, &key) && val.type == CURSOR_UINT &&
+            val.u64 <= 255) {
+            unit_id = val.u64;
+        }
+        else if (key_match(&target_key, &key) && val.type == CURSOR_STR) {
+            name = val.ptr;
+            name_len = val.size;
+        }
+    }
+
+    /* Anything after the map */
+    if (out_modbus_cursor_skip(cur, root.size - 2) == -1) {
+        return RECORD_INVALID;
+    }
+
+    target = out_modbus_target_find(ctx, name, name_len);
+    if (!target) {
+        return RECORD_UNROUTED;
+    }
+    if (unit_id == -1 && ctx->backend == RTU) {
+        return RECORD_NO_UNIT;
+    }
+
+    end = *cur;
+    *cur = start;
+    for (j = 0; j < map.size; j++) {
+        if (out_modbus_cursor_value(cur, &key) == -1 ||
+            out_modbus_cursor_next(cur, &val) == -1) {
+            return RECORD_INVALID;
+        }
+
+        /* [{address: a, value: v}, ...] */
+        if (val.type != CURSOR_ARRAY) {
+            if (out_modbus_cursor_skip_content(cur, &val) == -1) {
+                return RECORD_INVALID;
+            }
+            continue;
+        }
+
+        type = -1;
+        for (i = 0; i < 4; i++) {
+            if ((i == COILS || i == HOLDING_REGISTERS) &&
+                key_match(&type_key[i], &key)) {
+                type = i;
+                break;
+            }
+        }
+
+        fc = -1;
+        if (key_match(&mask_write_key, &key)) {
+            fc = OUT_MODBUS_MASK_WRITE;
+        }
+        else if (key_match(&write_read_key, &key)) {
+            fc = OUT_MODBUS_WRITE_READ;
+        }
+
+        for (k = 0; k < val.size; k++) {
+            if (out_modbus_cursor_next(cur, &elem) == -1) {
+                return RECORD_INVALID;
+            }
+            if (elem.type != CURSOR_MAP) {
+                if (out_modbus_cursor_skip_content(cur, &elem) == -1 ||
+                    out_modbus_cursor_skip(cur, val.size - k - 1) == -1) {
+                    return RECORD_INVALID;
                 }
+                break;
+            }
+
+            if (fc != -1) {
+                ret = parse_command(cur, elem.size, unit_id, fc,
+                                    &target->batch);
+            }
+            else {
+                ret = parse_write(cur, elem.size, unit_id, type,
+                                  &target->batch);
+            }
+            if (ret != RECORD_OK) {
+                return ret;
             }
         }
     }
-    msgpack_unpacked_destroy(&result);
+    *cur = end;
+
+    return RECORD_OK;
+}
+
+/*
+ * Decode a chunk and write it to the targets: FLB_OK, FLB_RETRY or
+ * FLB_ERROR. Kept apart from the flush callback so the benchmark can call
+ * it outside of the engine.
+ */
+int out_modbus_flush_chunk(struct flb_out_modbus_config *ctx,
+                           const void *data, size_t bytes)
+{
+    int i;
+    int ret;
+    int unrouted = 0;
+    int no_unit = 0;
+    struct out_modbus_cursor cur;
+
+    /* Every link is being reopened in the background, retry later */
+    if (!out_modbus_targets_up(ctx)) {
+        return FLB_RETRY;
+    }
+
+    /*
+     * The batches are kept from one chunk to the next. A single target is
+     * sized for the largest number of writes the chunk can hold, so
+     * decoding makes no allocation once it has grown to the usual chunk
+     * size; with several targets each batch grows as needed.
+     */
+    for (i = 0; i < ctx->ntargets; i++) {
+        out_modbus_batch_reset(&ctx->targets[i].batch);
+    }
+    if (ctx->ntargets == 1 &&
+        out_modbus_batch_reserve(&ctx->targets[0].batch,
+                                 bytes / OUT_MODBUS_MIN_WRITE_SIZE) == -1) {
+        return FLB_RETRY;
+    }
+
+    out_modbus_cursor_init(&cur, data, bytes);
+    while (!out_modbus_cursor_done(&cur)) {
+        ret = parse_record(&cur, ctx);
+        if (ret == RECORD_NOMEM) {
+            return FLB_RETRY;
+        }
+        if (ret == RECORD_UNROUTED) {
+            unrouted++;
+        }
+        if (ret == RECORD_NO_UNIT) {
+            no_unit++;
+        }
+        if (ret == RECORD_INVALID) {
+            flb_error("[out_modbus] Invalid record at offset %zu of %zu, "
+                      "ignoring the rest of the chunk",
+                      (size_t) (cur.p - (const unsigned char *) data), bytes);
+            break;
+        }
+    }
+
+    if (unrouted > 0) {
+        flb_warn("[out_modbus] %d records without a known target dropped",
+                 unrouted);
+    }
+    if (no_unit > 0) {
+        flb_warn("[out_modbus] %d records without a unit_id dropped: the rtu "
+                 "backend needs one, in the record or the instance", no_unit);
+    }
+
+    /* Each target is written on its own thread */
+    return out_modbus_targets_flush(ctx, data, bytes);
+}
+
+static void out_modbus_flush(const void *data, size_t bytes,
+                             const char *tag, int tag_len,
+                             struct flb_input_instance *i_ins,
+                             void *out_context,
+                             struct flb_config *config)
+{
+    int ret;
+
+    ret = out_modbus_flush_chunk(out_context, data, bytes);
 
-    FLB_OUTPUT_RETURN(FLB_OK);
+    FLB_OUTPUT_RETURN(ret);
 }
 
 static int out_modbus_exit(void *data, struct flb_config *config)
@@ -26,9 +26,42 @@
 
 #include <modbus.h>
 
+#include "modbus_conn.h"
+#include "out_modbus_batch.h"
+#include "out_modbus_target.h"
+
+enum {
+    COILS = 0,
+    DISCRETE_INPUTS,
+    HOLDING_REGISTERS,
+    INPUT_REGISTERS
+};
+
+extern char *type_str[4];
+
 struct flb_out_modbus_config {
-    modbus_t *modbus_ctx;
-    int err;
+    /* Slaves and gateways, each with its own connection and writes */
+    struct out_modbus_target *targets;
+    int ntargets;
+    int def_target;             /* records without "target", -1 for none */
+
+    /* Chunks being retried, oldest first */
+    struct mk_list retries;
+    int nretries;
+
+    /* Slave of the records without "unit_id", -1 for the default one */
+    int backend;
+    int unit_id;
+
+    /* Collapse the writes of a chunk to the last value of each point */
+    int dedup;
+
+    /* Known values of the slaves, writes they already hold are skipped */
+    int shadow;
+    int shadow_readback_ms;
 };
 
+int out_modbus_flush_chunk(struct flb_out_modbus_config *ctx,
+                           const void *data, size_t bytes);
+
 #endif
@@ -0,0 +1,537 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_output.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <modbus.h>
+
+#include "out_modbus.h"
+#include "out_modbus_batch.h"
+#include "out_modbus_shadow.h"
+
+#define BATCH_INITIAL_SIZE 64
+
+void out_modbus_batch_init(struct out_modbus_batch *batch)
+{
+    batch->writes = NULL;
+    batch->size = 0;
+    batch->alloc = 0;
+    batch->commands = NULL;
+    batch->ncommands = 0;
+    batch->commands_alloc = 0;
+    batch->values = NULL;
+    batch->nvalues = 0;
+    batch->values_alloc = 0;
+    batch->keys = NULL;
+    batch->slots = NULL;
+    batch->nslots = 0;
+    batch->shadow = NULL;
+    batch->held = 0;
+    batch->runs = 0;
+    batch->failed_runs = 0;
+    batch->err = 0;
+}
+
+void out_modbus_batch_destroy(struct out_modbus_batch *batch)
+{
+    flb_free(batch->writes);
+    flb_free(batch->commands);
+    flb_free(batch->values);
+    flb_free(batch->keys);
+    flb_free(batch->slots);
+    out_modbus_batch_init(batch);
+}
+
+void out_modbus_batch_reset(struct out_modbus_batch *batch)
+{
+    batch->size = 0;
+    batch->ncommands = 0;
+    batch->nvalues = 0;
+    batch->held = 0;
+    batch->runs = 0;
+    batch->failed_runs = 0;
+    batch->err = 0;
+}
+
+/* Make room for 'size' writes, the array is kept across chunks */
+int out_modbus_batch_reserve(struct out_modbus_batch *batch, int size)
+{
+    struct out_modbus_write *tmp;
+
+    if (size <= batch->alloc) {
+        return 0;
+    }
+    if (size < BATCH_INITIAL_SIZE) {
+        size = BATCH_INITIAL_SIZE;
+    }
+
+    tmp = flb_realloc(batch->writes, size * sizeof(struct out_modbus_write));
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    batch->writes = tmp;
+    batch->alloc = size;
+
+    return 0;
+}
+
+int out_modbus_batch_add(struct out_modbus_batch *batch, int unit_id,
+                         int type, int addr, uint16_t value)
+{
+    if (batch->size == batch->alloc &&
+        out_modbus_batch_reserve(batch, batch->alloc ?
+                                 batch->alloc * 2 : BATCH_INITIAL_SIZE) == -1) {
+        return -1;
+    }
+
+    batch->writes[batch->size].unit_id = unit_id;
+    batch->writes[batch->size].type = type;
+    batch->writes[batch->size].addr = addr;
+    batch->writes[batch->size].value = value;
+    batch->writes[batch->size].seq = batch->size;
+    batch->writes[batch->size].segment = batch->ncommands;
+    batch->size++;
+
+    return 0;
+}
+
+/* Room for one more command and 'num' more values */
+static int command_reserve(struct out_modbus_batch *batch, int num)
+{
+    int size;
+    void *tmp;
+
+    if (batch->ncommands == batch->commands_alloc) {
+        size = batch->commands_alloc ? batch->commands_alloc * 2 :
+                                       BATCH_INITIAL_SIZE;
+        tmp = flb_realloc(batch->commands,
+                          size * sizeof(struct out_modbus_command));
+        if (!tmp) {
+            flb_errno();
+            return -1;
+        }
+        batch->commands = tmp;
+        batch->commands_alloc = size;
+    }
+
+    if (batch->nvalues + num > batch->values_alloc) {
+        size = batch->values_alloc ? batch->values_alloc : BATCH_INITIAL_SIZE;
+        while (size < batch->nvalues + num) {
+            size *= 2;
+        }
+        tmp = flb_realloc(batch->values, size * sizeof(uint16_t));
+        if (!tmp) {
+            flb_errno();
+            return -1;
+        }
+        batch->values = tmp;
+        batch->values_alloc = size;
+    }
+
+    return 0;
+}
+
+int out_modbus_batch_add_mask(struct out_modbus_batch *batch, int unit_id,
+                              int addr, uint16_t and_mask, uint16_t or_mask)
+{
+    struct out_modbus_command *cmd;
+
+    if (command_reserve(batch, 0) == -1) {
+        return -1;
+    }
+
+    cmd = &batch->commands[batch->ncommands++];
+    memset(cmd, 0, sizeof(struct out_modbus_command));
+    cmd->unit_id = unit_id;
+    cmd->fc = OUT_MODBUS_MASK_WRITE;
+    cmd->addr = addr;
+    cmd->and_mask = and_mask;
+    cmd->or_mask = or_mask;
+
+    return 0;
+}
+
+int out_modbus_batch_add_write_read(struct out_modbus_batch *batch,
+                                    int unit_id, int addr,
+                                    const uint16_t *values, int num,
+                                    int read_addr, int read_num)
+{
+    struct out_modbus_command *cmd;
+
+    if (command_reserve(batch, num) == -1) {
+        return -1;
+    }
+
+    cmd = &batch->commands[batch->ncommands++];
+    memset(cmd, 0, sizeof(struct out_modbus_command));
+    cmd->unit_id = unit_id;
+    cmd->fc = OUT_MODBUS_WRITE_READ;
+    cmd->addr = addr;
+    cmd->first = batch->nvalues;
+    cmd->num = num;
+    cmd->read_addr = read_addr;
+    cmd->read_num = read_num;
+
+    memcpy(batch->values + batch->nvalues, values, num * sizeof(uint16_t));
+    batch->nvalues += num;
+
+    return 0;
+}
+
+/* Entry of 'key' in the first 'mask' + 1 slots, or the free one to use */
+static inline int dedup_probe(struct out_modbus_batch *batch, uint64_t key,
+                              unsigned int mask)
+{
+    unsigned int i;
+
+    i = (unsigned int) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+    while (batch->slots[i] != -1 && batch->keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+/*
+ * Last write wins: keep one write per (unit, type, address) between two
+ * commands of the chunk, at the position of the first one and with the
+ * value of the last one. Returns the number of writes dropped, -1 when the
+ * table cannot grow.
+ */
+int out_modbus_batch_dedup(struct out_modbus_batch *batch)
+{
+    int i;
+    int n;
+    int slot;
+    unsigned int size;
+    uint64_t key;
+    uint64_t *keys;
+    int *slots;
+    struct out_modbus_write *w;
+
+    /* Load factor of 1/2 at most */
+    size = BATCH_INITIAL_SIZE;
+    while (size < (unsigned int) batch->size * 2) {
+        size *= 2;
+    }
+
+    if (size > batch->nslots) {
+        keys = flb_malloc(size * sizeof(uint64_t));
+        slots = flb_malloc(size * sizeof(int));
+        if (!keys || !slots) {
+            flb_errno();
+            flb_free(keys);
+            flb_free(slots);
+            return -1;
+        }
+        flb_free(batch->keys);
+        flb_free(batch->slots);
+        batch->keys = keys;
+        batch->slots = slots;
+        batch->nslots = size;
+    }
+
+    /* Only the part of the table this chunk needs is cleared and used */
+    memset(batch->slots, 0xff, size * sizeof(int));
+
+    n = 0;
+    for (i = 0; i < batch->size; i++) {
+        w = &batch->writes[i];
+        key = ((uint64_t) (w->unit_id + 1) << 40) |
+              ((uint64_t) w->type << 32) | (uint32_t) w->addr;
+
+        /* A write before a command does not take a later value */
+        slot = dedup_probe(batch, key, size - 1);
+        if (batch->slots[slot] != -1 &&
+            batch->writes[batch->slots[slot]].segment == w->segment) {
+            batch->writes[batch->slots[slot]].value = w->value;
+            continue;
+        }
+
+        batch->keys[slot] = key;
+        batch->slots[slot] = n;
+        batch->writes[n++] = *w;
+    }
+
+    i = batch->size - n;
+    batch->size = n;
+
+    return i;
+}
+
+static int write_compare(const void *a, const void *b)
+{
+    const struct out_modbus_write *wa = a;
+    const struct out_modbus_write *wb = b;
+
+    if (wa->unit_id != wb->unit_id) {
+        return wa->unit_id - wb->unit_id;
+    }
+    if (wa->type != wb->type) {
+        return wa->type - wb->type;
+    }
+    if (wa->addr != wb->addr) {
+        return wa->addr - wb->addr;
+    }
+    return wa->seq - wb->seq;
+}
+
+/*
+ * Send writes[0..num) which hold consecutive addresses of the same type
+ * and slave
+ */
+static int write_run(modbus_t *modbus_ctx, struct out_modbus_write *writes,
+                     int num)
+{
+    int i;
+    int rc;
+    uint8_t bits[MODBUS_MAX_WRITE_BITS];
+    uint16_t registers[MODBUS_MAX_WRITE_REGISTERS];
+
+    errno = 0;
+    if (writes[0].type == COILS) {
+        if (num == 1) {
+            rc = modbus_write_bit(modbus_ctx, writes[0].addr,
+                                  writes[0].value != 0);
+        }
+        else {
+            for (i = 0; i < num; i++) {
+                bits[i] = writes[i].value != 0;
+            }
+            rc = modbus_write_bits(modbus_ctx, writes[0].addr, num, bits);
+        }
+    }
+    else {
+        if (num == 1) {
+            rc = modbus_write_register(modbus_ctx, writes[0].addr,
+                                       writes[0].value);
+        }
+        else {
+            for (i = 0; i < num; i++) {
+                registers[i] = writes[i].value;
+            }
+            rc = modbus_write_registers(modbus_ctx, writes[0].addr, num,
+                                        registers);
+        }
+    }
+
+    return rc == num ? 0 : -1;
+}
+
+/*
+ * Send an FC22 or FC23 command. The registers FC23 reads back are left in
+ * 'read'; where they were just written they have to hold the written
+ * values, otherwise the write is reported as not confirmed.
+ */
+static int command_run(struct out_modbus_batch *batch, modbus_t *modbus_ctx,
+                       struct out_modbus_command *cmd, uint16_t *read)
+{
+    int i;
+    int idx;
+    uint16_t *values;
+
+    errno = 0;
+    if (cmd->fc == OUT_MODBUS_MASK_WRITE) {
+        return modbus_mask_write_register(modbus_ctx, cmd->addr,
+                                          cmd->and_mask,
+                                          cmd->or_mask) == -1 ? -1 : 0;
+    }
+
+    values = batch->values + cmd->first;
+    if (modbus_write_and_read_registers(modbus_ctx, cmd->addr, cmd->num,
+                                        values, cmd->read_addr,
+                                        cmd->read_num, read) != cmd->read_num) {
+        return -1;
+    }
+
+    for (i = 0; i < cmd->read_num; i++) {
+        idx = cmd->read_addr + i - cmd->addr;
+        if (idx >= 0 && idx < cmd->num && read[i] != values[idx]) {
+            flb_error("[out_modbus] Holding register %d reads %d after "
+                      "writing %d", cmd->read_addr + i, read[i], values[idx]);
+            errno = 0;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * writes[0..num) sorted, as runs of adjacent addresses, -1 on a connection
+ * error
+ */
+static int flush_writes(struct out_modbus_batch *batch,
+                        struct modbus_conn *link,
+                        struct out_modbus_write *writes, int num)
+{
+    int i;
+    int start;
+    int max;
+    int unit_id = -2;
+    int ret;
+    struct out_modbus_write *w;
+
+    if (num == 0) {
+        return 0;
+    }
+
+    qsort(writes, num, sizeof(struct out_modbus_write), write_compare);
+
+    start = 0;
+    for (i = 1; i <= num; i++) {
+        w = &writes[start];
+        max = w->type == COILS ? MODBUS_MAX_WRITE_BITS :
+                                 MODBUS_MAX_WRITE_REGISTERS;
+
+        if (i < num &&
+            writes[i].unit_id == w->unit_id &&
+            writes[i].type == w->type &&
+            writes[i].addr == writes[i - 1].addr + 1 &&
+            i - start < max) {
+            continue;
+        }
+
+        if (w->unit_id != unit_id) {
+            unit_id = w->unit_id;
+            modbus_conn_select(link, unit_id);
+        }
+
+        batch->runs++;
+        modbus_conn_pace(link);
+        ret = write_run(link->modbus_ctx, w, i - start);
+        modbus_conn_frame_end(link);
+        if (ret == -1) {
+            batch->failed_runs++;
+            if (batch->err == 0) {
+                batch->err = errno;
+            }
+            if (batch->shadow) {
+                out_modbus_shadow_forget(batch->shadow, w, i - start);
+            }
+            flb_error("[out_modbus] Error writing %d %s at address %d-%d: %s",
+                      i - start, type_str[w->type], w->addr,
+                      writes[i - 1].addr, modbus_strerror(errno));
+
+            /* Remaining runs would fail the same way */
+            if (connection_error(errno)) {
+                return -1;
+            }
+        }
+
+        start = i;
+    }
+
+    return 0;
+}
+
+/* One command, -1 on a connection error */
+static int flush_command(struct out_modbus_batch *batch,
+                         struct modbus_conn *link,
+                         struct out_modbus_command *cmd)
+{
+    int ret;
+    uint16_t read[MODBUS_MAX_WR_READ_REGISTERS];
+
+    modbus_conn_select(link, cmd->unit_id);
+
+    batch->runs++;
+    modbus_conn_pace(link);
+    ret = command_run(batch, link->modbus_ctx, cmd, read);
+    modbus_conn_frame_end(link);
+    if (batch->shadow) {
+        out_modbus_shadow_command(batch->shadow, batch, cmd, read, ret == 0);
+    }
+    if (ret == 0) {
+        return 0;
+    }
+
+    batch->failed_runs++;
+    if (batch->err == 0) {
+        batch->err = errno;
+    }
+    if (errno != 0) {
+        flb_error("[out_modbus] Error sending %s at address %d: %s",
+                  cmd->fc == OUT_MODBUS_MASK_WRITE ?
+                  "mask write" : "write/read", cmd->addr,
+                  modbus_strerror(errno));
+    }
+
+    return connection_error(errno) ? -1 : 0;
+}
+
+/*
+ * Send the pending writes and commands in chunk order. The writes between
+ * two commands are sorted by slave and sent as runs of adjacent addresses;
+ * a run is split when it reaches the PDU limit of its function code, and
+ * when the same address shows up again so later values still win. Writes
+ * the slave already holds are skipped when the batch has a shadow, as
+ * known after the commands before them. The link has to be acquired.
+ *
+ * Returns 0 when every run was written, -1 otherwise. The number of runs,
+ * failed runs and the first error are left in the batch.
+ */
+int out_modbus_batch_flush(struct out_modbus_batch *batch,
+                           struct modbus_conn *link)
+{
+    int i;
+    int start;
+    int end;
+    int num;
+
+    batch->held = 0;
+    batch->runs = 0;
+    batch->failed_runs = 0;
+    batch->err = 0;
+
+    start = 0;
+    for (i = 0; i <= batch->ncommands; i++) {
+        end = start;
+        while (end < batch->size && batch->writes[end].segment == i) {
+            end++;
+        }
+
+        num = end - start;
+        if (batch->shadow && num > 0) {
+            num = out_modbus_shadow_filter(batch->shadow,
+                                           batch->writes + start, num);
+            batch->held += end - start - num;
+        }
+
+        if (flush_writes(batch, link, batch->writes + start, num) == -1) {
+            return -1;
+        }
+        if (i < batch->ncommands &&
+            flush_command(batch, link, &batch->commands[i]) == -1) {
+            return -1;
+        }
+
+        start = end;
+    }
+
+    return batch->failed_runs > 0 ? -1 : 0;
+}
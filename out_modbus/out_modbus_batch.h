@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_OUT_MODBUS_BATCH_H
+#define FLB_OUT_MODBUS_BATCH_H
+
+#include <stdint.h>
+#include <modbus.h>
+
+#include "modbus_conn.h"
+
+struct out_modbus_shadow;
+
+/*
+ * Smallest msgpack encoding of an element that yields a write:
+ * fixmap, "address", fixint, "value", fixint.
+ */
+#define OUT_MODBUS_MIN_WRITE_SIZE 17
+
+/* A single {address, value} element taken from a record */
+struct out_modbus_write {
+    int unit_id;        /* from the record, -1 for the default slave */
+    int type;
+    int addr;
+    uint16_t value;
+    int seq;            /* position in the chunk, keeps sorting stable */
+    int segment;        /* number of commands before it in the chunk */
+};
+
+/* Commands other than plain writes, sent one by one */
+enum {
+    OUT_MODBUS_MASK_WRITE = 0,      /* FC22 */
+    OUT_MODBUS_WRITE_READ           /* FC23 */
+};
+
+/* A mask_write_registers or write_read_registers element of a record */
+struct out_modbus_command {
+    int unit_id;
+    int fc;
+    int addr;
+
+    /* FC22: register = (register & and_mask) | (or_mask & ~and_mask) */
+    uint16_t and_mask;
+    uint16_t or_mask;
+
+    /* FC23: values[first, first + num) of the batch, then a read */
+    int first;
+    int num;
+    int read_addr;
+    int read_num;
+};
+
+/*
+ * Writes collected from one chunk. Between two FC22 or FC23 commands, they
+ * are sorted and merged into runs of adjacent addresses, then sent as FC15
+ * (coils) or FC16 (holding registers) requests no longer than the protocol
+ * allows. Writes and commands go out in chunk order.
+ */
+struct out_modbus_batch {
+    struct out_modbus_write *writes;
+    int size;
+    int alloc;
+
+    /* FC22 / FC23 commands in chunk order, between the writes */
+    struct out_modbus_command *commands;
+    int ncommands;
+    int commands_alloc;
+    uint16_t *values;
+    int nvalues;
+    int values_alloc;
+
+    /*
+     * Last write wins: open addressing table from (unit, type, address)
+     * to the write holding its latest value, kept across chunks.
+     */
+    int dedup;
+    uint64_t *keys;
+    int *slots;
+    int nslots;         /* power of two, at least twice 'alloc' */
+
+    /* Values the slave holds, runs that fail are forgotten (optional) */
+    struct out_modbus_shadow *shadow;
+
+    /* Outcome of the last out_modbus_batch_flush() */
+    int held;           /* writes skipped, the slave holds their value */
+    int runs;
+    int failed_runs;
+    int err;            /* errno of the first failed run */
+};
+
+void out_modbus_batch_init(struct out_modbus_batch *batch);
+void out_modbus_batch_destroy(struct out_modbus_batch *batch);
+void out_modbus_batch_reset(struct out_modbus_batch *batch);
+int out_modbus_batch_reserve(struct out_modbus_batch *batch, int size);
+int out_modbus_batch_add(struct out_modbus_batch *batch, int unit_id,
+                         int type, int addr, uint16_t value);
+int out_modbus_batch_add_mask(struct out_modbus_batch *batch, int unit_id,
+                              int addr, uint16_t and_mask, uint16_t or_mask);
+int out_modbus_batch_add_write_read(struct out_modbus_batch *batch,
+                                    int unit_id, int addr,
+                                    const uint16_t *values, int num,
+                                    int read_addr, int read_num);
+int out_modbus_batch_dedup(struct out_modbus_batch *batch);
+int out_modbus_batch_flush(struct out_modbus_batch *batch,
+                           struct modbus_conn *link);
+
+#endif
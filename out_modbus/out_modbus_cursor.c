@@ -0,0 +1,263 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include "out_modbus_cursor.h"
+
+static inline uint64_t load_be(const unsigned char *p, int n)
+{
+    int i;
+    uint64_t v = 0;
+
+    for (i = 0; i < n; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+/* Signed integer of 'n' bytes, reported like msgpack-c does */
+static void set_int(struct out_modbus_obj *obj, const unsigned char *p, int n)
+{
+    int64_t v;
+
+    switch (n) {
+    case 1:
+        v = (int8_t) p[0];
+        break;
+    case 2:
+        v = (int16_t) load_be(p, 2);
+        break;
+    case 4:
+        v = (int32_t) load_be(p, 4);
+        break;
+    default:
+        v = (int64_t) load_be(p, 8);
+        break;
+    }
+
+    if (v < 0) {
+        obj->type = CURSOR_INT;
+        obj->i64 = v;
+    }
+    else {
+        obj->type = CURSOR_UINT;
+        obj->u64 = v;
+    }
+}
+
+/*
+ * Read the object at the cursor. Scalars, strings, bin and ext are
+ * consumed whole; for arrays and maps only the header is, the cursor then
+ * points to their first element. Returns -1 on truncated or invalid data.
+ */
+int out_modbus_cursor_next(struct out_modbus_cursor *cur,
+                           struct out_modbus_obj *obj)
+{
+    int width = 0;      /* bytes of the length or value after the tag */
+    int extra = 0;      /* ext type byte */
+    uint64_t len = 0;   /* payload bytes after the header */
+    unsigned char c;
+    const unsigned char *p = cur->p;
+    size_t avail = cur->end - p;
+
+    if (avail == 0) {
+        return -1;
+    }
+
+    c = *p++;
+    avail--;
+    obj->size = 0;
+
+    if (c <= 0x7f) {
+        obj->type = CURSOR_UINT;
+        obj->u64 = c;
+    }
+    else if (c <= 0x8f) {
+        obj->type = CURSOR_MAP;
+        obj->size = c & 0x0f;
+    }
+    else if (c <= 0x9f) {
+        obj->type = CURSOR_ARRAY;
+        obj->size = c & 0x0f;
+    }
+    else if (c <= 0xbf) {
+        obj->type = CURSOR_STR;
+        len = c & 0x1f;
+    }
+    else if (c >= 0xe0) {
+        obj->type = CURSOR_INT;
+        obj->i64 = (int8_t) c;
+    }
+    else {
+        switch (c) {
+        case 0xc0:
+            obj->type = CURSOR_NIL;
+            break;
+        case 0xc2:
+        case 0xc3:
+            obj->type = CURSOR_BOOL;
+            obj->boolean = c == 0xc3;
+            break;
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+            /* bin 8, 16, 32 */
+            obj->type = CURSOR_OTHER;
+            width = 1 << (c - 0xc4);
+            break;
+        case 0xc7:
+        case 0xc8:
+        case 0xc9:
+            /* ext 8, 16, 32 */
+            obj->type = CURSOR_OTHER;
+            width = 1 << (c - 0xc7);
+            extra = 1;
+            break;
+        case 0xca:
+        case 0xcb:
+            obj->type = CURSOR_OTHER;
+            len = c == 0xca ? 4 : 8;
+            break;
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            if (avail < (1 << (c - 0xcc))) {
+                return -1;
+            }
+            obj->type = CURSOR_UINT;
+            obj->u64 = load_be(p, 1 << (c - 0xcc));
+            p += 1 << (c - 0xcc);
+            break;
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+            if (avail < (1 << (c - 0xd0))) {
+                return -1;
+            }
+            set_int(obj, p, 1 << (c - 0xd0));
+            p += 1 << (c - 0xd0);
+            break;
+        case 0xd4:
+        case 0xd5:
+        case 0xd6:
+        case 0xd7:
+        case 0xd8:
+            /* fixext 1 to 16, type byte then data */
+            obj->type = CURSOR_OTHER;
+            len = 1 + (1 << (c - 0xd4));
+            break;
+        case 0xd9:
+        case 0xda:
+        case 0xdb:
+            obj->type = CURSOR_STR;
+            width = 1 << (c - 0xd9);
+            break;
+        case 0xdc:
+        case 0xdd:
+            obj->type = CURSOR_ARRAY;
+            width = c == 0xdc ? 2 : 4;
+            break;
+        case 0xde:
+        case 0xdf:
+            obj->type = CURSOR_MAP;
+            width = c == 0xde ? 2 : 4;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (width > 0) {
+        if (avail < width + extra) {
+            return -1;
+        }
+        len = load_be(p, width);
+        p += width;
+        if (obj->type == CURSOR_ARRAY || obj->type == CURSOR_MAP) {
+            obj->size = len;
+            len = 0;
+        }
+        else {
+            len += extra;
+        }
+    }
+
+    if (len > (size_t) (cur->end - p)) {
+        return -1;
+    }
+    if (obj->type == CURSOR_STR) {
+        obj->ptr = (const char *) p;
+        obj->size = len;
+    }
+
+    cur->p = p + len;
+    return 0;
+}
+
+/* Skip 'num' whole objects, containers with everything they hold */
+int out_modbus_cursor_skip(struct out_modbus_cursor *cur, uint64_t num)
+{
+    struct out_modbus_obj obj;
+
+    while (num > 0) {
+        if (out_modbus_cursor_next(cur, &obj) == -1) {
+            return -1;
+        }
+        num--;
+        if (obj.type == CURSOR_ARRAY) {
+            num += obj.size;
+        }
+        else if (obj.type == CURSOR_MAP) {
+            num += (uint64_t) obj.size * 2;
+        }
+    }
+
+    return 0;
+}
+
+/* Skip the elements of an array or map whose header was just read */
+int out_modbus_cursor_skip_content(struct out_modbus_cursor *cur,
+                                   const struct out_modbus_obj *obj)
+{
+    if (obj->type == CURSOR_ARRAY) {
+        return out_modbus_cursor_skip(cur, obj->size);
+    }
+    if (obj->type == CURSOR_MAP) {
+        return out_modbus_cursor_skip(cur, (uint64_t) obj->size * 2);
+    }
+
+    return 0;
+}
+
+/* Read a whole object, the content of arrays and maps is skipped */
+int out_modbus_cursor_value(struct out_modbus_cursor *cur,
+                            struct out_modbus_obj *obj)
+{
+    if (out_modbus_cursor_next(cur, obj) == -1) {
+        return -1;
+    }
+
+    return out_modbus_cursor_skip_content(cur, obj);
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_OUT_MODBUS_CURSOR_H
+#define FLB_OUT_MODBUS_CURSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    CURSOR_NIL = 0,
+    CURSOR_BOOL,
+    CURSOR_UINT,
+    CURSOR_INT,         /* negative integers only */
+    CURSOR_STR,
+    CURSOR_ARRAY,
+    CURSOR_MAP,
+    CURSOR_OTHER        /* floats, bin and ext, skipped as a whole */
+};
+
+/*
+ * One msgpack object read in place. Strings point into the chunk, arrays
+ * and maps only carry their number of elements, which follow the header.
+ */
+struct out_modbus_obj {
+    int type;
+    uint32_t size;      /* string length, array or map elements */
+    const char *ptr;
+    uint64_t u64;
+    int64_t i64;
+    int boolean;
+};
+
+/* Reads a msgpack buffer without copying or allocating anything */
+struct out_modbus_cursor {
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+static inline void out_modbus_cursor_init(struct out_modbus_cursor *cur,
+                                          const void *data, size_t size)
+{
+    cur->p = data;
+    cur->end = cur->p + size;
+}
+
+static inline int out_modbus_cursor_done(struct out_modbus_cursor *cur)
+{
+    return cur->p >= cur->end;
+}
+
+int out_modbus_cursor_next(struct out_modbus_cursor *cur,
+                           struct out_modbus_obj *obj);
+int out_modbus_cursor_skip(struct out_modbus_cursor *cur, uint64_t num);
+int out_modbus_cursor_skip_content(struct out_modbus_cursor *cur,
+                                   const struct out_modbus_obj *obj);
+int out_modbus_cursor_value(struct out_modbus_cursor *cur,
+                            struct out_modbus_obj *obj);
+
+#endif
@@ -0,0 +1,379 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_output.h>
+#include <errno.h>
+#include <string.h>
+#include <modbus.h>
+
+#include "out_modbus.h"
+#include "out_modbus_shadow.h"
+
+#define PAGE OUT_MODBUS_SHADOW_PAGE
+#define NPAGES (65536 / OUT_MODBUS_SHADOW_PAGE)
+
+static inline int valid_get(const uint64_t *valid, int i)
+{
+    return (valid[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void valid_set(uint64_t *valid, int i)
+{
+    valid[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static inline void valid_clear(uint64_t *valid, int i)
+{
+    valid[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
+
+/* Page holding 'addr', allocated on first use when 'create' is set */
+static struct out_modbus_shadow_page *page_get(struct out_modbus_shadow *shadow,
+                                               int unit_id, int type,
+                                               int addr, int create)
+{
+    struct out_modbus_shadow_slave **slave;
+    struct out_modbus_shadow_page **page;
+
+    if (addr < 0 || addr > 0xffff) {
+        return NULL;
+    }
+
+    slave = &shadow->slaves[unit_id + 1];
+    if (*slave == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        *slave = flb_calloc(1, sizeof(struct out_modbus_shadow_slave));
+        if (*slave == NULL) {
+            flb_errno();
+            return NULL;
+        }
+    }
+
+    page = &(*slave)->pages[type == COILS ? 0 : 1][addr / PAGE];
+    if (*page == NULL && create) {
+        *page = flb_calloc(1, sizeof(struct out_modbus_shadow_page));
+        if (*page == NULL) {
+            flb_errno();
+        }
+    }
+
+    return *page;
+}
+
+void out_modbus_shadow_destroy(struct out_modbus_shadow *shadow)
+{
+    int i;
+    int t;
+    int p;
+
+    for (i = 0; i < 257; i++) {
+        if (shadow->slaves[i] == NULL) {
+            continue;
+        }
+        for (t = 0; t < 2; t++) {
+            for (p = 0; p < NPAGES; p++) {
+                flb_free(shadow->slaves[i]->pages[t][p]);
+            }
+        }
+        flb_free(shadow->slaves[i]);
+        shadow->slaves[i] = NULL;
+    }
+}
+
+/* Forget every value, pages are kept for later use */
+void out_modbus_shadow_clear(struct out_modbus_shadow *shadow)
+{
+    int i;
+    int t;
+    int p;
+    struct out_modbus_shadow_page *page;
+
+    for (i = 0; i < 257; i++) {
+        if (shadow->slaves[i] == NULL) {
+            continue;
+        }
+        for (t = 0; t < 2; t++) {
+            for (p = 0; p < NPAGES; p++) {
+                page = shadow->slaves[i]->pages[t][p];
+                if (page) {
+                    memset(page->valid, 0, sizeof(page->valid));
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Drop the writes[0..num) the slave already holds, in chunk order, and
+ * move the others to the front. They are recorded as held right away; the
+ * runs that fail are forgotten again by out_modbus_batch_flush(). Returns
+ * the number of writes kept.
+ */
+int out_modbus_shadow_filter(struct out_modbus_shadow *shadow,
+                             struct out_modbus_write *writes, int num)
+{
+    int i;
+    int n;
+    int idx;
+    uint16_t value;
+    struct out_modbus_write *w;
+    struct out_modbus_shadow_page *page;
+
+    n = 0;
+    for (i = 0; i < num; i++) {
+        w = &writes[i];
+        value = w->type == COILS ? w->value != 0 : w->value;
+
+        page = page_get(shadow, w->unit_id, w->type, w->addr, FLB_TRUE);
+        if (page) {
+            idx = w->addr % PAGE;
+            if (valid_get(page->valid, idx) && page->values[idx] == value) {
+                continue;
+            }
+            page->values[idx] = value;
+            valid_set(page->valid, idx);
+        }
+
+        writes[n++] = *w;
+    }
+
+    return n;
+}
+
+/* The slave may not hold these values, e.g. their write failed */
+void out_modbus_shadow_forget(struct out_modbus_shadow *shadow,
+                              struct out_modbus_write *writes, int num)
+{
+    int i;
+    struct out_modbus_shadow_page *page;
+
+    for (i = 0; i < num; i++) {
+        page = page_get(shadow, writes[i].unit_id, writes[i].type,
+                        writes[i].addr, FLB_FALSE);
+        if (page) {
+            valid_clear(page->valid, writes[i].addr % PAGE);
+        }
+    }
+}
+
+/* Record the value of one holding register, or forget it */
+static void register_store(struct out_modbus_shadow *shadow, int unit_id,
+                           int addr, uint16_t value, int known)
+{
+    struct out_modbus_shadow_page *page;
+
+    page = page_get(shadow, unit_id, HOLDING_REGISTERS, addr, known);
+    if (!page) {
+        return;
+    }
+
+    if (known) {
+        page->values[addr % PAGE] = value;
+        valid_set(page->valid, addr % PAGE);
+    }
+    else {
+        valid_clear(page->valid, addr % PAGE);
+    }
+}
+
+/*
+ * Follow an FC22 or FC23 command sent to the slave, 'ok' when it was
+ * accepted. A masked register stays known when its value was; FC23
+ * records the written values and then what was read back.
+ */
+void out_modbus_shadow_command(struct out_modbus_shadow *shadow,
+                               struct out_modbus_batch *batch,
+                               struct out_modbus_command *cmd,
+                               const uint16_t *read, int ok)
+{
+    int i;
+    int idx;
+    uint16_t value;
+    struct out_modbus_shadow_page *page;
+
+    if (cmd->fc == OUT_MODBUS_MASK_WRITE) {
+        page = page_get(shadow, cmd->unit_id, HOLDING_REGISTERS, cmd->addr,
+                        FLB_FALSE);
+        if (!page) {
+            return;
+        }
+
+        idx = cmd->addr % PAGE;
+        if (ok && valid_get(page->valid, idx)) {
+            value = page->values[idx];
+            page->values[idx] = (value & cmd->and_mask) |
+                                (cmd->or_mask & ~cmd->and_mask);
+        }
+        else {
+            valid_clear(page->valid, idx);
+        }
+        return;
+    }
+
+    for (i = 0; i < cmd->num; i++) {
+        register_store(shadow, cmd->unit_id, cmd->addr + i,
+                       batch->values[cmd->first + i], ok);
+    }
+    if (ok) {
+        for (i = 0; i < cmd->read_num; i++) {
+            register_store(shadow, cmd->unit_id, cmd->read_addr + i,
+                           read[i], FLB_TRUE);
+        }
+    }
+}
+
+/* Read addresses [first, last] of a page back from the slave (FC1/FC3) */
+static int readback_page(modbus_t *modbus_ctx, int type, int base,
+                         struct out_modbus_shadow_page *page,
+                         int first, int last)
+{
+    int i;
+    int a;
+    int n;
+    int max;
+    uint8_t bits[PAGE];
+
+    max = type == COILS ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+
+    for (a = first; a <= last; a += n) {
+        n = last - a + 1;
+        if (n > max) {
+            n = max;
+        }
+
+        if (type == COILS) {
+            if (modbus_read_bits(modbus_ctx, base + a, n, bits) != n) {
+                return -1;
+            }
+            for (i = 0; i < n; i++) {
+                page->values[a + i] = bits[i];
+            }
+        }
+        else {
+            if (modbus_read_registers(modbus_ctx, base + a, n,
+                                      page->values + a) != n) {
+                return -1;
+            }
+        }
+
+        for (i = a; i < a + n; i++) {
+            valid_set(page->valid, i);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Bring the cache up to date before a flush, with the link acquired. The
+ * values are dropped when the connection was reopened since they were
+ * recorded, as the slave may have restarted. Every 'readback_ms', the
+ * span of known values of each page is read back from the slave.
+ * Returns -1 on a connection error.
+ */
+int out_modbus_shadow_sync(struct out_modbus_shadow *shadow,
+                           struct modbus_conn *link)
+{
+    int i;
+    int t;
+    int p;
+    int idx;
+    int first;
+    int last;
+    int ret;
+    int selected;
+    uint64_t now;
+    struct out_modbus_shadow_page *page;
+
+    if (link->opens != shadow->opens) {
+        out_modbus_shadow_clear(shadow);
+        shadow->opens = link->opens;
+    }
+
+    if (shadow->readback_ms <= 0) {
+        return 0;
+    }
+    now = modbus_conn_time_ms();
+    if (now < shadow->readback_next) {
+        return 0;
+    }
+    shadow->readback_next = now + shadow->readback_ms;
+
+    for (i = 0; i < 257; i++) {
+        if (shadow->slaves[i] == NULL) {
+            continue;
+        }
+
+        selected = FLB_FALSE;
+        for (t = 0; t < 2; t++) {
+            for (p = 0; p < NPAGES; p++) {
+                page = shadow->slaves[i]->pages[t][p];
+                if (page == NULL) {
+                    continue;
+                }
+
+                first = -1;
+                last = -1;
+                for (idx = 0; idx < PAGE; idx++) {
+                    if (valid_get(page->valid, idx)) {
+                        if (first == -1) {
+                            first = idx;
+                        }
+                        last = idx;
+                    }
+                }
+                if (first == -1) {
+                    continue;
+                }
+
+                if (!selected) {
+                    modbus_conn_select(link, i - 1);
+                    selected = FLB_TRUE;
+                }
+
+                modbus_conn_pace(link);
+                ret = readback_page(link->modbus_ctx,
+                                    t == 0 ? COILS : HOLDING_REGISTERS,
+                                    p * PAGE, page, first, last);
+                modbus_conn_frame_end(link);
+                if (ret == -1) {
+                    if (connection_error(errno)) {
+                        return -1;
+                    }
+
+                    /* Values that cannot be checked are not trusted */
+                    flb_debug("[out_modbus] Read-back of %s %d-%d failed: %s",
+                              type_str[t == 0 ? COILS : HOLDING_REGISTERS],
+                              p * PAGE + first, p * PAGE + last,
+                              modbus_strerror(errno));
+                    memset(page->valid, 0, sizeof(page->valid));
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_OUT_MODBUS_SHADOW_H
+#define FLB_OUT_MODBUS_SHADOW_H
+
+#include <stdint.h>
+
+#include "modbus_conn.h"
+#include "out_modbus_batch.h"
+
+/* Addresses per page of the cache */
+#define OUT_MODBUS_SHADOW_PAGE 256
+
+/* Known values of 256 consecutive coils or holding registers */
+struct out_modbus_shadow_page {
+    uint64_t valid[OUT_MODBUS_SHADOW_PAGE / 64];
+    uint16_t values[OUT_MODBUS_SHADOW_PAGE];
+};
+
+/* Pages of one slave, coils first, allocated on first use */
+struct out_modbus_shadow_slave {
+    struct out_modbus_shadow_page *pages[2][65536 / OUT_MODBUS_SHADOW_PAGE];
+};
+
+/*
+ * Values the slaves are known to hold, per unit id (index 0 for the
+ * default unit). Filled by successful writes and by read-backs, cleared
+ * when the connection is reopened.
+ */
+struct out_modbus_shadow {
+    struct out_modbus_shadow_slave *slaves[257];
+
+    unsigned int opens;         /* link->opens the values belong to */
+    int readback_ms;            /* 0 to never read back */
+    uint64_t readback_next;     /* monotonic ms */
+};
+
+void out_modbus_shadow_destroy(struct out_modbus_shadow *shadow);
+void out_modbus_shadow_clear(struct out_modbus_shadow *shadow);
+int out_modbus_shadow_filter(struct out_modbus_shadow *shadow,
+                             struct out_modbus_write *writes, int num);
+void out_modbus_shadow_forget(struct out_modbus_shadow *shadow,
+                              struct out_modbus_write *writes, int num);
+void out_modbus_shadow_command(struct out_modbus_shadow *shadow,
+                               struct out_modbus_batch *batch,
+                               struct out_modbus_command *cmd,
+                               const uint16_t *read, int ok);
+int out_modbus_shadow_sync(struct out_modbus_shadow *shadow,
+                           struct modbus_conn *link);
+
+#endif
@@ -0,0 +1,547 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#include <fluent-bit/flb_info.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_str.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <modbus.h>
+
+#include "out_modbus.h"
+#include "out_modbus_shadow.h"
+#include "out_modbus_target.h"
+
+static int target_add(struct flb_out_modbus_config *ctx, const char *name,
+                      int name_len, struct modbus_conn_params *params)
+{
+    struct out_modbus_target *tmp;
+    struct out_modbus_target *target;
+
+    tmp = flb_realloc(ctx->targets,
+                      (ctx->ntargets + 1) * sizeof(struct out_modbus_target));
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    ctx->targets = tmp;
+
+    target = &ctx->targets[ctx->ntargets];
+    memset(target, 0, sizeof(struct out_modbus_target));
+    out_modbus_batch_init(&target->batch);
+    target->batch.dedup = ctx->dedup;
+    ctx->ntargets++;
+
+    if (name) {
+        target->name = flb_strndup(name, name_len);
+        target->name_len = name_len;
+        if (!target->name) {
+            flb_errno();
+            return -1;
+        }
+    }
+
+    if (ctx->shadow) {
+        target->shadow = flb_calloc(1, sizeof(struct out_modbus_shadow));
+        if (!target->shadow) {
+            flb_errno();
+            return -1;
+        }
+        target->shadow->readback_ms = ctx->shadow_readback_ms;
+        target->batch.shadow = target->shadow;
+    }
+
+    /* An unreachable slave is retried in the background */
+    target->link = modbus_conn_get(params);
+    if (!target->link) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* One entry of the 'targets' list: name=address[:port] */
+static int parse_target(struct flb_out_modbus_config *ctx, char *entry,
+                        struct modbus_conn_params *params)
+{
+    char *eq;
+    char *sep;
+    struct modbus_conn_params p = *params;
+
+    eq = strchr(entry, '=');
+    if (!eq || eq == entry || eq[1] == '\0') {
+        return -1;
+    }
+    *eq = '\0';
+
+    if (out_modbus_target_find(ctx, entry, eq - entry)) {
+        flb_error("[out_modbus] Target '%s' defined twice", entry);
+        return -1;
+    }
+
+    /* Serial devices have no port */
+    p.address = eq + 1;
+    sep = strrchr(eq + 1, ':');
+    if (sep && p.backend != RTU) {
+        *sep = '\0';
+        p.port = atoi(sep + 1);
+    }
+
+    return target_add(ctx, entry, eq - entry, &p);
+}
+
+/* Send the writes of one target, may run on its own thread */
+static void target_flush(struct out_modbus_target *target)
+{
+    int ret;
+    int size;
+    struct out_modbus_batch *batch = &target->batch;
+
+    /* Only the last value written to each point goes to the slave */
+    if (batch->dedup) {
+        size = batch->size;
+        if (out_modbus_batch_dedup(batch) == -1) {
+            target->ret = FLB_RETRY;
+            return;
+        }
+        flb_debug("[out_modbus] %d writes, %d after deduplication",
+                  size, batch->size);
+    }
+
+    if (modbus_conn_acquire(target->link) == -1) {
+        target->ret = FLB_RETRY;
+        return;
+    }
+
+    if (target->shadow &&
+        out_modbus_shadow_sync(target->shadow, target->link) == -1) {
+        modbus_conn_fail(target->link, errno);
+        modbus_conn_release(target->link);
+        target->ret = FLB_RETRY;
+        return;
+    }
+
+    /* Every write of the chunk as multi-coil / multi-register runs */
+    target->ret = FLB_OK;
+    ret = out_modbus_batch_flush(batch, target->link);
+    if (batch->held > 0) {
+        flb_debug("[out_modbus] %d of %d writes skipped, already held "
+                  "by the slave", batch->held, batch->size);
+    }
+    if (ret == -1) {
+        flb_error("[out_modbus] %d of %d write runs to %s failed",
+                  batch->failed_runs, batch->runs, target->link->address);
+
+        if (connection_error(batch->err)) {
+            modbus_conn_fail(target->link, batch->err);
+            target->ret = FLB_RETRY;
+        }
+        else {
+            target->ret = FLB_ERROR;
+        }
+    }
+    modbus_conn_release(target->link);
+}
+
+/* Thread of a target, flushing its batch whenever it is handed one */
+static void *target_worker(void *data)
+{
+    struct out_modbus_target *target = data;
+
+    pthread_mutex_lock(&target->lock);
+    while (!target->stop) {
+        if (!target->busy) {
+            pthread_cond_wait(&target->cond, &target->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&target->lock);
+        target_flush(target);
+        pthread_mutex_lock(&target->lock);
+
+        target->busy = 0;
+        pthread_cond_broadcast(&target->cond);
+    }
+    pthread_mutex_unlock(&target->lock);
+
+    return NULL;
+}
+
+/*
+ * Give every target its own thread, once the list is complete. A target
+ * whose thread cannot start is flushed from the calling thread.
+ */
+static void targets_start(struct flb_out_modbus_config *ctx)
+{
+    int i;
+    struct out_modbus_target *target;
+
+    if (ctx->ntargets < 2) {
+        return;
+    }
+
+    for (i = 0; i < ctx->ntargets; i++) {
+        target = &ctx->targets[i];
+        pthread_mutex_init(&target->lock, NULL);
+        pthread_cond_init(&target->cond, NULL);
+        if (pthread_create(&target->thread, NULL, target_worker,
+                           target) == 0) {
+            target->worker = FLB_TRUE;
+        }
+        else {
+            flb_warn("[out_modbus] Cannot start the thread of a target, "
+                     "it is flushed from the engine");
+            pthread_cond_destroy(&target->cond);
+            pthread_mutex_destroy(&target->lock);
+        }
+    }
+}
+
+static void target_stop(struct out_modbus_target *target)
+{
+    if (!target->worker) {
+        return;
+    }
+
+    pthread_mutex_lock(&target->lock);
+    target->stop = FLB_TRUE;
+    pthread_cond_broadcast(&target->cond);
+    pthread_mutex_unlock(&target->lock);
+
+    pthread_join(target->thread, NULL);
+    pthread_cond_destroy(&target->cond);
+    pthread_mutex_destroy(&target->lock);
+    target->worker = FLB_FALSE;
+}
+
+/*
+ * Identity of a chunk across its retries. Only computed while chunks are
+ * being retried.
+ */
+static uint64_t chunk_hash(const void *data, size_t bytes)
+{
+    size_t i;
+    uint64_t w;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *p = data;
+
+    for (i = 0; i + 8 <= bytes; i += 8) {
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < bytes; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static void retry_destroy(struct flb_out_modbus_config *ctx,
+                          struct out_modbus_retry *retry)
+{
+    mk_list_del(&retry->_head);
+    ctx->nretries--;
+    flb_free(retry->done);
+    flb_free(retry);
+}
+
+static struct out_modbus_retry *retry_find(struct flb_out_modbus_config *ctx,
+                                           uint64_t hash, size_t bytes)
+{
+    struct mk_list *head;
+    struct out_modbus_retry *retry;
+
+    mk_list_foreach(head, &ctx->retries) {
+        retry = mk_list_entry(head, struct out_modbus_retry, _head);
+        if (retry->hash == hash && retry->bytes == bytes) {
+            return retry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Remember a chunk the engine is going to retry. The engine gives up on a
+ * chunk after its retry limit without telling the plugin, so the oldest
+ * chunks are forgotten past OUT_MODBUS_MAX_RETRIES.
+ */
+static struct out_modbus_retry *retry_add(struct flb_out_modbus_config *ctx,
+                                          uint64_t hash, size_t bytes)
+{
+    struct out_modbus_retry *retry;
+
+    if (ctx->nretries >= OUT_MODBUS_MAX_RETRIES) {
+        retry_destroy(ctx, mk_list_entry_first(&ctx->retries,
+                                               struct out_modbus_retry,
+                                               _head));
+    }
+
+    retry = flb_calloc(1, sizeof(struct out_modbus_retry));
+    if (!retry) {
+        flb_errno();
+        return NULL;
+    }
+    retry->done = flb_calloc(ctx->ntargets, 1);
+    if (!retry->done) {
+        flb_errno();
+        flb_free(retry);
+        return NULL;
+    }
+    retry->hash = hash;
+    retry->bytes = bytes;
+    retry->ret = FLB_OK;
+    mk_list_add(&retry->_head, &ctx->retries);
+    ctx->nretries++;
+
+    return retry;
+}
+
+/*
+ * Open the connection of every target: the instance 'address' for
+ * records without a "target" key, and the 'targets' list. Targets going
+ * through the same gateway share its connection.
+ */
+int out_modbus_targets_configure(struct flb_out_modbus_config *ctx,
+                                 struct flb_output_instance *in,
+                                 struct modbus_conn_params *params)
+{
+    int len;
+    char entry[300];
+    const char *str;
+    const char *end;
+
+    ctx->def_target = -1;
+    if (params->address) {
+        if (target_add(ctx, NULL, 0, params) == -1) {
+            return -1;
+        }
+        ctx->def_target = 0;
+    }
+
+    str = flb_output_get_property("targets", in);
+    while (str && *str) {
+        while (*str == ' ' || *str == ',') {
+            str++;
+        }
+        if (*str == '\0') {
+            break;
+        }
+
+        end = str;
+        while (*end && *end != ',' && *end != ' ') {
+            end++;
+        }
+
+        len = end - str;
+        if (len >= sizeof(entry)) {
+            return -1;
+        }
+        memcpy(entry, str, len);
+        entry[len] = '\0';
+
+        if (parse_target(ctx, entry, params) == -1) {
+            flb_error("[out_modbus] Invalid target '%.*s': has to be "
+                      "name=address[:port]", len, str);
+            return -1;
+        }
+        str = end;
+    }
+
+    if (ctx->ntargets == 0) {
+        flb_error("[out_modbus] Slave address unknown");
+        return -1;
+    }
+
+    targets_start(ctx);
+
+    return 0;
+}
+
+void out_modbus_targets_destroy(struct flb_out_modbus_config *ctx)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct out_modbus_target *target;
+
+    mk_list_foreach_safe(head, tmp, &ctx->retries) {
+        retry_destroy(ctx, mk_list_entry(head, struct out_modbus_retry,
+                                         _head));
+    }
+
+    for (i = 0; i < ctx->ntargets; i++) {
+        target_stop(&ctx->targets[i]);
+    }
+
+    for (i = 0; i < ctx->ntargets; i++) {
+        target = &ctx->targets[i];
+        if (target->link) {
+            modbus_conn_put(target->link);
+        }
+        out_modbus_batch_destroy(&target->batch);
+        if (target->shadow) {
+            out_modbus_shadow_destroy(target->shadow);
+            flb_free(target->shadow);
+        }
+        flb_free(target->name);
+    }
+
+    flb_free(ctx->targets);
+    ctx->targets = NULL;
+    ctx->ntargets = 0;
+}
+
+/* Target called 'name', the default one when 'name' is NULL */
+struct out_modbus_target *out_modbus_target_find(
+    struct flb_out_modbus_config *ctx, const char *name, int len)
+{
+    int i;
+
+    if (name == NULL) {
+        return ctx->def_target == -1 ? NULL : &ctx->targets[ctx->def_target];
+    }
+
+    for (i = 0; i < ctx->ntargets; i++) {
+        if (ctx->targets[i].name_len == len &&
+            memcmp(ctx->targets[i].name, name, len) == 0) {
+            return &ctx->targets[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* FLB_TRUE when at least one target is connected */
+int out_modbus_targets_up(struct flb_out_modbus_config *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->ntargets; i++) {
+        if (modbus_conn_up(ctx->targets[i].link)) {
+            return FLB_TRUE;
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/*
+ * Send the writes of every target, each target with writes on its own
+ * thread so slow gateways do not add up. The chunk is retried when a
+ * target lost its connection, and then only sent again to the targets
+ * that did not take it; it fails when a target refused a write.
+ */
+int out_modbus_targets_flush(struct flb_out_modbus_config *ctx,
+                             const void *data, size_t bytes)
+{
+    int i;
+    int ret;
+    int first = -1;
+    uint64_t hash = 0;
+    struct out_modbus_retry *retry = NULL;
+    struct out_modbus_target *target;
+
+    if (ctx->nretries > 0) {
+        hash = chunk_hash(data, bytes);
+        retry = retry_find(ctx, hash, bytes);
+    }
+
+    for (i = 0; i < ctx->ntargets; i++) {
+        target = &ctx->targets[i];
+        target->ret = FLB_OK;
+        if ((target->batch.size == 0 && target->batch.ncommands == 0) ||
+            (retry && retry->done[i])) {
+            continue;
+        }
+
+        /* The first target is sent from this thread */
+        if (first == -1) {
+            first = i;
+            continue;
+        }
+        if (target->worker) {
+            pthread_mutex_lock(&target->lock);
+            target->busy = FLB_TRUE;
+            pthread_cond_broadcast(&target->cond);
+            pthread_mutex_unlock(&target->lock);
+        }
+        else {
+            target_flush(target);
+        }
+    }
+
+    if (first != -1) {
+        target_flush(&ctx->targets[first]);
+    }
+
+    ret = retry ? retry->ret : FLB_OK;
+    for (i = 0; i < ctx->ntargets; i++) {
+        target = &ctx->targets[i];
+        if (target->worker) {
+            pthread_mutex_lock(&target->lock);
+            while (target->busy) {
+                pthread_cond_wait(&target->cond, &target->lock);
+            }
+            pthread_mutex_unlock(&target->lock);
+        }
+        if (target->ret == FLB_RETRY) {
+            ret = FLB_RETRY;
+        }
+        else if (target->ret == FLB_ERROR && ret == FLB_OK) {
+            ret = FLB_ERROR;
+        }
+    }
+
+    if (ret != FLB_RETRY) {
+        if (retry) {
+            retry_destroy(ctx, retry);
+        }
+        return ret;
+    }
+
+    /* Targets done with the chunk, whatever the outcome of their writes */
+    if (!retry) {
+        if (ctx->nretries == 0) {
+            hash = chunk_hash(data, bytes);
+        }
+        retry = retry_add(ctx, hash, bytes);
+        if (!retry) {
+            return FLB_RETRY;
+        }
+    }
+    for (i = 0; i < ctx->ntargets; i++) {
+        target = &ctx->targets[i];
+        if (target->ret == FLB_RETRY) {
+            continue;
+        }
+        retry->done[i] = 1;
+        if (target->ret == FLB_ERROR) {
+            retry->ret = FLB_ERROR;
+        }
+    }
+
+    return FLB_RETRY;
+}
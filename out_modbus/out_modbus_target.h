@@ -0,0 +1,82 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* Fluent Bit Modbus Plugin
+ * ========================
+ * Copyright (C) 2019  ARM Limited, All Rights Reserved
+ *
+ * This file is part of Fluent Bit Modbus Plugin.
+ *
+ * Fluent Bit Modbus Plugin is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Fluent Bit Modbus Plugin is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Fluent Bit Modbus Plugin. If not, see https://www.gnu.org/licenses/.
+ *
+*/
+
+#ifndef FLB_OUT_MODBUS_TARGET_H
+#define FLB_OUT_MODBUS_TARGET_H
+
+#include <fluent-bit/flb_output.h>
+#include <pthread.h>
+
+#include "modbus_conn.h"
+#include "out_modbus_batch.h"
+
+struct flb_out_modbus_config;
+
+/* A slave or gateway records are routed to, by their "target" key */
+struct out_modbus_target {
+    char *name;                 /* NULL for the instance 'address' */
+    int name_len;
+    struct modbus_conn *link;
+
+    /* Writes of the chunk being flushed, and what the slaves hold */
+    struct out_modbus_batch batch;
+    struct out_modbus_shadow *shadow;
+
+    /* Outcome of the last flush: FLB_OK, FLB_RETRY or FLB_ERROR */
+    int ret;
+
+    /* Thread flushing the target, kept while there are several targets */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int worker;                 /* started */
+    int busy;                   /* a flush was handed to it */
+    int stop;
+};
+
+/* Chunks whose retries are followed at most */
+#define OUT_MODBUS_MAX_RETRIES 64
+
+/*
+ * A chunk retried because of some targets, with the targets that already
+ * took its writes: a retry does not send them the old values again.
+ */
+struct out_modbus_retry {
+    uint64_t hash;
+    size_t bytes;
+    int ret;                    /* FLB_ERROR once a target refused writes */
+    char *done;                 /* per target */
+    struct mk_list _head;
+};
+
+int out_modbus_targets_configure(struct flb_out_modbus_config *ctx,
+                                 struct flb_output_instance *in,
+                                 struct modbus_conn_params *params);
+void out_modbus_targets_destroy(struct flb_out_modbus_config *ctx);
+struct out_modbus_target *out_modbus_target_find(
+    struct flb_out_modbus_config *ctx, const char *name, int len);
+int out_modbus_targets_up(struct flb_out_modbus_config *ctx);
+int out_modbus_targets_flush(struct flb_out_modbus_config *ctx,
+                             const void *data, size_t bytes);
+
+#endif